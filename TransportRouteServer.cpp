@@ -9,9 +9,75 @@
 #include <ctime>
 #include <sstream>
 #include <iomanip>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <cmath>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <tuple>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HUB_LABELS_SSE2 1
+#endif
 
 using namespace std;
 
+// Global heap allocation counter, read by --bench to report allocations per
+// query. Counting replaces the global allocator, so only benchmark builds
+// (-DTRANSIT_COUNT_ALLOCATIONS) turn it on; other builds report no counts.
+atomic<uint64_t> heapAllocationCount(0);
+
+#ifdef TRANSIT_COUNT_ALLOCATIONS
+const bool COUNTING_ALLOCATIONS = true;
+
+// Kept out of line: inlined into a caller, malloc() and free() look
+// mismatched with new and delete to GCC's -Wmismatched-new-delete
+#if defined(__GNUC__)
+#define TRANSIT_NOINLINE __attribute__((noinline))
+#else
+#define TRANSIT_NOINLINE
+#endif
+
+TRANSIT_NOINLINE void* operator new(size_t size) {
+    heapAllocationCount.fetch_add(1, memory_order_relaxed);
+    void* block = malloc(size == 0 ? 1 : size);
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+TRANSIT_NOINLINE void operator delete(void* block) noexcept {
+    free(block);
+}
+
+TRANSIT_NOINLINE void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+#else
+const bool COUNTING_ALLOCATIONS = false;
+#endif
+
 struct Edge {
     string to;
     double distance;
@@ -19,383 +85,7526 @@ struct Edge {
     string bus;
 };
 
-class Graph {
+const uint32_t NO_STOP = UINT32_MAX;
+const uint32_t NO_EDGE = UINT32_MAX;
+const uint32_t NO_BUS = UINT32_MAX;
+
+// Read-only view of one stop's outgoing edge ids in a CompactGraph.
+// Iterating it walks an index range, so it never copies or allocates.
+struct EdgeRange {
+    struct iterator {
+        uint32_t edge;
+
+        uint32_t operator*() const { return edge; }
+        iterator& operator++() { edge++; return *this; }
+        bool operator!=(const iterator& other) const { return edge != other.edge; }
+    };
+
+    uint32_t first;
+    uint32_t last;
+
+    iterator begin() const { return iterator{ first }; }
+    iterator end() const { return iterator{ last }; }
+    uint32_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+};
+
+// Read-only view of a run of edge ids stored in an array, such as a stop's
+// incoming edges in the reverse CSR
+struct EdgeIdList {
+    const uint32_t* first;
+    const uint32_t* last;
+
+    const uint32_t* begin() const { return first; }
+    const uint32_t* end() const { return last; }
+    uint32_t size() const { return (uint32_t)(last - first); }
+};
+
+const uint32_t MAX_LANDMARKS = 16;
+const uint32_t DEFAULT_LANDMARKS = 8;
+
+// ALT preprocessing: exact distance and fare tables from and to a few landmark
+// stops. Tables are stop-major (entry stop * landmarks.size() + i) so one stop's
+// values sit together; unreachable pairs hold numeric_limits<>::max().
+struct LandmarkIndex {
+    vector<uint32_t> landmarks;
+    vector<double> distanceFrom;
+    vector<double> distanceTo;
+    vector<int> fareFrom;
+    vector<int> fareTo;
+    double preprocessingMs = 0;
+
+    size_t memoryBytes() const {
+        return landmarks.size() * sizeof(uint32_t) +
+            (distanceFrom.size() + distanceTo.size()) * sizeof(double) +
+            (fareFrom.size() + fareTo.size()) * sizeof(int);
+    }
+};
+
+// One arc of a contraction hierarchy: either an original edge, or a shortcut
+// standing for the arcs firstChild (from -> middle) and secondChild (middle -> to)
+struct HierarchyArc {
+    uint32_t edge;
+    uint32_t firstChild;
+    uint32_t secondChild;
+};
+
+// Contraction hierarchy for one metric. Each stop gets a rank; a query only ever
+// moves to higher-ranked stops. upwardArcs lists, per stop, the arcs u -> v with
+// rank v > rank u (used by the forward search); downwardArcs lists, per stop, the
+// arcs v -> u with rank v > rank u, stored at u and walked from u to v by the
+// backward search. Both are CSR arrays holding the other end, cost and arc id.
+template <class Weight>
+struct ContractionHierarchy {
+    vector<uint32_t> rank;
+    vector<HierarchyArc> arcs;
+
+    vector<uint32_t> upwardOffsets;
+    vector<uint32_t> upwardTargets;
+    vector<Weight> upwardCosts;
+    vector<uint32_t> upwardArcIds;
+
+    vector<uint32_t> downwardOffsets;
+    vector<uint32_t> downwardTargets;
+    vector<Weight> downwardCosts;
+    vector<uint32_t> downwardArcIds;
+
+    uint32_t shortcutCount = 0;
+    double preprocessingMs = 0;
+
+    bool empty() const {
+        return rank.empty();
+    }
+
+    size_t memoryBytes() const {
+        return rank.size() * sizeof(uint32_t) + arcs.size() * sizeof(HierarchyArc) +
+            (upwardOffsets.size() + upwardTargets.size() + upwardArcIds.size() +
+                downwardOffsets.size() + downwardTargets.size() + downwardArcIds.size()) * sizeof(uint32_t) +
+            (upwardCosts.size() + downwardCosts.size()) * sizeof(Weight);
+    }
+};
+
+// Hub labels (2-hop labeling) derived from one contraction hierarchy. The
+// forward label of a stop lists the hubs it reaches upwards with their costs;
+// the backward label lists the hubs that reach it. cost(s, t) is the minimum
+// of forward(s) + backward(t) over the hubs the two labels share. Labels are
+// sorted by hub id. For path recovery a forward entry also keeps the last
+// hierarchy arc into its hub and the stop that arc leaves, and a backward
+// entry the first arc out of its hub and the stop it enters.
+template <class Weight>
+struct HubLabels {
+    vector<uint32_t> forwardOffsets;
+    vector<uint32_t> forwardHubs;
+    vector<Weight> forwardCosts;
+    vector<uint32_t> forwardNextStops;
+    vector<uint32_t> forwardArcs;
+
+    vector<uint32_t> backwardOffsets;
+    vector<uint32_t> backwardHubs;
+    vector<Weight> backwardCosts;
+    vector<uint32_t> backwardNextStops;
+    vector<uint32_t> backwardArcs;
+
+    // The hierarchy the labels were built from, which unpacks their arcs
+    shared_ptr<const ContractionHierarchy<Weight>> hierarchy;
+    uint64_t fingerprint = 0;
+    double preprocessingMs = 0;
+    bool loadedFromDisk = false;
+
+    size_t entryCount() const {
+        return forwardHubs.size() + backwardHubs.size();
+    }
+
+    size_t memoryBytes() const {
+        return (forwardOffsets.size() + backwardOffsets.size()) * sizeof(uint32_t) +
+            entryCount() * (3 * sizeof(uint32_t) + sizeof(Weight));
+    }
+};
+
+// Metric-independent half of a customizable contraction hierarchy. Stops are
+// eliminated in nested dissection order over the undirected topology, and
+// eliminating a stop joins all of its remaining neighbours, so every lower
+// triangle exists and any metric can be applied later without witness
+// searches. Each undirected arc is stored once, at its lower-ranked end; its id
+// is its slot in upwardTargets.
+struct CustomizableHierarchy {
+    vector<uint32_t> rank;
+
+    // Higher neighbours of each stop, sorted by stop id
+    vector<uint32_t> upwardOffsets;
+    vector<uint32_t> upwardTargets;
+
+    // Lower neighbours of each stop, sorted by stop id, with the arc ids
+    vector<uint32_t> downwardOffsets;
+    vector<uint32_t> downwardSources;
+    vector<uint32_t> downwardArcIds;
+
+    // The arc each original edge lies on, NO_EDGE for self-loops
+    vector<uint32_t> edgeArcs;
+
+    // Stops grouped by level, one above their highest lower neighbour; arcs
+    // of stops on one level never depend on each other during customization
+    vector<uint32_t> levelOffsets;
+    vector<uint32_t> levelStops;
+
+    double preprocessingMs = 0;
+
+    uint32_t arcCount() const {
+        return (uint32_t)upwardTargets.size();
+    }
+
+    size_t memoryBytes() const {
+        return (rank.size() + upwardOffsets.size() + upwardTargets.size() + downwardOffsets.size() +
+            downwardSources.size() + downwardArcIds.size() + edgeArcs.size() +
+            levelOffsets.size() + levelStops.size()) * sizeof(uint32_t);
+    }
+};
+
+// Epoch-based reclamation for versions that readers use without locks. A
+// reader announces the global epoch in its own slot for as long as it holds
+// a version; a writer that replaces a version retires the old one tagged with
+// the epoch it then closes, and frees it once every busy slot announces a
+// later epoch, since those readers can only have loaded the newer version.
+class EpochDomain {
 public:
-    unordered_map<string, vector<Edge>> adjacencyList;
+    static EpochDomain& instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    // Pins nest; only the outermost one announces an epoch
+    void enter() {
+        ReaderSlot& slot = slotForThisThread();
+        if (slot.depth++ == 0) {
+            slot.epoch.store(globalEpoch.load());
+        }
+    }
+
+    void exit() {
+        ReaderSlot& slot = slotForThisThread();
+        if (--slot.depth == 0) {
+            slot.epoch.store(IDLE);
+        }
+    }
+
+    // Hand over a replaced version; it is freed once no reader can hold it
+    void retire(shared_ptr<const void> version) {
+        lock_guard<mutex> lock(retiredGuard);
+        retired.push_back(make_pair(globalEpoch.fetch_add(1), move(version)));
+        reclaim();
+    }
+
+    size_t retiredCount() {
+        lock_guard<mutex> lock(retiredGuard);
+        reclaim();
+        return retired.size();
+    }
+
+private:
+    static const uint64_t IDLE = UINT64_MAX;
+
+    // One per thread that ever read, kept on a list that only grows; a thread
+    // that exits frees its slot for the next new thread
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{ IDLE };
+        atomic<bool> claimed{ false };
+        uint32_t depth = 0;
+        ReaderSlot* next = nullptr;
+    };
+
+    struct SlotOwner {
+        ReaderSlot* slot = nullptr;
+        ~SlotOwner() {
+            if (slot) slot->claimed.store(false);
+        }
+    };
+
+    atomic<uint64_t> globalEpoch{ 1 };
+    atomic<ReaderSlot*> slots{ nullptr };
+    mutex retiredGuard;
+    vector<pair<uint64_t, shared_ptr<const void>>> retired;
+
+    ReaderSlot& slotForThisThread() {
+        thread_local SlotOwner owner;
+        if (owner.slot) {
+            return *owner.slot;
+        }
+
+        for (ReaderSlot* slot = slots.load(); slot; slot = slot->next) {
+            bool expected = false;
+            if (slot->claimed.compare_exchange_strong(expected, true)) {
+                owner.slot = slot;
+                return *slot;
+            }
+        }
+
+        ReaderSlot* slot = new ReaderSlot();
+        slot->claimed.store(true);
+        slot->next = slots.load();
+        while (!slots.compare_exchange_weak(slot->next, slot)) {}
+        owner.slot = slot;
+        return *slot;
+    }
+
+    // Called with retiredGuard held
+    void reclaim() {
+        uint64_t oldestReader = IDLE;
+        for (ReaderSlot* slot = slots.load(); slot; slot = slot->next) {
+            oldestReader = min(oldestReader, slot->epoch.load());
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].first >= oldestReader) {
+                retired[kept++] = move(retired[i]);
+            }
+        }
+        retired.resize(kept);
+    }
+};
+
+// The current version of a value that readers share and writers replace whole.
+// Readers pin the version they load without taking a lock or touching a shared
+// count; a writer publishes a new version with one atomic swap and the old one
+// is freed through the epoch domain once the last reader that pinned it is done.
+template <class T>
+class Published {
+public:
+    class Pin {
+    public:
+        explicit Pin(const Published& source) {
+            EpochDomain::instance().enter();
+            version = source.current.load();
+        }
+
+        Pin(Pin&& other) : version(other.version), active(other.active) {
+            other.active = false;
+        }
+
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+
+        ~Pin() {
+            if (active) EpochDomain::instance().exit();
+        }
+
+        const T& operator*() const { return *version; }
+        const T* operator->() const { return version; }
+
+    private:
+        const T* version = nullptr;
+        bool active = true;
+    };
+
+    Published() {}
+    Published(const Published&) = delete;
+    Published& operator=(const Published&) = delete;
+
+    Pin pin() const {
+        return Pin(*this);
+    }
+
+    bool empty() const {
+        return current.load() == nullptr;
+    }
+
+    // Writers are expected to be serialized by the caller
+    void store(shared_ptr<const T> next) {
+        current.store(next.get());
+        owner.swap(next);
+        if (next) EpochDomain::instance().retire(move(next));
+    }
+
+private:
+    atomic<const T*> current{ nullptr };
+    shared_ptr<const T> owner;
+};
+
+const uint32_t NO_TRIP = UINT32_MAX;
+
+// Scheduled service laid out for RAPTOR. A route is a group of trips that run
+// one bus over the same stops without overtaking each other; its stop times
+// are stored trip by trip, so scanning a route reads memory in order. Trip ids
+// are global: route r owns [routeTripOffsets[r], routeTripOffsets[r + 1]).
+struct Timetable {
+    vector<uint32_t> routeStopOffsets;
+    vector<uint32_t> routeStops;
+    vector<uint32_t> routeBusIds;
+    vector<uint32_t> routeTripOffsets;
+    vector<uint32_t> routeTimeOffsets;
+    vector<int> arrivals;
+    vector<int> departures;
+
+    // Routes serving each stop, with the stop's position along each of them
+    vector<uint32_t> stopRouteOffsets;
+    vector<uint32_t> stopRoutes;
+    vector<uint32_t> stopRoutePositions;
+
+    // Walking links: static edges short enough to walk, with their walking time
+    vector<uint32_t> footpathOffsets;
+    vector<uint32_t> footpathEdges;
+    vector<int> footpathSeconds;
+
+    // Every hop of every trip between consecutive stops, sorted by departure
+    // for the Connection Scan Algorithm, with the route of each trip
+    vector<int> connectionDepartures;
+    vector<int> connectionArrivals;
+    vector<uint32_t> connectionFromStops;
+    vector<uint32_t> connectionToStops;
+    vector<uint32_t> connectionTrips;
+    vector<uint32_t> connectionPositions;
+    vector<uint32_t> tripRoutes;
+
+    uint32_t routeCount() const {
+        return (uint32_t)routeBusIds.size();
+    }
+
+    uint32_t tripCount() const {
+        return routeTripOffsets.empty() ? 0 : routeTripOffsets.back();
+    }
+
+    uint32_t routeLength(uint32_t route) const {
+        return routeStopOffsets[route + 1] - routeStopOffsets[route];
+    }
+
+    size_t timeIndex(uint32_t route, uint32_t trip, uint32_t position) const {
+        return routeTimeOffsets[route] + (size_t)(trip - routeTripOffsets[route]) * routeLength(route) + position;
+    }
+
+    size_t memoryBytes() const {
+        return (routeStopOffsets.size() + routeStops.size() + routeBusIds.size() + routeTripOffsets.size() +
+            routeTimeOffsets.size() + stopRouteOffsets.size() + stopRoutes.size() + stopRoutePositions.size() +
+            footpathOffsets.size() + footpathEdges.size() + connectionFromStops.size() + connectionToStops.size() +
+            connectionTrips.size() + connectionPositions.size() + tripRoutes.size()) * sizeof(uint32_t) +
+            (arrivals.size() + departures.size() + footpathSeconds.size() + connectionDepartures.size() +
+            connectionArrivals.size()) * sizeof(int);
+    }
+};
+
+// Frozen compressed-sparse-row copy of the network that the searches run on.
+// Stops and bus names are interned to dense ids, and the outgoing edges of
+// stop s are the indices [edgeOffsets[s], edgeOffsets[s + 1]) of the edge arrays.
+// The reverse CSR lists, for every stop, the ids of the edges that enter it,
+// so backward searches also work once directed edges exist.
+struct CompactGraph {
     vector<string> stopNames;
+    unordered_map<string, uint32_t> stopIds;
+    vector<string> busNames;
 
-    void addStop(string name) {
-        if (adjacencyList.find(name) != adjacencyList.end()) {
-            cout << "[!] Stop already exists: " << name << endl;
-            return;
+    vector<uint32_t> edgeOffsets;
+    vector<uint32_t> edgeTargets;
+    vector<double> edgeDistances;
+    vector<int> edgeFares;
+    vector<uint32_t> edgeBusIds;
+    vector<uint32_t> edgeSources;
+
+    vector<uint32_t> reverseOffsets;
+    vector<uint32_t> reverseEdges;
+
+    // Route-expanded states for transfer-aware search: one per (stop, bus
+    // arriving there) pair, numbered stop by stop. edgeStates is the state an
+    // edge arrives in, so the expanded graph needs no edges of its own.
+    vector<uint32_t> stateStops;
+    vector<uint32_t> stateBuses;
+    vector<uint32_t> edgeStates;
+
+    // Stop coordinates in degrees (NaN when unknown) and as x/y/z triples on the
+    // unit sphere. minKmPerGreatCircleKm is the smallest edge distance per
+    // great-circle km over the network, or 0 when any stop lacks coordinates
+    // and no geometric bound can be trusted.
+    vector<double> stopLatitudes;
+    vector<double> stopLongitudes;
+    vector<double> stopPositions;
+    double minKmPerGreatCircleKm = 0;
+
+    // Distance is fixed by the topology and gets a witness-pruned hierarchy;
+    // fares change on their own and are customized onto the shared order
+    LandmarkIndex landmarks;
+    shared_ptr<const ContractionHierarchy<double>> distanceHierarchy;
+    CustomizableHierarchy customizable;
+    shared_ptr<const ContractionHierarchy<int>> fareHierarchy;
+
+    // Optional hub-label indexes; null when disabled or over the memory budget
+    shared_ptr<const HubLabels<double>> distanceLabels;
+    shared_ptr<const HubLabels<int>> fareLabels;
+
+    // Scheduled trips laid out for RAPTOR; empty when no trips were added
+    Timetable timetable;
+
+    // Publication number of this version, counting from 1
+    uint64_t version = 0;
+
+    uint32_t stopCount() const {
+        return (uint32_t)stopNames.size();
+    }
+
+    uint32_t edgeCount() const {
+        return (uint32_t)edgeTargets.size();
+    }
+
+    uint32_t stateCount() const {
+        return (uint32_t)stateStops.size();
+    }
+
+    EdgeRange neighbors(uint32_t stop) const {
+        return EdgeRange{ edgeOffsets[stop], edgeOffsets[stop + 1] };
+    }
+
+    EdgeIdList incoming(uint32_t stop) const {
+        const uint32_t* base = reverseEdges.data();
+        return EdgeIdList{ base + reverseOffsets[stop], base + reverseOffsets[stop + 1] };
+    }
+
+    uint32_t findStop(const string& name) const {
+        auto found = stopIds.find(name);
+        if (found == stopIds.end()) {
+            return NO_STOP;
         }
+        return found->second;
+    }
+};
 
-        vector<Edge> emptyRouteList;
-        adjacencyList[name] = emptyRouteList;
-        stopNames.push_back(name);
-        cout << "[+] Added stop: " << name << endl;
+const double EARTH_RADIUS_KM = 6371.0;
+const double DEGREES_TO_RADIANS = 3.14159265358979323846 / 180.0;
+
+// Haversine great-circle distance between two points given in degrees
+double greatCircleKm(double latitude1, double longitude1, double latitude2, double longitude2) {
+    double halfLatitudeDelta = (latitude2 - latitude1) * DEGREES_TO_RADIANS / 2;
+    double halfLongitudeDelta = (longitude2 - longitude1) * DEGREES_TO_RADIANS / 2;
+    double a = sin(halfLatitudeDelta) * sin(halfLatitudeDelta) +
+        cos(latitude1 * DEGREES_TO_RADIANS) * cos(latitude2 * DEGREES_TO_RADIANS) *
+        sin(halfLongitudeDelta) * sin(halfLongitudeDelta);
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(min(1.0, a)));
+}
+
+// Cost policies for the Dijkstra engine. Each names its weight type and the cost
+// of one edge, so runDijkstra<Policy> compiles into a loop specialized for it.
+// The weight type also picks the queue: integer policies get a radix heap.
+struct DistanceCost {
+    typedef double Weight;
+
+    Weight edgeCost(const CompactGraph& network, uint32_t edge) const {
+        return network.edgeDistances[edge];
+    }
+};
+
+struct FareCost {
+    typedef int Weight;
+
+    Weight edgeCost(const CompactGraph& network, uint32_t edge) const {
+        return network.edgeFares[edge];
+    }
+};
+
+// Fewest stops: every edge costs one hop
+struct HopCost {
+    typedef int Weight;
+
+    Weight edgeCost(const CompactGraph&, uint32_t) const {
+        return 1;
+    }
+};
+
+// Weighted blend of kilometres and rupees; by default Rs. 5 counts as 1 km
+struct BlendedCost {
+    typedef double Weight;
+
+    double distanceWeight = 1.0;
+    double fareWeight = 0.2;
+
+    Weight edgeCost(const CompactGraph& network, uint32_t edge) const {
+        return distanceWeight * network.edgeDistances[edge] + fareWeight * network.edgeFares[edge];
+    }
+};
+
+// Lower bounds on the remaining cost to the target, added to the heap key.
+// ZeroHeuristic turns the engine into plain Dijkstra.
+struct ZeroHeuristic {
+    ZeroHeuristic(const CompactGraph&, uint32_t) {}
+
+    int estimate(uint32_t) const {
+        return 0;
+    }
+};
+
+// Distance to the target scaled by the network's minimum km per great-circle km.
+// It uses the chord through the sphere, which never exceeds the great-circle
+// arc and needs no trigonometry per stop. No edge beats the scale ratio, so the
+// bound is admissible and consistent for DistanceCost.
+struct GreatCircleHeuristic {
+    const double* positions;
+    double targetX;
+    double targetY;
+    double targetZ;
+    double scale;
+
+    GreatCircleHeuristic(const CompactGraph& network, uint32_t targetId)
+        : positions(network.stopPositions.data()), targetX(0), targetY(0), targetZ(0), scale(0) {
+        if (targetId != NO_STOP && network.minKmPerGreatCircleKm > 0) {
+            targetX = positions[3 * targetId];
+            targetY = positions[3 * targetId + 1];
+            targetZ = positions[3 * targetId + 2];
+            scale = network.minKmPerGreatCircleKm * EARTH_RADIUS_KM;
+        }
+    }
+
+    double estimate(uint32_t stop) const {
+        if (scale == 0) {
+            return 0;
+        }
+        double dx = positions[3 * stop] - targetX;
+        double dy = positions[3 * stop + 1] - targetY;
+        double dz = positions[3 * stop + 2] - targetZ;
+        return scale * sqrt(dx * dx + dy * dy + dz * dz);
+    }
+};
+
+inline const vector<double>& landmarkFromTable(const LandmarkIndex& index, const DistanceCost&) { return index.distanceFrom; }
+inline const vector<double>& landmarkToTable(const LandmarkIndex& index, const DistanceCost&) { return index.distanceTo; }
+inline const vector<int>& landmarkFromTable(const LandmarkIndex& index, const FareCost&) { return index.fareFrom; }
+inline const vector<int>& landmarkToTable(const LandmarkIndex& index, const FareCost&) { return index.fareTo; }
+
+// ALT bound from the triangle inequality over every landmark L:
+// cost(v, t) >= cost(L, t) - cost(L, v) and cost(v, t) >= cost(v, L) - cost(t, L).
+// The target's own table entries are copied out once per query.
+template <class CostPolicy>
+struct LandmarkHeuristic {
+    typedef typename CostPolicy::Weight Weight;
+
+    const Weight* fromTable;
+    const Weight* toTable;
+    uint32_t landmarkCount;
+    Weight targetFrom[MAX_LANDMARKS];
+    Weight targetTo[MAX_LANDMARKS];
+
+    LandmarkHeuristic(const CompactGraph& network, uint32_t targetId)
+        : fromTable(landmarkFromTable(network.landmarks, CostPolicy()).data()),
+        toTable(landmarkToTable(network.landmarks, CostPolicy()).data()),
+        landmarkCount(targetId == NO_STOP ? 0 : (uint32_t)network.landmarks.landmarks.size()) {
+        for (uint32_t i = 0; i < landmarkCount; i++) {
+            targetFrom[i] = fromTable[(size_t)targetId * landmarkCount + i];
+            targetTo[i] = toTable[(size_t)targetId * landmarkCount + i];
+        }
+    }
+
+    Weight estimate(uint32_t stop) const {
+        const Weight INFINITY_VALUE = numeric_limits<Weight>::max();
+        const Weight* stopFrom = fromTable + (size_t)stop * landmarkCount;
+        const Weight* stopTo = toTable + (size_t)stop * landmarkCount;
+        Weight bound = 0;
+
+        for (uint32_t i = 0; i < landmarkCount; i++) {
+            if (stopFrom[i] != INFINITY_VALUE && targetFrom[i] != INFINITY_VALUE && targetFrom[i] - stopFrom[i] > bound) {
+                bound = targetFrom[i] - stopFrom[i];
+            }
+            if (stopTo[i] != INFINITY_VALUE && targetTo[i] != INFINITY_VALUE && stopTo[i] - targetTo[i] > bound) {
+                bound = stopTo[i] - targetTo[i];
+            }
+        }
+
+        return bound;
+    }
+};
+
+// Edge directions for the engine. Backward searches walk incoming edges, so the
+// costs they compute are costs *to* the root stop.
+struct ForwardSearch {
+    static EdgeRange edges(const CompactGraph& network, uint32_t stop) { return network.neighbors(stop); }
+    static uint32_t otherEnd(const CompactGraph& network, uint32_t edge) { return network.edgeTargets[edge]; }
+};
+
+struct BackwardSearch {
+    static EdgeIdList edges(const CompactGraph& network, uint32_t stop) { return network.incoming(stop); }
+    static uint32_t otherEnd(const CompactGraph& network, uint32_t edge) { return network.edgeSources[edge]; }
+};
+
+// Work done by the latest search on this thread; /route results and --bench report it
+struct SearchStats {
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+};
+
+thread_local SearchStats searchStats;
+
+// Number of bits needed to write value, 0 for 0
+inline int bitWidth(uint32_t value) {
+#if defined(__GNUC__)
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+#else
+    int width = 0;
+    for (; value != 0; value >>= 1) width++;
+    return width;
+#endif
+}
+
+// Binary min-heap of (key, stop) pairs
+template <class Weight>
+struct BinaryHeap {
+    vector<pair<Weight, uint32_t>> items;
+
+    void clear() { items.clear(); }
+    bool empty() const { return items.empty(); }
+    const pair<Weight, uint32_t>& top() { return items.front(); }
+
+    void push(Weight key, uint32_t stop) {
+        items.push_back(make_pair(key, stop));
+        push_heap(items.begin(), items.end(), greater<pair<Weight, uint32_t>>());
+    }
+
+    pair<Weight, uint32_t> pop() {
+        pop_heap(items.begin(), items.end(), greater<pair<Weight, uint32_t>>());
+        pair<Weight, uint32_t> smallest = items.back();
+        items.pop_back();
+        return smallest;
+    }
+};
+
+// Radix heap for non-negative integer keys that never drop below the last key
+// popped, which holds for Dijkstra and for A* with a consistent heuristic. A
+// key sits in the bucket numbered by the highest bit where it differs from
+// that last key; only emptying bucket 0 looks at the rest, moving each key to
+// a lower bucket, so push is O(1) and pop amortized O(log C) for keys up to C.
+template <class Weight>
+struct RadixHeap {
+    static const int BUCKETS = 33;
+
+    vector<pair<Weight, uint32_t>> buckets[BUCKETS];
+    Weight last = 0;
+    size_t count = 0;
+
+    void clear() {
+        for (vector<pair<Weight, uint32_t>>& bucket : buckets) bucket.clear();
+        last = 0;
+        count = 0;
+    }
+
+    bool empty() const { return count == 0; }
+
+    const pair<Weight, uint32_t>& top() {
+        if (buckets[0].empty()) refill();
+        return buckets[0].back();
+    }
+
+    void push(Weight key, uint32_t stop) {
+        // A key below the last pop would break monotonicity; it can only come
+        // from an inconsistent heuristic, and goes out next
+        buckets[bucketOf(max(key, last))].push_back(make_pair(key, stop));
+        count++;
+    }
+
+    pair<Weight, uint32_t> pop() {
+        if (buckets[0].empty()) refill();
+        pair<Weight, uint32_t> smallest = buckets[0].back();
+        buckets[0].pop_back();
+        count--;
+        return smallest;
+    }
+
+    int bucketOf(Weight key) const {
+        return bitWidth(uint32_t(key) ^ uint32_t(last));
+    }
+
+    // Move the smallest key up to last and spread its bucket over lower ones
+    void refill() {
+        int first = 1;
+        while (buckets[first].empty()) first++;
+
+        vector<pair<Weight, uint32_t>>& bucket = buckets[first];
+        last = bucket[0].first;
+        for (const pair<Weight, uint32_t>& item : bucket) {
+            last = min(last, item.first);
+        }
+        for (const pair<Weight, uint32_t>& item : bucket) {
+            buckets[bucketOf(item.first)].push_back(item);
+        }
+        bucket.clear();
+    }
+};
+
+// Queue the Dijkstra engine uses for a cost policy's weight type: integer
+// costs (fares, hops) get the radix heap, everything else the binary heap
+template <class Weight>
+struct SearchQueue {
+    typedef BinaryHeap<Weight> Type;
+};
+
+template <>
+struct SearchQueue<int> {
+    typedef RadixHeap<int> Type;
+};
+
+// Predecessor labels of one search, indexed by stop id. A stop's label is only
+// valid while its stamp equals the current generation, so starting a new query
+// bumps the generation instead of clearing O(V) entries.
+struct SearchLabels {
+    vector<uint32_t> stamp;
+    vector<uint32_t> previousStop;
+    vector<uint32_t> previousEdge;
+    uint32_t generation = 0;
+
+    void beginLabels(uint32_t stopCount) {
+        if (stamp.size() < stopCount) {
+            stamp.resize(stopCount, 0);
+            previousStop.resize(stopCount, NO_STOP);
+            previousEdge.resize(stopCount, NO_EDGE);
+        }
+
+        generation++;
+        if (generation == 0) {
+            // Stamps wrapped around: clear them once and start over
+            fill(stamp.begin(), stamp.end(), 0);
+            generation = 1;
+        }
+    }
+
+    bool reached(uint32_t stop) const {
+        return stamp[stop] == generation;
+    }
+};
+
+// Per-thread scratch space for the Dijkstra engine: labels, best costs and a
+// heap whose capacity survives between queries, so steady-state searches
+// touch only the stops they reach and do not allocate.
+template <class Weight>
+struct SearchWorkspace : SearchLabels {
+    vector<Weight> bestCost;
+    typename SearchQueue<Weight>::Type heap;
+
+    void begin(uint32_t stopCount) {
+        beginLabels(stopCount);
+        if (bestCost.size() < stopCount) {
+            bestCost.resize(stopCount);
+        }
+        heap.clear();
+    }
+
+    Weight costOf(uint32_t stop) const {
+        return reached(stop) ? bestCost[stop] : numeric_limits<Weight>::max();
+    }
+
+    void setLabel(uint32_t stop, Weight cost, uint32_t fromStop, uint32_t viaEdge) {
+        stamp[stop] = generation;
+        bestCost[stop] = cost;
+        previousStop[stop] = fromStop;
+        previousEdge[stop] = viaEdge;
+    }
+
+    void pushHeap(Weight cost, uint32_t stop) {
+        heap.push(cost, stop);
+    }
+
+    pair<Weight, uint32_t> popHeap() {
+        return heap.pop();
+    }
+
+    // Bidirectional searches use side 0 forwards and side 1 backwards
+    static SearchWorkspace& forThisThread(int side = 0) {
+        thread_local SearchWorkspace workspaces[2];
+        return workspaces[side];
+    }
+};
+
+// Edge filter for searches that may use the whole network
+struct AllEdges {
+    bool allows(uint32_t, uint32_t) const {
+        return true;
+    }
+};
+
+// Dijkstra over the CSR graph for any cost policy. Leaves the best cost and
+// predecessor stop/edge of every reached stop in workspace. The search stops as
+// soon as targetId is settled; pass NO_STOP to settle the whole network. A
+// non-zero heuristic orders the heap by cost plus estimate, which makes it A*.
+// Edges the filter rejects (given the edge and the stop it leads to) are skipped.
+template <class Direction = ForwardSearch, class CostPolicy, class Heuristic, class EdgeFilter = AllEdges>
+void runDijkstra(
+    const CompactGraph& network,
+    const CostPolicy& cost,
+    const Heuristic& heuristic,
+    uint32_t startId,
+    uint32_t targetId,
+    SearchWorkspace<typename CostPolicy::Weight>& workspace,
+    const EdgeFilter& filter = EdgeFilter()
+) {
+    typedef typename CostPolicy::Weight Weight;
+
+    workspace.begin(network.stopCount());
+
+    if (startId == NO_STOP) {
+        return;
+    }
+
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+
+    workspace.setLabel(startId, Weight(0), NO_STOP, NO_EDGE);
+    workspace.pushHeap(Weight(0), startId);
+
+    while (!workspace.heap.empty()) {
+        pair<Weight, uint32_t> current = workspace.popHeap();
+
+        uint32_t currentStop = current.second;
+        Weight currentCost = workspace.bestCost[currentStop];
+
+        if (current.first > currentCost + heuristic.estimate(currentStop)) {
+            continue;
+        }
+
+        nodesSettled++;
+        if (currentStop == targetId) {
+            break;
+        }
+
+        edgesRelaxed += Direction::edges(network, currentStop).size();
+        for (uint32_t route : Direction::edges(network, currentStop)) {
+            uint32_t neighborStop = Direction::otherEnd(network, route);
+            if (!filter.allows(route, neighborStop)) {
+                continue;
+            }
+            Weight costThroughCurrent = currentCost + cost.edgeCost(network, route);
+
+            if (costThroughCurrent < workspace.costOf(neighborStop)) {
+                workspace.setLabel(neighborStop, costThroughCurrent, currentStop, route);
+                workspace.pushHeap(costThroughCurrent + heuristic.estimate(neighborStop), neighborStop);
+            }
+        }
+    }
+
+    searchStats.nodesSettled += nodesSettled;
+    searchStats.edgesRelaxed += edgesRelaxed;
+}
+
+// Dijkstra over (stop, current bus) states: an edge costs its policy cost plus
+// transferPenalty when it boards a different bus than the one arrived on. The
+// start is an extra state, stateCount(), with no bus. Stops at the first
+// settled state of targetId and returns it, or NO_STOP when unreachable;
+// previousStop holds predecessor states.
+template <class CostPolicy>
+uint32_t runTransferSearch(
+    const CompactGraph& network,
+    const CostPolicy& cost,
+    typename CostPolicy::Weight transferPenalty,
+    uint32_t startId,
+    uint32_t targetId,
+    SearchWorkspace<typename CostPolicy::Weight>& workspace
+) {
+    typedef typename CostPolicy::Weight Weight;
+
+    uint32_t startState = network.stateCount();
+    workspace.begin(startState + 1);
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return NO_STOP;
+    }
+
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+    uint32_t targetState = NO_STOP;
+
+    workspace.setLabel(startState, Weight(0), NO_STOP, NO_EDGE);
+    workspace.pushHeap(Weight(0), startState);
+
+    while (!workspace.heap.empty()) {
+        pair<Weight, uint32_t> current = workspace.popHeap();
+        uint32_t currentState = current.second;
+        if (current.first > workspace.bestCost[currentState]) {
+            continue;
+        }
+
+        uint32_t currentStop = currentState == startState ? startId : network.stateStops[currentState];
+        uint32_t currentBus = currentState == startState ? NO_BUS : network.stateBuses[currentState];
+        nodesSettled++;
+        if (currentStop == targetId) {
+            targetState = currentState;
+            break;
+        }
+
+        edgesRelaxed += network.neighbors(currentStop).size();
+        for (uint32_t route : network.neighbors(currentStop)) {
+            uint32_t nextState = network.edgeStates[route];
+            Weight costThroughCurrent = current.first + cost.edgeCost(network, route);
+            if (currentBus != NO_BUS && network.edgeBusIds[route] != currentBus) {
+                costThroughCurrent += transferPenalty;
+            }
+
+            if (costThroughCurrent < workspace.costOf(nextState)) {
+                workspace.setLabel(nextState, costThroughCurrent, currentState, route);
+                workspace.pushHeap(costThroughCurrent, nextState);
+            }
+        }
+    }
+
+    searchStats.nodesSettled += nodesSettled;
+    searchStats.edgesRelaxed += edgesRelaxed;
+    return targetState;
+}
+
+// Bidirectional Dijkstra: grows a forward tree from startId over outgoing edges
+// and a backward tree from targetId over incoming edges, always expanding the
+// side with the smaller tentative cost, and stops once the two heap minima
+// together cannot beat the best meeting point. Returns that meeting stop, or
+// NO_STOP when targetId is unreachable.
+template <class CostPolicy>
+uint32_t runBidirectionalDijkstra(
+    const CompactGraph& network,
+    const CostPolicy& cost,
+    uint32_t startId,
+    uint32_t targetId,
+    SearchWorkspace<typename CostPolicy::Weight>& forward,
+    SearchWorkspace<typename CostPolicy::Weight>& backward
+) {
+    typedef typename CostPolicy::Weight Weight;
+    const Weight INFINITY_VALUE = numeric_limits<Weight>::max();
+
+    forward.begin(network.stopCount());
+    backward.begin(network.stopCount());
+
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return NO_STOP;
+    }
+
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+    Weight bestTotal = INFINITY_VALUE;
+    uint32_t meetingStop = NO_STOP;
+
+    forward.setLabel(startId, Weight(0), NO_STOP, NO_EDGE);
+    forward.pushHeap(Weight(0), startId);
+    backward.setLabel(targetId, Weight(0), NO_STOP, NO_EDGE);
+    backward.pushHeap(Weight(0), targetId);
+
+    if (startId == targetId) {
+        bestTotal = Weight(0);
+        meetingStop = startId;
+    }
+
+    while (true) {
+        // Drop stale entries so both heap tops are real lower bounds
+        while (!forward.heap.empty() && forward.heap.top().first > forward.bestCost[forward.heap.top().second]) {
+            forward.popHeap();
+        }
+        while (!backward.heap.empty() && backward.heap.top().first > backward.bestCost[backward.heap.top().second]) {
+            backward.popHeap();
+        }
+
+        // Once either side runs dry, every stop it can reach is settled and the
+        // meeting point found so far is optimal
+        if (forward.heap.empty() || backward.heap.empty()) {
+            break;
+        }
+
+        Weight forwardTop = forward.heap.top().first;
+        Weight backwardTop = backward.heap.top().first;
+        if (forwardTop + backwardTop >= bestTotal) {
+            break;
+        }
+
+        bool expandForward = forwardTop <= backwardTop;
+        SearchWorkspace<Weight>& side = expandForward ? forward : backward;
+        SearchWorkspace<Weight>& otherSide = expandForward ? backward : forward;
+
+        pair<Weight, uint32_t> current = side.popHeap();
+        uint32_t currentStop = current.second;
+        Weight currentCost = current.first;
+        nodesSettled++;
+
+        if (expandForward) {
+            edgesRelaxed += network.neighbors(currentStop).size();
+            for (uint32_t route : network.neighbors(currentStop)) {
+                uint32_t neighborStop = network.edgeTargets[route];
+                Weight costThroughCurrent = currentCost + cost.edgeCost(network, route);
+
+                if (costThroughCurrent < side.costOf(neighborStop)) {
+                    side.setLabel(neighborStop, costThroughCurrent, currentStop, route);
+                    side.pushHeap(costThroughCurrent, neighborStop);
+                }
+                if (otherSide.reached(neighborStop) && costThroughCurrent + otherSide.bestCost[neighborStop] < bestTotal) {
+                    bestTotal = costThroughCurrent + otherSide.bestCost[neighborStop];
+                    meetingStop = neighborStop;
+                }
+            }
+        }
+        else {
+            // Backward labels point towards the target: previousStop is the next
+            // stop on the way there and previousEdge the forward edge to it
+            edgesRelaxed += network.incoming(currentStop).size();
+            for (uint32_t route : network.incoming(currentStop)) {
+                uint32_t neighborStop = network.edgeSources[route];
+                Weight costThroughCurrent = currentCost + cost.edgeCost(network, route);
+
+                if (costThroughCurrent < side.costOf(neighborStop)) {
+                    side.setLabel(neighborStop, costThroughCurrent, currentStop, route);
+                    side.pushHeap(costThroughCurrent, neighborStop);
+                }
+                if (otherSide.reached(neighborStop) && costThroughCurrent + otherSide.bestCost[neighborStop] < bestTotal) {
+                    bestTotal = costThroughCurrent + otherSide.bestCost[neighborStop];
+                    meetingStop = neighborStop;
+                }
+            }
+        }
+    }
+
+    searchStats.nodesSettled += nodesSettled;
+    searchStats.edgesRelaxed += edgesRelaxed;
+    return meetingStop;
+}
+
+// Copy the costs of one finished one-to-all search into column i of a table
+template <class Weight>
+void fillLandmarkColumn(const SearchWorkspace<Weight>& workspace, uint32_t stopCount, uint32_t landmarkCount, uint32_t i, vector<Weight>& table) {
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        table[(size_t)stop * landmarkCount + i] = workspace.costOf(stop);
+    }
+}
+
+// Fill column i of the fare tables from and to landmark i
+void fillLandmarkFareColumns(const CompactGraph& network, const vector<uint32_t>& landmarks, uint32_t i, vector<int>& fareFrom, vector<int>& fareTo) {
+    ZeroHeuristic noHeuristic(network, NO_STOP);
+    SearchWorkspace<int>& workspace = SearchWorkspace<int>::forThisThread();
+    uint32_t landmarkCount = (uint32_t)landmarks.size();
+
+    runDijkstra(network, FareCost(), noHeuristic, landmarks[i], NO_STOP, workspace);
+    fillLandmarkColumn(workspace, network.stopCount(), landmarkCount, i, fareFrom);
+
+    runDijkstra<BackwardSearch>(network, FareCost(), noHeuristic, landmarks[i], NO_STOP, workspace);
+    fillLandmarkColumn(workspace, network.stopCount(), landmarkCount, i, fareTo);
+}
+
+// Recompute the fare tables for the current landmarks after fares changed,
+// one thread per landmark, and swap them in whole
+void refreshLandmarkFares(CompactGraph& network) {
+    LandmarkIndex& index = network.landmarks;
+    vector<int> fareFrom(index.fareFrom.size());
+    vector<int> fareTo(index.fareTo.size());
+
+    vector<thread> workers;
+    for (uint32_t i = 0; i < index.landmarks.size(); i++) {
+        workers.emplace_back([&network, &index, &fareFrom, &fareTo, i]() {
+            fillLandmarkFareColumns(network, index.landmarks, i, fareFrom, fareTo);
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    index.fareFrom.swap(fareFrom);
+    index.fareTo.swap(fareTo);
+}
+
+// Pick landmarks by farthest-point selection and fill the ALT tables. Selection
+// is sequential because each pick depends on the previous ones; the other three
+// tables are then computed with one thread per landmark.
+void buildLandmarkIndex(CompactGraph& network, uint32_t requestedCount) {
+    auto startTime = chrono::steady_clock::now();
+    LandmarkIndex& index = network.landmarks;
+    index = LandmarkIndex();
+
+    uint32_t stopCount = network.stopCount();
+    uint32_t landmarkCount = min(min(requestedCount, MAX_LANDMARKS), stopCount);
+    if (landmarkCount == 0) {
+        return;
+    }
+
+    size_t tableSize = (size_t)stopCount * landmarkCount;
+    index.distanceFrom.assign(tableSize, numeric_limits<double>::max());
+    index.distanceTo.assign(tableSize, numeric_limits<double>::max());
+    index.fareFrom.assign(tableSize, numeric_limits<int>::max());
+    index.fareTo.assign(tableSize, numeric_limits<int>::max());
+
+    SearchWorkspace<double>& workspace = SearchWorkspace<double>::forThisThread();
+    ZeroHeuristic noHeuristic(network, NO_STOP);
+
+    // Start from the stop farthest from stop 0, then keep adding the stop whose
+    // nearest landmark is farthest away; unreachable stops win outright, which
+    // spreads landmarks over disconnected parts too
+    vector<double> nearestLandmark(stopCount, numeric_limits<double>::max());
+    runDijkstra(network, DistanceCost(), noHeuristic, 0, NO_STOP, workspace);
+    uint32_t nextLandmark = 0;
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        if (workspace.reached(stop) && workspace.bestCost[stop] > workspace.costOf(nextLandmark)) {
+            nextLandmark = stop;
+        }
+    }
+
+    for (uint32_t i = 0; i < landmarkCount; i++) {
+        index.landmarks.push_back(nextLandmark);
+        runDijkstra(network, DistanceCost(), noHeuristic, nextLandmark, NO_STOP, workspace);
+        fillLandmarkColumn(workspace, stopCount, landmarkCount, i, index.distanceFrom);
+
+        nearestLandmark[nextLandmark] = 0;
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            nearestLandmark[stop] = min(nearestLandmark[stop], workspace.costOf(stop));
+            if (nearestLandmark[stop] > nearestLandmark[nextLandmark]) {
+                nextLandmark = stop;
+            }
+        }
+    }
+
+    vector<thread> workers;
+    for (uint32_t i = 0; i < landmarkCount; i++) {
+        workers.emplace_back([&network, &index, stopCount, landmarkCount, i]() {
+            ZeroHeuristic noHeuristic(network, NO_STOP);
+            SearchWorkspace<double>& distanceWorkspace = SearchWorkspace<double>::forThisThread();
+
+            runDijkstra<BackwardSearch>(network, DistanceCost(), noHeuristic, index.landmarks[i], NO_STOP, distanceWorkspace);
+            fillLandmarkColumn(distanceWorkspace, stopCount, landmarkCount, i, index.distanceTo);
+            fillLandmarkFareColumns(network, index.landmarks, i, index.fareFrom, index.fareTo);
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    index.preprocessingMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+}
+
+// Contraction of one metric into a ContractionHierarchy. Stops are contracted in
+// order of a lazily updated priority (edge difference plus contracted
+// neighbours); contracting v adds a shortcut u -> w for every pair of remaining
+// neighbours unless a bounded witness search finds a path at least as cheap
+// that avoids v.
+template <class CostPolicy>
+class HierarchyBuilder {
+public:
+    typedef typename CostPolicy::Weight Weight;
+
+    HierarchyBuilder(const CompactGraph& network, const CostPolicy& cost)
+        : network(network), cost(cost), stopCount(network.stopCount()),
+        outgoing(stopCount), incoming(stopCount), contracted(stopCount, false),
+        contractedNeighbors(stopCount, 0), level(stopCount, 0), witnessCost(stopCount), witnessStamp(stopCount, 0), witnessTarget(stopCount, false) {
+    }
+
+    void build(ContractionHierarchy<Weight>& hierarchy) {
+        auto startTime = chrono::steady_clock::now();
+        hierarchy = ContractionHierarchy<Weight>();
+
+        // Start from the cheapest original edge per ordered pair of stops
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            for (uint32_t edge : network.neighbors(stop)) {
+                uint32_t target = network.edgeTargets[edge];
+                if (target != stop) {
+                    addOrImproveArc(stop, target, cost.edgeCost(network, edge), edge, NO_EDGE, NO_EDGE);
+                }
+            }
+        }
+
+        priority_queue<pair<int, uint32_t>, vector<pair<int, uint32_t>>, greater<pair<int, uint32_t>>> contractionQueue;
+        vector<int> priority(stopCount);
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            priority[stop] = priorityOf(stop);
+            contractionQueue.push(make_pair(priority[stop], stop));
+        }
+
+        hierarchy.rank.assign(stopCount, 0);
+        uint32_t nextRank = 0;
+
+        while (!contractionQueue.empty()) {
+            pair<int, uint32_t> top = contractionQueue.top();
+            contractionQueue.pop();
+
+            uint32_t stop = top.second;
+            if (contracted[stop] || top.first != priority[stop]) {
+                continue;
+            }
+
+            // Lazy update: re-evaluate and put the stop back if it got worse
+            priority[stop] = priorityOf(stop);
+            if (!contractionQueue.empty() && priority[stop] > contractionQueue.top().first) {
+                contractionQueue.push(make_pair(priority[stop], stop));
+                continue;
+            }
+
+            vector<uint32_t> neighbors = contract(stop);
+            hierarchy.rank[stop] = nextRank++;
+
+            // Contraction changes the neighbours' edge difference, so refresh them now
+            for (uint32_t neighbor : neighbors) {
+                priority[neighbor] = priorityOf(neighbor);
+                contractionQueue.push(make_pair(priority[neighbor], neighbor));
+            }
+        }
+
+        uint32_t originalArcs = 0;
+        hierarchy.arcs.reserve(arcs.size());
+        for (const BuildArc& arc : arcs) {
+            hierarchy.arcs.push_back(HierarchyArc{ arc.edge, arc.firstChild, arc.secondChild });
+            if (arc.edge != NO_EDGE) originalArcs++;
+        }
+        hierarchy.shortcutCount = (uint32_t)arcs.size() - originalArcs;
+
+        buildSearchGraphs(hierarchy);
+        hierarchy.preprocessingMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+    }
+
+private:
+    struct BuildArc {
+        uint32_t from;
+        uint32_t to;
+        Weight cost;
+        uint32_t edge;
+        uint32_t firstChild;
+        uint32_t secondChild;
+        bool live;
+    };
+
+    // Witness searches give up after this many settled stops and then assume
+    // no witness exists, which only costs an unnecessary shortcut. Priority
+    // estimates use a cheaper limit than the real contraction.
+    static const uint32_t CONTRACTION_SETTLE_LIMIT = 500;
+    static const uint32_t ESTIMATE_SETTLE_LIMIT = 50;
+
+    const CompactGraph& network;
+    CostPolicy cost;
+    uint32_t stopCount;
+
+    vector<BuildArc> arcs;
+    vector<vector<uint32_t>> outgoing;
+    vector<vector<uint32_t>> incoming;
+    vector<bool> contracted;
+    vector<int> contractedNeighbors;
+    vector<int> level;
+
+    vector<Weight> witnessCost;
+    vector<uint32_t> witnessStamp;
+    uint32_t witnessGeneration = 0;
+    vector<pair<Weight, uint32_t>> witnessHeap;
+    vector<bool> witnessTarget;
+
+    void addOrImproveArc(uint32_t from, uint32_t to, Weight arcCost, uint32_t edge, uint32_t firstChild, uint32_t secondChild) {
+        for (uint32_t arcId : outgoing[from]) {
+            BuildArc& arc = arcs[arcId];
+            if (arc.live && arc.to == to) {
+                if (arcCost < arc.cost) {
+                    // Retire the dearer parallel arc; shortcuts that already use it
+                    // can still unpack it by id
+                    arc.live = false;
+                    detachArc(arcId);
+                    break;
+                }
+                return;
+            }
+        }
+
+        uint32_t arcId = (uint32_t)arcs.size();
+        arcs.push_back(BuildArc{ from, to, arcCost, edge, firstChild, secondChild, true });
+        outgoing[from].push_back(arcId);
+        incoming[to].push_back(arcId);
+    }
+
+    // Drop an arc from the adjacency lists of its two ends; it stays in arcs
+    void detachArc(uint32_t arcId) {
+        vector<uint32_t>& fromList = outgoing[arcs[arcId].from];
+        vector<uint32_t>& toList = incoming[arcs[arcId].to];
+        fromList.erase(find(fromList.begin(), fromList.end(), arcId));
+        toList.erase(find(toList.begin(), toList.end(), arcId));
+    }
+
+    // Cheapest costs from source avoiding skippedStop, bounded by maxCost and the
+    // settle limit, and finished early once all targetCount stops marked in
+    // witnessTarget are settled; results are read back via witnessCostOf
+    void runWitnessSearch(uint32_t source, uint32_t skippedStop, Weight maxCost, uint32_t settleLimit, uint32_t targetCount) {
+        witnessGeneration++;
+        if (witnessGeneration == 0) {
+            fill(witnessStamp.begin(), witnessStamp.end(), 0);
+            witnessGeneration = 1;
+        }
+
+        witnessHeap.clear();
+        witnessStamp[source] = witnessGeneration;
+        witnessCost[source] = 0;
+        witnessHeap.push_back(make_pair(Weight(0), source));
+
+        uint32_t settled = 0;
+        while (!witnessHeap.empty() && settled < settleLimit) {
+            pop_heap(witnessHeap.begin(), witnessHeap.end(), greater<pair<Weight, uint32_t>>());
+            pair<Weight, uint32_t> current = witnessHeap.back();
+            witnessHeap.pop_back();
+
+            if (current.first > witnessCost[current.second]) {
+                continue;
+            }
+            if (current.first > maxCost) {
+                break;
+            }
+            settled++;
+            if (witnessTarget[current.second] && --targetCount == 0) {
+                break;
+            }
+
+            for (uint32_t arcId : outgoing[current.second]) {
+                const BuildArc& arc = arcs[arcId];
+                if (!arc.live || contracted[arc.to] || arc.to == skippedStop) {
+                    continue;
+                }
+
+                Weight costThroughCurrent = current.first + arc.cost;
+                if (costThroughCurrent < witnessCostOf(arc.to)) {
+                    witnessStamp[arc.to] = witnessGeneration;
+                    witnessCost[arc.to] = costThroughCurrent;
+                    witnessHeap.push_back(make_pair(costThroughCurrent, arc.to));
+                    push_heap(witnessHeap.begin(), witnessHeap.end(), greater<pair<Weight, uint32_t>>());
+                }
+            }
+        }
+    }
+
+    Weight witnessCostOf(uint32_t stop) const {
+        return witnessStamp[stop] == witnessGeneration ? witnessCost[stop] : numeric_limits<Weight>::max();
+    }
+
+    // Visit every shortcut contracting stop would need: handle(inArc, outArc)
+    template <class Handler>
+    void forEachNeededShortcut(uint32_t stop, uint32_t settleLimit, Handler handle) {
+        Weight maxOutgoing = 0;
+        uint32_t targetCount = 0;
+        for (uint32_t outArc : outgoing[stop]) {
+            if (arcs[outArc].live && !contracted[arcs[outArc].to]) {
+                maxOutgoing = max(maxOutgoing, arcs[outArc].cost);
+                witnessTarget[arcs[outArc].to] = true;
+                targetCount++;
+            }
+        }
+
+        for (uint32_t inArc : incoming[stop]) {
+            const BuildArc& in = arcs[inArc];
+            if (!in.live || contracted[in.from]) {
+                continue;
+            }
+
+            runWitnessSearch(in.from, stop, in.cost + maxOutgoing, settleLimit, targetCount);
+
+            for (uint32_t outArc : outgoing[stop]) {
+                const BuildArc& out = arcs[outArc];
+                if (!out.live || contracted[out.to] || out.to == in.from) {
+                    continue;
+                }
+                if (witnessCostOf(out.to) > in.cost + out.cost) {
+                    handle(inArc, outArc);
+                }
+            }
+        }
+
+        for (uint32_t outArc : outgoing[stop]) {
+            witnessTarget[arcs[outArc].to] = false;
+        }
+    }
+
+    int liveDegree(uint32_t stop) const {
+        int degree = 0;
+        for (uint32_t arcId : outgoing[stop]) {
+            if (arcs[arcId].live && !contracted[arcs[arcId].to]) degree++;
+        }
+        for (uint32_t arcId : incoming[stop]) {
+            if (arcs[arcId].live && !contracted[arcs[arcId].from]) degree++;
+        }
+        return degree;
+    }
+
+    // Edge difference, weighted up, plus contracted neighbours and hierarchy
+    // depth so contraction spreads evenly over the network
+    int priorityOf(uint32_t stop) {
+        int shortcuts = 0;
+        forEachNeededShortcut(stop, ESTIMATE_SETTLE_LIMIT, [&shortcuts](uint32_t, uint32_t) { shortcuts++; });
+        return 2 * (shortcuts - liveDegree(stop)) + contractedNeighbors[stop] + level[stop];
+    }
+
+    // Contract stop and return its remaining neighbours
+    vector<uint32_t> contract(uint32_t stop) {
+        vector<pair<uint32_t, uint32_t>> shortcuts;
+        forEachNeededShortcut(stop, CONTRACTION_SETTLE_LIMIT, [&shortcuts](uint32_t inArc, uint32_t outArc) {
+            shortcuts.push_back(make_pair(inArc, outArc));
+        });
+
+        for (const auto& shortcut : shortcuts) {
+            BuildArc in = arcs[shortcut.first];
+            BuildArc out = arcs[shortcut.second];
+            addOrImproveArc(in.from, out.to, in.cost + out.cost, NO_EDGE, shortcut.first, shortcut.second);
+        }
+
+        contracted[stop] = true;
+        vector<uint32_t> neighbors;
+        for (uint32_t arcId : outgoing[stop]) {
+            if (arcs[arcId].live && !contracted[arcs[arcId].to]) neighbors.push_back(arcs[arcId].to);
+        }
+        for (uint32_t arcId : incoming[stop]) {
+            if (arcs[arcId].live && !contracted[arcs[arcId].from]) neighbors.push_back(arcs[arcId].from);
+        }
+
+        // The remaining stops never walk back into a contracted one, so unlink
+        // its arcs from their lists to keep the later witness searches short
+        for (uint32_t arcId : outgoing[stop]) {
+            vector<uint32_t>& toList = incoming[arcs[arcId].to];
+            toList.erase(find(toList.begin(), toList.end(), arcId));
+        }
+        for (uint32_t arcId : incoming[stop]) {
+            vector<uint32_t>& fromList = outgoing[arcs[arcId].from];
+            fromList.erase(find(fromList.begin(), fromList.end(), arcId));
+        }
+        sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(unique(neighbors.begin(), neighbors.end()), neighbors.end());
+
+        for (uint32_t neighbor : neighbors) {
+            contractedNeighbors[neighbor]++;
+            level[neighbor] = max(level[neighbor], level[stop] + 1);
+        }
+        return neighbors;
+    }
+
+    void buildSearchGraphs(ContractionHierarchy<Weight>& hierarchy) {
+        hierarchy.upwardOffsets.assign(stopCount + 1, 0);
+        hierarchy.downwardOffsets.assign(stopCount + 1, 0);
+
+        for (const BuildArc& arc : arcs) {
+            if (!arc.live) continue;
+            if (hierarchy.rank[arc.to] > hierarchy.rank[arc.from]) {
+                hierarchy.upwardOffsets[arc.from + 1]++;
+            }
+            else {
+                hierarchy.downwardOffsets[arc.to + 1]++;
+            }
+        }
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            hierarchy.upwardOffsets[stop + 1] += hierarchy.upwardOffsets[stop];
+            hierarchy.downwardOffsets[stop + 1] += hierarchy.downwardOffsets[stop];
+        }
+
+        hierarchy.upwardTargets.resize(hierarchy.upwardOffsets[stopCount]);
+        hierarchy.upwardCosts.resize(hierarchy.upwardOffsets[stopCount]);
+        hierarchy.upwardArcIds.resize(hierarchy.upwardOffsets[stopCount]);
+        hierarchy.downwardTargets.resize(hierarchy.downwardOffsets[stopCount]);
+        hierarchy.downwardCosts.resize(hierarchy.downwardOffsets[stopCount]);
+        hierarchy.downwardArcIds.resize(hierarchy.downwardOffsets[stopCount]);
+
+        vector<uint32_t> nextUpward(hierarchy.upwardOffsets.begin(), hierarchy.upwardOffsets.end() - 1);
+        vector<uint32_t> nextDownward(hierarchy.downwardOffsets.begin(), hierarchy.downwardOffsets.end() - 1);
+
+        for (uint32_t arcId = 0; arcId < arcs.size(); arcId++) {
+            const BuildArc& arc = arcs[arcId];
+            if (!arc.live) continue;
+            if (hierarchy.rank[arc.to] > hierarchy.rank[arc.from]) {
+                uint32_t slot = nextUpward[arc.from]++;
+                hierarchy.upwardTargets[slot] = arc.to;
+                hierarchy.upwardCosts[slot] = arc.cost;
+                hierarchy.upwardArcIds[slot] = arcId;
+            }
+            else {
+                uint32_t slot = nextDownward[arc.to]++;
+                hierarchy.downwardTargets[slot] = arc.from;
+                hierarchy.downwardCosts[slot] = arc.cost;
+                hierarchy.downwardArcIds[slot] = arcId;
+            }
+        }
+    }
+};
+
+// Bidirectional upward search on a contraction hierarchy. The forward side only
+// follows upward arcs from startId and the backward side only downward arcs
+// (reversed) from targetId; a side stops once its heap minimum cannot beat the
+// best meeting point. Stall-on-demand skips stops that are provably reached
+// more cheaply from above. Labels store hierarchy arc ids as previousEdge.
+template <class Weight>
+uint32_t runHierarchyQuery(
+    const ContractionHierarchy<Weight>& hierarchy,
+    uint32_t startId,
+    uint32_t targetId,
+    SearchWorkspace<Weight>& forward,
+    SearchWorkspace<Weight>& backward
+) {
+    uint32_t stopCount = (uint32_t)hierarchy.rank.size();
+    forward.begin(stopCount);
+    backward.begin(stopCount);
+
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return NO_STOP;
+    }
+
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+    Weight bestTotal = numeric_limits<Weight>::max();
+    uint32_t meetingStop = NO_STOP;
+
+    forward.setLabel(startId, Weight(0), NO_STOP, NO_EDGE);
+    forward.pushHeap(Weight(0), startId);
+    backward.setLabel(targetId, Weight(0), NO_STOP, NO_EDGE);
+    backward.pushHeap(Weight(0), targetId);
+
+    bool forwardTurn = true;
+    while (true) {
+        bool forwardActive = !forward.heap.empty() && forward.heap.top().first < bestTotal;
+        bool backwardActive = !backward.heap.empty() && backward.heap.top().first < bestTotal;
+        if (!forwardActive && !backwardActive) {
+            break;
+        }
+
+        bool expandForward = forwardActive && (forwardTurn || !backwardActive);
+        forwardTurn = !forwardTurn;
+
+        SearchWorkspace<Weight>& side = expandForward ? forward : backward;
+        SearchWorkspace<Weight>& otherSide = expandForward ? backward : forward;
+        const vector<uint32_t>& offsets = expandForward ? hierarchy.upwardOffsets : hierarchy.downwardOffsets;
+        const vector<uint32_t>& targets = expandForward ? hierarchy.upwardTargets : hierarchy.downwardTargets;
+        const vector<Weight>& costs = expandForward ? hierarchy.upwardCosts : hierarchy.downwardCosts;
+        const vector<uint32_t>& arcIds = expandForward ? hierarchy.upwardArcIds : hierarchy.downwardArcIds;
+        const vector<uint32_t>& stallOffsets = expandForward ? hierarchy.downwardOffsets : hierarchy.upwardOffsets;
+        const vector<uint32_t>& stallTargets = expandForward ? hierarchy.downwardTargets : hierarchy.upwardTargets;
+        const vector<Weight>& stallCosts = expandForward ? hierarchy.downwardCosts : hierarchy.upwardCosts;
+
+        pair<Weight, uint32_t> current = side.popHeap();
+        uint32_t currentStop = current.second;
+        Weight currentCost = current.first;
+        if (currentCost > side.bestCost[currentStop]) {
+            continue;
+        }
+        nodesSettled++;
+
+        if (otherSide.reached(currentStop) && currentCost + otherSide.bestCost[currentStop] < bestTotal) {
+            bestTotal = currentCost + otherSide.bestCost[currentStop];
+            meetingStop = currentStop;
+        }
+
+        // Stall-on-demand: a higher stop that reaches this one more cheaply means
+        // this label cannot lie on a shortest up-down path
+        bool stalled = false;
+        for (uint32_t slot = stallOffsets[currentStop]; slot < stallOffsets[currentStop + 1]; slot++) {
+            uint32_t higherStop = stallTargets[slot];
+            if (side.reached(higherStop) && side.bestCost[higherStop] + stallCosts[slot] < currentCost) {
+                stalled = true;
+                break;
+            }
+        }
+        if (stalled) {
+            continue;
+        }
+
+        edgesRelaxed += offsets[currentStop + 1] - offsets[currentStop];
+        for (uint32_t slot = offsets[currentStop]; slot < offsets[currentStop + 1]; slot++) {
+            uint32_t neighborStop = targets[slot];
+            Weight costThroughCurrent = currentCost + costs[slot];
+
+            if (costThroughCurrent < side.costOf(neighborStop)) {
+                side.setLabel(neighborStop, costThroughCurrent, currentStop, arcIds[slot]);
+                side.pushHeap(costThroughCurrent, neighborStop);
+            }
+        }
+    }
+
+    searchStats.nodesSettled += nodesSettled;
+    searchStats.edgesRelaxed += edgesRelaxed;
+    return meetingStop;
+}
+
+// Expand a hierarchy arc into the original edge ids it stands for, in order
+template <class Weight>
+void unpackHierarchyArc(const ContractionHierarchy<Weight>& hierarchy, uint32_t arcId, vector<uint32_t>& edges) {
+    vector<uint32_t> pending;
+    pending.push_back(arcId);
+
+    while (!pending.empty()) {
+        const HierarchyArc& arc = hierarchy.arcs[pending.back()];
+        pending.pop_back();
+
+        if (arc.edge != NO_EDGE) {
+            edges.push_back(arc.edge);
+        }
+        else {
+            pending.push_back(arc.secondChild);
+            pending.push_back(arc.firstChild);
+        }
+    }
+}
+
+// Original edges of the hierarchy route from startId to endId, searched with
+// this thread's workspaces. Returns false when endId cannot be reached.
+template <class Weight>
+bool findHierarchyPath(const ContractionHierarchy<Weight>& hierarchy, uint32_t startId, uint32_t endId, vector<uint32_t>& edges) {
+    SearchWorkspace<Weight>& forward = SearchWorkspace<Weight>::forThisThread(0);
+    SearchWorkspace<Weight>& backward = SearchWorkspace<Weight>::forThisThread(1);
+    uint32_t meetingStop = runHierarchyQuery(hierarchy, startId, endId, forward, backward);
+    if (meetingStop == NO_STOP) {
+        return false;
+    }
+
+    vector<uint32_t> arcs;
+    for (uint32_t current = meetingStop; current != startId; current = forward.previousStop[current]) {
+        arcs.push_back(forward.previousEdge[current]);
+    }
+    reverse(arcs.begin(), arcs.end());
+    for (uint32_t current = meetingStop; current != endId; current = backward.previousStop[current]) {
+        arcs.push_back(backward.previousEdge[current]);
+    }
+
+    edges.clear();
+    for (uint32_t arc : arcs) {
+        unpackHierarchyArc(hierarchy, arc, edges);
+    }
+    return true;
+}
+
+inline const shared_ptr<const ContractionHierarchy<double>>& hierarchyFor(const CompactGraph& network, const DistanceCost&) { return network.distanceHierarchy; }
+inline const shared_ptr<const ContractionHierarchy<int>>& hierarchyFor(const CompactGraph& network, const FareCost&) { return network.fareHierarchy; }
+
+// Nested dissection order over the undirected topology. A part is split by
+// the BFS level, from a far-away stop, that is smallest among those leaving at
+// least a third of the part on either side; that level becomes a separator
+// and takes the highest ranks still free, and the two sides are ordered the
+// same way. Parts BFS cannot reach from the start are handled on their own.
+vector<uint32_t> nestedDissectionRanks(const vector<vector<uint32_t>>& neighbors) {
+    uint32_t stopCount = (uint32_t)neighbors.size();
+    vector<uint32_t> rank(stopCount, NO_STOP);
+    vector<uint32_t> part(stopCount, 0);
+    vector<uint32_t> depth(stopCount, NO_STOP);
+    vector<uint32_t> queue;
+    queue.reserve(stopCount);
+    uint32_t nextPart = 1;
+    uint32_t nextRank = stopCount;
+
+    // Breadth-first search inside one part; leaves the visit order in queue
+    auto runBreadthFirst = [&](uint32_t source, uint32_t partId) {
+        queue.clear();
+        queue.push_back(source);
+        depth[source] = 0;
+        for (size_t head = 0; head < queue.size(); head++) {
+            uint32_t stop = queue[head];
+            for (uint32_t neighbor : neighbors[stop]) {
+                if (part[neighbor] == partId && depth[neighbor] == NO_STOP) {
+                    depth[neighbor] = depth[stop] + 1;
+                    queue.push_back(neighbor);
+                }
+            }
+        }
+    };
+    auto clearDepths = [&]() {
+        for (uint32_t stop : queue) depth[stop] = NO_STOP;
+    };
+
+    vector<vector<uint32_t>> pending;
+    vector<uint32_t> everything(stopCount);
+    for (uint32_t stop = 0; stop < stopCount; stop++) everything[stop] = stop;
+    pending.push_back(move(everything));
+
+    while (!pending.empty()) {
+        vector<uint32_t> stops = move(pending.back());
+        pending.pop_back();
+
+        if (stops.size() <= 2) {
+            for (uint32_t stop : stops) rank[stop] = --nextRank;
+            continue;
+        }
+
+        uint32_t partId = nextPart++;
+        for (uint32_t stop : stops) part[stop] = partId;
+
+        // Two sweeps find a stop near the edge of its component
+        runBreadthFirst(stops[0], partId);
+        uint32_t start = queue.back();
+        clearDepths();
+        runBreadthFirst(start, partId);
+
+        if (queue.size() < stops.size()) {
+            // Disconnected: split off everything the search did not reach
+            vector<uint32_t> unreached;
+            for (uint32_t stop : stops) {
+                if (depth[stop] == NO_STOP) unreached.push_back(stop);
+            }
+            pending.push_back(move(unreached));
+            pending.push_back(queue);
+            clearDepths();
+            continue;
+        }
+
+        uint32_t levelCount = depth[queue.back()] + 1;
+        vector<uint32_t> levelSizes(levelCount, 0);
+        for (uint32_t stop : queue) levelSizes[depth[stop]]++;
+
+        uint32_t total = (uint32_t)queue.size();
+        uint32_t separatorLevel = NO_STOP;
+        uint32_t before = 0;
+        uint32_t medianLevel = 0;
+        for (uint32_t level = 0; level < levelCount; level++) {
+            uint32_t after = total - before - levelSizes[level];
+            if (before < (total + 1) / 2) medianLevel = level;
+            if (3 * before >= total && 3 * after >= total &&
+                (separatorLevel == NO_STOP || levelSizes[level] < levelSizes[separatorLevel])) {
+                separatorLevel = level;
+            }
+            before += levelSizes[level];
+        }
+        if (separatorLevel == NO_STOP) separatorLevel = medianLevel;
+
+        vector<uint32_t> nearSide;
+        vector<uint32_t> farSide;
+        for (uint32_t stop : queue) {
+            if (depth[stop] == separatorLevel) rank[stop] = --nextRank;
+            else if (depth[stop] < separatorLevel) nearSide.push_back(stop);
+            else farSide.push_back(stop);
+        }
+        clearDepths();
+
+        if (!nearSide.empty()) pending.push_back(move(nearSide));
+        if (!farSide.empty()) pending.push_back(move(farSide));
+    }
+
+    return rank;
+}
+
+// Compute the metric-independent elimination order and arc layout of a
+// customizable hierarchy. Eliminating the stops in rank order, each stop's
+// remaining neighbours become a clique, and those are its upward arcs.
+void buildCustomizableHierarchy(const CompactGraph& network, CustomizableHierarchy& hierarchy) {
+    auto startTime = chrono::steady_clock::now();
+    hierarchy = CustomizableHierarchy();
+
+    uint32_t stopCount = network.stopCount();
+    vector<vector<uint32_t>> neighbors(stopCount);
+    for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+        uint32_t from = network.edgeSources[edge];
+        uint32_t to = network.edgeTargets[edge];
+        if (from != to) {
+            neighbors[from].push_back(to);
+            neighbors[to].push_back(from);
+        }
+    }
+    for (vector<uint32_t>& list : neighbors) {
+        sort(list.begin(), list.end());
+        list.erase(unique(list.begin(), list.end()), list.end());
+    }
+
+    hierarchy.rank = nestedDissectionRanks(neighbors);
+    vector<uint32_t> order(stopCount);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        order[hierarchy.rank[stop]] = stop;
+    }
+
+    // neighbors[] only ever holds stops that are still to be eliminated
+    vector<vector<uint32_t>> higher(stopCount);
+    vector<uint32_t> merged;
+    for (uint32_t stop : order) {
+        higher[stop].swap(neighbors[stop]);
+
+        for (uint32_t neighbor : higher[stop]) {
+            merged.clear();
+            set_union(neighbors[neighbor].begin(), neighbors[neighbor].end(),
+                higher[stop].begin(), higher[stop].end(), back_inserter(merged));
+            merged.erase(remove_if(merged.begin(), merged.end(), [stop, neighbor](uint32_t other) {
+                return other == stop || other == neighbor;
+            }), merged.end());
+
+            neighbors[neighbor].swap(merged);
+        }
+    }
+
+    hierarchy.upwardOffsets.assign(stopCount + 1, 0);
+    hierarchy.downwardOffsets.assign(stopCount + 1, 0);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        hierarchy.upwardOffsets[stop + 1] = hierarchy.upwardOffsets[stop] + (uint32_t)higher[stop].size();
+        for (uint32_t target : higher[stop]) {
+            hierarchy.downwardOffsets[target + 1]++;
+        }
+    }
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        hierarchy.downwardOffsets[stop + 1] += hierarchy.downwardOffsets[stop];
+    }
+
+    hierarchy.upwardTargets.reserve(hierarchy.upwardOffsets[stopCount]);
+    hierarchy.downwardSources.resize(hierarchy.upwardOffsets[stopCount]);
+    hierarchy.downwardArcIds.resize(hierarchy.upwardOffsets[stopCount]);
+    vector<uint32_t> nextSlot(hierarchy.downwardOffsets.begin(), hierarchy.downwardOffsets.end() - 1);
+
+    // Walking stops in id order leaves every downward list sorted by id
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        for (uint32_t target : higher[stop]) {
+            uint32_t slot = nextSlot[target]++;
+            hierarchy.downwardSources[slot] = stop;
+            hierarchy.downwardArcIds[slot] = (uint32_t)hierarchy.upwardTargets.size();
+            hierarchy.upwardTargets.push_back(target);
+        }
+    }
+
+    hierarchy.edgeArcs.assign(network.edgeCount(), NO_EDGE);
+    for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+        uint32_t lower = network.edgeSources[edge];
+        uint32_t upper = network.edgeTargets[edge];
+        if (lower == upper) {
+            continue;
+        }
+        if (hierarchy.rank[lower] > hierarchy.rank[upper]) {
+            swap(lower, upper);
+        }
+
+        auto first = hierarchy.upwardTargets.begin() + hierarchy.upwardOffsets[lower];
+        auto last = hierarchy.upwardTargets.begin() + hierarchy.upwardOffsets[lower + 1];
+        hierarchy.edgeArcs[edge] = (uint32_t)(lower_bound(first, last, upper) - hierarchy.upwardTargets.begin());
+    }
+
+    vector<uint32_t> level(stopCount, 0);
+    uint32_t levelCount = stopCount > 0 ? 1 : 0;
+    for (uint32_t stop : order) {
+        for (uint32_t slot = hierarchy.downwardOffsets[stop]; slot < hierarchy.downwardOffsets[stop + 1]; slot++) {
+            level[stop] = max(level[stop], level[hierarchy.downwardSources[slot]] + 1);
+        }
+        levelCount = max(levelCount, level[stop] + 1);
+    }
+
+    hierarchy.levelOffsets.assign(levelCount + 1, 0);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        hierarchy.levelOffsets[level[stop] + 1]++;
+    }
+    for (uint32_t i = 0; i < levelCount; i++) {
+        hierarchy.levelOffsets[i + 1] += hierarchy.levelOffsets[i];
+    }
+    hierarchy.levelStops.resize(stopCount);
+    vector<uint32_t> nextLevelSlot(hierarchy.levelOffsets.begin(), hierarchy.levelOffsets.end() - 1);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        hierarchy.levelStops[nextLevelSlot[level[stop]]++] = stop;
+    }
+
+    hierarchy.preprocessingMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+}
+
+// Levels with fewer stops than this are customized on the calling thread
+const uint32_t PARALLEL_LEVEL_MIN_STOPS = 256;
+
+// Apply a metric to a customizable hierarchy and produce a query-ready
+// ContractionHierarchy. Every arc u - w starts at its cheapest original edge in
+// each direction and is then lowered through each triangle u - v - w with v
+// below both. Arcs are processed level by level of their lower end, so all
+// arcs they read are final; each arc is written by exactly one thread. Arc a
+// becomes hierarchy arcs 2a (upwards) and 2a + 1 (downwards); arcs no path
+// can use are left out of the search graphs.
+template <class CostPolicy>
+void customizeHierarchy(
+    const CompactGraph& network,
+    const CustomizableHierarchy& customizable,
+    const CostPolicy& cost,
+    ContractionHierarchy<typename CostPolicy::Weight>& hierarchy
+) {
+    typedef typename CostPolicy::Weight Weight;
+    const Weight INFINITY_VALUE = numeric_limits<Weight>::max();
+
+    auto startTime = chrono::steady_clock::now();
+    hierarchy = ContractionHierarchy<Weight>();
+    hierarchy.rank = customizable.rank;
+
+    uint32_t stopCount = network.stopCount();
+    uint32_t arcCount = customizable.arcCount();
+    vector<Weight> upwardCost(arcCount, INFINITY_VALUE);
+    vector<Weight> downwardCost(arcCount, INFINITY_VALUE);
+    hierarchy.arcs.assign(2 * (size_t)arcCount, HierarchyArc{ NO_EDGE, NO_EDGE, NO_EDGE });
+
+    for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+        uint32_t arc = customizable.edgeArcs[edge];
+        if (arc == NO_EDGE) {
+            continue;
+        }
+
+        bool upwards = customizable.rank[network.edgeSources[edge]] < customizable.rank[network.edgeTargets[edge]];
+        vector<Weight>& arcCost = upwards ? upwardCost : downwardCost;
+        Weight edgeCost = cost.edgeCost(network, edge);
+        if (edgeCost < arcCost[arc]) {
+            arcCost[arc] = edgeCost;
+            hierarchy.arcs[2 * (size_t)arc + (upwards ? 0 : 1)] = HierarchyArc{ edge, NO_EDGE, NO_EDGE };
+        }
+    }
+
+    auto customizeStops = [&](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t lower = customizable.levelStops[i];
+            for (uint32_t arc = customizable.upwardOffsets[lower]; arc < customizable.upwardOffsets[lower + 1]; arc++) {
+                uint32_t upper = customizable.upwardTargets[arc];
+
+                // Stops below both ends: intersect the two sorted lower-neighbour lists
+                uint32_t lowerSlot = customizable.downwardOffsets[lower];
+                uint32_t upperSlot = customizable.downwardOffsets[upper];
+                while (lowerSlot < customizable.downwardOffsets[lower + 1] && upperSlot < customizable.downwardOffsets[upper + 1]) {
+                    uint32_t lowerMiddle = customizable.downwardSources[lowerSlot];
+                    uint32_t upperMiddle = customizable.downwardSources[upperSlot];
+                    if (lowerMiddle < upperMiddle) {
+                        lowerSlot++;
+                        continue;
+                    }
+                    if (upperMiddle < lowerMiddle) {
+                        upperSlot++;
+                        continue;
+                    }
+
+                    uint32_t toLower = customizable.downwardArcIds[lowerSlot];
+                    uint32_t toUpper = customizable.downwardArcIds[upperSlot];
+                    lowerSlot++;
+                    upperSlot++;
+
+                    // lower -> middle -> upper
+                    if (downwardCost[toLower] != INFINITY_VALUE && upwardCost[toUpper] != INFINITY_VALUE &&
+                        downwardCost[toLower] + upwardCost[toUpper] < upwardCost[arc]) {
+                        upwardCost[arc] = downwardCost[toLower] + upwardCost[toUpper];
+                        hierarchy.arcs[2 * (size_t)arc] = HierarchyArc{ NO_EDGE, 2 * toLower + 1, 2 * toUpper };
+                    }
+                    // upper -> middle -> lower
+                    if (downwardCost[toUpper] != INFINITY_VALUE && upwardCost[toLower] != INFINITY_VALUE &&
+                        downwardCost[toUpper] + upwardCost[toLower] < downwardCost[arc]) {
+                        downwardCost[arc] = downwardCost[toUpper] + upwardCost[toLower];
+                        hierarchy.arcs[2 * (size_t)arc + 1] = HierarchyArc{ NO_EDGE, 2 * toUpper + 1, 2 * toLower };
+                    }
+                }
+            }
+        }
+    };
+
+    uint32_t workerCount = max(1u, thread::hardware_concurrency());
+    uint32_t levelCount = (uint32_t)customizable.levelOffsets.size() - 1;
+    for (uint32_t level = 1; level < levelCount; level++) {
+        uint32_t first = customizable.levelOffsets[level];
+        uint32_t last = customizable.levelOffsets[level + 1];
+        if (workerCount == 1 || last - first < PARALLEL_LEVEL_MIN_STOPS) {
+            customizeStops(first, last);
+            continue;
+        }
+
+        vector<thread> workers;
+        uint32_t chunk = (last - first + workerCount - 1) / workerCount;
+        for (uint32_t begin = first; begin < last; begin += chunk) {
+            workers.emplace_back(customizeStops, begin, min(begin + chunk, last));
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    auto directedCost = [&upwardCost, &downwardCost](uint32_t hierarchyArc) {
+        return (hierarchyArc & 1) ? downwardCost[hierarchyArc / 2] : upwardCost[hierarchyArc / 2];
+    };
+
+    // Perfect customization, walking the levels back down. The higher neighbours
+    // of a stop form a clique, so any cheaper lower -> upper path through higher
+    // stops starts with an arc lower -> middle and ends with the arc between
+    // middle and upper, which is already exact. An arc whose cost some such
+    // path matches is not needed by queries and is left out of the search
+    // graphs; the positive-cost check keeps two arcs from excusing each other.
+    vector<char> upwardNeeded(arcCount, 1);
+    vector<char> downwardNeeded(arcCount, 1);
+
+    auto perfectStops = [&](uint32_t first, uint32_t last) {
+        // cliqueArcs[i * degree + j]: hierarchy arc from the i-th to the j-th higher neighbour
+        vector<uint32_t> cliqueArcs;
+
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t lower = customizable.levelStops[i];
+            uint32_t firstArc = customizable.upwardOffsets[lower];
+            uint32_t degree = customizable.upwardOffsets[lower + 1] - firstArc;
+            const uint32_t* clique = customizable.upwardTargets.data() + firstArc;
+
+            // Both lists are sorted by stop id, so one merge per member finds its arcs
+            cliqueArcs.assign((size_t)degree * degree, NO_EDGE);
+            for (uint32_t from = 0; from < degree; from++) {
+                uint32_t slot = customizable.upwardOffsets[clique[from]];
+                uint32_t lastSlot = customizable.upwardOffsets[clique[from] + 1];
+                for (uint32_t to = 0; to < degree && slot < lastSlot;) {
+                    if (customizable.upwardTargets[slot] < clique[to]) slot++;
+                    else if (clique[to] < customizable.upwardTargets[slot]) to++;
+                    else {
+                        cliqueArcs[(size_t)from * degree + to] = 2 * slot;
+                        cliqueArcs[(size_t)to * degree + from] = 2 * slot + 1;
+                        slot++;
+                        to++;
+                    }
+                }
+            }
+
+            for (uint32_t target = 0; target < degree; target++) {
+                uint32_t arc = firstArc + target;
+                for (uint32_t via = 0; via < degree; via++) {
+                    if (via == target) continue;
+                    uint32_t viaArc = firstArc + via;
+                    uint32_t middleToUpper = cliqueArcs[(size_t)via * degree + target];
+                    uint32_t upperToMiddle = cliqueArcs[(size_t)target * degree + via];
+
+                    if (upwardCost[viaArc] != INFINITY_VALUE && directedCost(middleToUpper) != INFINITY_VALUE &&
+                        upwardCost[viaArc] + directedCost(middleToUpper) < upwardCost[arc]) {
+                        upwardCost[arc] = upwardCost[viaArc] + directedCost(middleToUpper);
+                        hierarchy.arcs[2 * (size_t)arc] = HierarchyArc{ NO_EDGE, 2 * viaArc, middleToUpper };
+                    }
+                    if (downwardCost[viaArc] != INFINITY_VALUE && directedCost(upperToMiddle) != INFINITY_VALUE &&
+                        directedCost(upperToMiddle) + downwardCost[viaArc] < downwardCost[arc]) {
+                        downwardCost[arc] = directedCost(upperToMiddle) + downwardCost[viaArc];
+                        hierarchy.arcs[2 * (size_t)arc + 1] = HierarchyArc{ NO_EDGE, upperToMiddle, 2 * viaArc + 1 };
+                    }
+                }
+            }
+
+            for (uint32_t target = 0; target < degree; target++) {
+                uint32_t arc = firstArc + target;
+                for (uint32_t via = 0; via < degree; via++) {
+                    if (via == target) continue;
+                    Weight toMiddle = upwardCost[firstArc + via];
+                    Weight middleToUpper = directedCost(cliqueArcs[(size_t)via * degree + target]);
+                    Weight upperToMiddle = directedCost(cliqueArcs[(size_t)target * degree + via]);
+                    Weight fromMiddle = downwardCost[firstArc + via];
+
+                    if (toMiddle > 0 && middleToUpper > 0 && toMiddle != INFINITY_VALUE && middleToUpper != INFINITY_VALUE &&
+                        toMiddle + middleToUpper == upwardCost[arc]) {
+                        upwardNeeded[arc] = 0;
+                    }
+                    if (upperToMiddle > 0 && fromMiddle > 0 && upperToMiddle != INFINITY_VALUE && fromMiddle != INFINITY_VALUE &&
+                        upperToMiddle + fromMiddle == downwardCost[arc]) {
+                        downwardNeeded[arc] = 0;
+                    }
+                }
+            }
+        }
+    };
+
+    for (uint32_t level = levelCount; level-- > 0;) {
+        uint32_t first = customizable.levelOffsets[level];
+        uint32_t last = customizable.levelOffsets[level + 1];
+        if (workerCount == 1 || last - first < PARALLEL_LEVEL_MIN_STOPS) {
+            perfectStops(first, last);
+            continue;
+        }
+
+        vector<thread> workers;
+        uint32_t chunk = (last - first + workerCount - 1) / workerCount;
+        for (uint32_t begin = first; begin < last; begin += chunk) {
+            workers.emplace_back(perfectStops, begin, min(begin + chunk, last));
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    hierarchy.upwardOffsets.assign(stopCount + 1, 0);
+    hierarchy.downwardOffsets.assign(stopCount + 1, 0);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        hierarchy.upwardOffsets[stop + 1] = hierarchy.upwardOffsets[stop];
+        hierarchy.downwardOffsets[stop + 1] = hierarchy.downwardOffsets[stop];
+
+        for (uint32_t arc = customizable.upwardOffsets[stop]; arc < customizable.upwardOffsets[stop + 1]; arc++) {
+            uint32_t upper = customizable.upwardTargets[arc];
+            if (upwardNeeded[arc] && upwardCost[arc] != INFINITY_VALUE) {
+                hierarchy.upwardTargets.push_back(upper);
+                hierarchy.upwardCosts.push_back(upwardCost[arc]);
+                hierarchy.upwardArcIds.push_back(2 * arc);
+                hierarchy.upwardOffsets[stop + 1]++;
+                if (hierarchy.arcs[2 * (size_t)arc].edge == NO_EDGE) hierarchy.shortcutCount++;
+            }
+            if (downwardNeeded[arc] && downwardCost[arc] != INFINITY_VALUE) {
+                hierarchy.downwardTargets.push_back(upper);
+                hierarchy.downwardCosts.push_back(downwardCost[arc]);
+                hierarchy.downwardArcIds.push_back(2 * arc + 1);
+                hierarchy.downwardOffsets[stop + 1]++;
+                if (hierarchy.arcs[2 * (size_t)arc + 1].edge == NO_EDGE) hierarchy.shortcutCount++;
+            }
+        }
+    }
+
+    hierarchy.preprocessingMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+}
+
+const size_t DEFAULT_HUB_LABEL_BUDGET_MB = 64;
+const uint32_t HUB_LABEL_FILE_MAGIC = 0x4C425548;
+
+// Cheapest hub shared by a forward and a backward label, both sorted by hub.
+// Returns the entry index in each label, or NO_STOP when they share no hub.
+// With SSE2, blocks of four hubs are compared all against all at once and
+// the block with the smaller last hub moves on.
+template <class Weight>
+pair<uint32_t, uint32_t> cheapestCommonHub(
+    const uint32_t* forwardHubs, const Weight* forwardCosts, uint32_t forwardCount,
+    const uint32_t* backwardHubs, const Weight* backwardCosts, uint32_t backwardCount
+) {
+    Weight bestCost = numeric_limits<Weight>::max();
+    pair<uint32_t, uint32_t> best(NO_STOP, NO_STOP);
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+#ifdef HUB_LABELS_SSE2
+    while (i + 4 <= forwardCount && j + 4 <= backwardCount) {
+        __m128i forwardBlock = _mm_loadu_si128((const __m128i*)(forwardHubs + i));
+        __m128i backwardBlock = _mm_loadu_si128((const __m128i*)(backwardHubs + j));
+        __m128i matches = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(forwardBlock, backwardBlock),
+                _mm_cmpeq_epi32(forwardBlock, _mm_shuffle_epi32(backwardBlock, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(forwardBlock, _mm_shuffle_epi32(backwardBlock, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(forwardBlock, _mm_shuffle_epi32(backwardBlock, _MM_SHUFFLE(2, 1, 0, 3)))));
+
+        for (int mask = _mm_movemask_ps(_mm_castsi128_ps(matches)), lane = 0; mask != 0; mask >>= 1, lane++) {
+            if (!(mask & 1)) continue;
+            for (uint32_t other = j; other < j + 4; other++) {
+                if (backwardHubs[other] == forwardHubs[i + lane]) {
+                    if (forwardCosts[i + lane] + backwardCosts[other] < bestCost) {
+                        bestCost = forwardCosts[i + lane] + backwardCosts[other];
+                        best = make_pair(i + lane, other);
+                    }
+                    break;
+                }
+            }
+        }
+
+        uint32_t forwardLast = forwardHubs[i + 3];
+        uint32_t backwardLast = backwardHubs[j + 3];
+        if (forwardLast <= backwardLast) i += 4;
+        if (backwardLast <= forwardLast) j += 4;
+    }
+#endif
+
+    while (i < forwardCount && j < backwardCount) {
+        if (forwardHubs[i] < backwardHubs[j]) {
+            i++;
+        }
+        else if (backwardHubs[j] < forwardHubs[i]) {
+            j++;
+        }
+        else {
+            if (forwardCosts[i] + backwardCosts[j] < bestCost) {
+                bestCost = forwardCosts[i] + backwardCosts[j];
+                best = make_pair(i, j);
+            }
+            i++;
+            j++;
+        }
+    }
+
+    return best;
+}
+
+// FNV-1a over the ranks and search graphs, so saved labels are only reused
+// for the very hierarchy they were built from
+template <class Weight>
+uint64_t hierarchyFingerprint(const ContractionHierarchy<Weight>& hierarchy) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void* data, size_t bytes) {
+        const unsigned char* next = (const unsigned char*)data;
+        for (size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ next[i]) * 1099511628211ull;
+        }
+    };
+
+    mix(hierarchy.rank.data(), hierarchy.rank.size() * sizeof(uint32_t));
+    mix(hierarchy.upwardTargets.data(), hierarchy.upwardTargets.size() * sizeof(uint32_t));
+    mix(hierarchy.upwardCosts.data(), hierarchy.upwardCosts.size() * sizeof(Weight));
+    mix(hierarchy.downwardTargets.data(), hierarchy.downwardTargets.size() * sizeof(uint32_t));
+    mix(hierarchy.downwardCosts.data(), hierarchy.downwardCosts.size() * sizeof(Weight));
+    return hash;
+}
+
+// Hub labels of one direction while they are being built: entries are
+// appended stop by stop and each stop remembers where its label starts
+template <class Weight>
+struct LabelBuffer {
+    vector<uint32_t> begin;
+    vector<uint32_t> end;
+    vector<uint32_t> hubs;
+    vector<Weight> costs;
+    vector<uint32_t> nextStops;
+    vector<uint32_t> arcs;
+
+    // Copy into stop-indexed CSR arrays
+    void compact(vector<uint32_t>& offsets, vector<uint32_t>& outHubs, vector<Weight>& outCosts,
+        vector<uint32_t>& outNextStops, vector<uint32_t>& outArcs) const {
+        uint32_t stopCount = (uint32_t)begin.size();
+        offsets.assign(stopCount + 1, 0);
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            offsets[stop + 1] = offsets[stop] + (end[stop] - begin[stop]);
+        }
+
+        outHubs.reserve(hubs.size());
+        outCosts.reserve(hubs.size());
+        outNextStops.reserve(hubs.size());
+        outArcs.reserve(hubs.size());
+        for (uint32_t stop = 0; stop < stopCount; stop++) {
+            outHubs.insert(outHubs.end(), hubs.begin() + begin[stop], hubs.begin() + end[stop]);
+            outCosts.insert(outCosts.end(), costs.begin() + begin[stop], costs.begin() + end[stop]);
+            outNextStops.insert(outNextStops.end(), nextStops.begin() + begin[stop], nextStops.begin() + end[stop]);
+            outArcs.insert(outArcs.end(), arcs.begin() + begin[stop], arcs.begin() + end[stop]);
+        }
+    }
+};
+
+// One label of a stop, gathered from its neighbours' labels. Candidates are
+// (hub, cost, next stop, arc) with the stop's own zero-cost entry first.
+template <class Weight>
+void appendPrunedLabel(
+    uint32_t stop,
+    vector<tuple<uint32_t, Weight, uint32_t, uint32_t>>& candidates,
+    vector<uint32_t>& candidateHubs,
+    vector<Weight>& candidateCosts,
+    const LabelBuffer<Weight>& opposite,
+    bool candidatesAreForward,
+    LabelBuffer<Weight>& labels
+) {
+    // Cheapest entry per hub
+    sort(candidates.begin(), candidates.end());
+    candidateHubs.clear();
+    candidateCosts.clear();
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (kept > 0 && get<0>(candidates[kept - 1]) == get<0>(candidates[i])) continue;
+        candidates[kept++] = candidates[i];
+        candidateHubs.push_back(get<0>(candidates[i]));
+        candidateCosts.push_back(get<1>(candidates[i]));
+    }
+    candidates.resize(kept);
+
+    // Drop entries another shared hub beats: their cost is not the real one
+    labels.begin[stop] = (uint32_t)labels.hubs.size();
+    for (const auto& candidate : candidates) {
+        uint32_t hub = get<0>(candidate);
+        if (hub != stop) {
+            const uint32_t* hubLabel = opposite.hubs.data() + opposite.begin[hub];
+            const Weight* hubCosts = opposite.costs.data() + opposite.begin[hub];
+            uint32_t hubCount = opposite.end[hub] - opposite.begin[hub];
+            pair<uint32_t, uint32_t> best = candidatesAreForward
+                ? cheapestCommonHub(candidateHubs.data(), candidateCosts.data(), (uint32_t)kept, hubLabel, hubCosts, hubCount)
+                : cheapestCommonHub(hubLabel, hubCosts, hubCount, candidateHubs.data(), candidateCosts.data(), (uint32_t)kept);
+            Weight bestCost = candidatesAreForward
+                ? candidateCosts[best.first] + hubCosts[best.second]
+                : hubCosts[best.first] + candidateCosts[best.second];
+            if (bestCost < get<1>(candidate)) continue;
+        }
+
+        labels.hubs.push_back(hub);
+        labels.costs.push_back(get<1>(candidate));
+        labels.nextStops.push_back(get<2>(candidate));
+        labels.arcs.push_back(get<3>(candidate));
+    }
+    labels.end[stop] = (uint32_t)labels.hubs.size();
+}
+
+// Build hub labels from a hierarchy, from the highest-ranked stop down. A
+// stop's forward label is its own entry plus the forward labels of its upward
+// neighbours shifted by the arc cost; backward labels do the same over the
+// downward arcs. Returns null once the labels outgrow budgetBytes.
+template <class Weight>
+shared_ptr<const HubLabels<Weight>> buildHubLabels(shared_ptr<const ContractionHierarchy<Weight>> hierarchy, size_t budgetBytes) {
+    auto startTime = chrono::steady_clock::now();
+    const ContractionHierarchy<Weight>& ch = *hierarchy;
+    uint32_t stopCount = (uint32_t)ch.rank.size();
+    size_t entryBytes = 3 * sizeof(uint32_t) + sizeof(Weight);
+
+    vector<uint32_t> order(stopCount);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        order[stopCount - 1 - ch.rank[stop]] = stop;
+    }
+
+    LabelBuffer<Weight> forward;
+    LabelBuffer<Weight> backward;
+    forward.begin.assign(stopCount, 0);
+    forward.end.assign(stopCount, 0);
+    backward.begin.assign(stopCount, 0);
+    backward.end.assign(stopCount, 0);
+
+    vector<tuple<uint32_t, Weight, uint32_t, uint32_t>> candidates;
+    vector<uint32_t> candidateHubs;
+    vector<Weight> candidateCosts;
+
+    for (uint32_t stop : order) {
+        // Forward: stop -> neighbour -> ... -> hub; remember the last arc into the hub
+        candidates.clear();
+        candidates.push_back(make_tuple(stop, Weight(0), NO_STOP, NO_EDGE));
+        for (uint32_t slot = ch.upwardOffsets[stop]; slot < ch.upwardOffsets[stop + 1]; slot++) {
+            uint32_t neighbor = ch.upwardTargets[slot];
+            for (uint32_t entry = forward.begin[neighbor]; entry < forward.end[neighbor]; entry++) {
+                bool direct = forward.hubs[entry] == neighbor;
+                candidates.push_back(make_tuple(forward.hubs[entry], ch.upwardCosts[slot] + forward.costs[entry],
+                    direct ? stop : forward.nextStops[entry], direct ? ch.upwardArcIds[slot] : forward.arcs[entry]));
+            }
+        }
+        appendPrunedLabel(stop, candidates, candidateHubs, candidateCosts, backward, true, forward);
+
+        // Backward: hub -> ... -> neighbour -> stop; remember the first arc out of the hub
+        candidates.clear();
+        candidates.push_back(make_tuple(stop, Weight(0), NO_STOP, NO_EDGE));
+        for (uint32_t slot = ch.downwardOffsets[stop]; slot < ch.downwardOffsets[stop + 1]; slot++) {
+            uint32_t neighbor = ch.downwardTargets[slot];
+            for (uint32_t entry = backward.begin[neighbor]; entry < backward.end[neighbor]; entry++) {
+                bool direct = backward.hubs[entry] == neighbor;
+                candidates.push_back(make_tuple(backward.hubs[entry], ch.downwardCosts[slot] + backward.costs[entry],
+                    direct ? stop : backward.nextStops[entry], direct ? ch.downwardArcIds[slot] : backward.arcs[entry]));
+            }
+        }
+        appendPrunedLabel(stop, candidates, candidateHubs, candidateCosts, forward, false, backward);
+
+        if ((forward.hubs.size() + backward.hubs.size()) * entryBytes > budgetBytes) {
+            return nullptr;
+        }
+    }
+
+    auto labels = make_shared<HubLabels<Weight>>();
+    forward.compact(labels->forwardOffsets, labels->forwardHubs, labels->forwardCosts, labels->forwardNextStops, labels->forwardArcs);
+    backward.compact(labels->backwardOffsets, labels->backwardHubs, labels->backwardCosts, labels->backwardNextStops, labels->backwardArcs);
+    labels->hierarchy = hierarchy;
+    labels->fingerprint = hierarchyFingerprint(ch);
+    labels->preprocessingMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+    return labels;
+}
+
+const uint64_t FILE_CHECKSUM_SEED = 14695981039346656037ull;
+
+// FNV-1a over 64-bit words, fast enough to check a cache file on every start;
+// pass the previous result as hash to continue over several blocks
+uint64_t fileChecksum(const char* data, size_t bytes, uint64_t hash = FILE_CHECKSUM_SEED) {
+    size_t words = bytes / sizeof(uint64_t);
+    for (size_t word = 0; word < words; word++) {
+        uint64_t value;
+        memcpy(&value, data + word * sizeof(uint64_t), sizeof(value));
+        hash = (hash ^ value) * 1099511628211ull;
+    }
+    for (size_t byte = words * sizeof(uint64_t); byte < bytes; byte++) {
+        hash = (hash ^ (unsigned char)data[byte]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+template <class T>
+uint64_t arrayChecksum(const vector<T>& values, uint64_t hash) {
+    return fileChecksum((const char*)values.data(), values.size() * sizeof(T), hash);
+}
+
+template <class Weight>
+uint64_t labelChecksum(const HubLabels<Weight>& labels) {
+    uint64_t hash = FILE_CHECKSUM_SEED;
+    hash = arrayChecksum(labels.forwardOffsets, hash);
+    hash = arrayChecksum(labels.forwardHubs, hash);
+    hash = arrayChecksum(labels.forwardCosts, hash);
+    hash = arrayChecksum(labels.forwardNextStops, hash);
+    hash = arrayChecksum(labels.forwardArcs, hash);
+    hash = arrayChecksum(labels.backwardOffsets, hash);
+    hash = arrayChecksum(labels.backwardHubs, hash);
+    hash = arrayChecksum(labels.backwardCosts, hash);
+    hash = arrayChecksum(labels.backwardNextStops, hash);
+    return arrayChecksum(labels.backwardArcs, hash);
+}
+
+template <class T>
+void writeArray(ofstream& file, const vector<T>& values) {
+    uint64_t count = values.size();
+    file.write((const char*)&count, sizeof(count));
+    file.write((const char*)values.data(), count * sizeof(T));
+}
+
+// The stored count is only trusted up to the bytes left in the file, so a
+// damaged file cannot ask for an absurd allocation
+template <class T>
+bool readArray(ifstream& file, vector<T>& values, uint64_t& bytesLeft) {
+    uint64_t count = 0;
+    if (bytesLeft < sizeof(count) || !file.read((char*)&count, sizeof(count))) return false;
+    bytesLeft -= sizeof(count);
+    if (count > bytesLeft / sizeof(T)) return false;
+    bytesLeft -= count * sizeof(T);
+    values.resize((size_t)count);
+    return (bool)file.read((char*)values.data(), count * sizeof(T));
+}
+
+// A CSR index read from disk: rows + 1 offsets that start at 0, never
+// decrease and end at the entry count
+inline bool validOffsets(const vector<uint32_t>& offsets, size_t rows, size_t total) {
+    if (offsets.size() != rows + 1 || offsets.front() != 0 || offsets.back() != total) {
+        return false;
+    }
+    for (size_t row = 0; row < rows; row++) {
+        if (offsets[row] > offsets[row + 1]) return false;
+    }
+    return true;
+}
+
+// Every id read from disk is below limit, or is the "none" sentinel
+// (NO_STOP / NO_EDGE) where orNone allows it
+inline bool validIds(const vector<uint32_t>& ids, size_t limit, bool orNone = false) {
+    for (uint32_t id : ids) {
+        if (id >= limit && !(orNone && id == NO_EDGE)) return false;
+    }
+    return true;
+}
+
+// An arc unpackHierarchyArc can expand: an original edge or a shortcut. A
+// customized hierarchy also keeps slots for arcs no metric path uses, which
+// have neither and must never be referenced.
+template <class Weight>
+bool usableArc(const ContractionHierarchy<Weight>& hierarchy, uint32_t arcId) {
+    const HierarchyArc& arc = hierarchy.arcs[arcId];
+    return arc.edge != NO_EDGE || arc.firstChild != NO_EDGE;
+}
+
+// One direction of a label set read from disk is well formed: offsets start
+// at 0, never decrease and end at the entry count; every label lists distinct
+// hubs in ascending order; and the path pointers name real stops and arcs
+template <class Weight>
+bool validLabelSide(const vector<uint32_t>& offsets, const vector<uint32_t>& hubs, const vector<Weight>& costs,
+    const vector<uint32_t>& nextStops, const vector<uint32_t>& arcs, uint32_t stopCount, uint32_t arcCount) {
+    if (offsets.size() != (size_t)stopCount + 1 || offsets.front() != 0 || offsets.back() != hubs.size() ||
+        costs.size() != hubs.size() || nextStops.size() != hubs.size() || arcs.size() != hubs.size()) {
+        return false;
+    }
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        if (offsets[stop] > offsets[stop + 1]) return false;
+        for (uint32_t entry = offsets[stop]; entry < offsets[stop + 1]; entry++) {
+            if (hubs[entry] >= stopCount || (entry > offsets[stop] && hubs[entry] <= hubs[entry - 1]) ||
+                !(costs[entry] >= 0) || (nextStops[entry] != NO_STOP && nextStops[entry] >= stopCount) ||
+                (arcs[entry] != NO_EDGE && arcs[entry] >= arcCount)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Both directions of labels read from disk fit hierarchy, and every arc they
+// name can be unpacked
+template <class Weight>
+bool validHubLabels(const HubLabels<Weight>& labels, const ContractionHierarchy<Weight>& hierarchy) {
+    uint32_t stopCount = (uint32_t)hierarchy.rank.size();
+    uint32_t arcCount = (uint32_t)hierarchy.arcs.size();
+    if (!validLabelSide(labels.forwardOffsets, labels.forwardHubs, labels.forwardCosts,
+            labels.forwardNextStops, labels.forwardArcs, stopCount, arcCount) ||
+        !validLabelSide(labels.backwardOffsets, labels.backwardHubs, labels.backwardCosts,
+            labels.backwardNextStops, labels.backwardArcs, stopCount, arcCount)) {
+        return false;
+    }
+    for (const vector<uint32_t>* arcs : { &labels.forwardArcs, &labels.backwardArcs }) {
+        for (uint32_t arc : *arcs) {
+            if (arc != NO_EDGE && !usableArc(hierarchy, arc)) return false;
+        }
+    }
+    return true;
+}
+
+template <class Weight>
+bool saveHubLabels(const HubLabels<Weight>& labels, const string& path) {
+    ofstream file(path, ios::binary | ios::trunc);
+    uint32_t header[2] = { HUB_LABEL_FILE_MAGIC, (uint32_t)sizeof(Weight) };
+    file.write((const char*)header, sizeof(header));
+    file.write((const char*)&labels.fingerprint, sizeof(labels.fingerprint));
+    uint64_t checksum = labelChecksum(labels);
+    file.write((const char*)&checksum, sizeof(checksum));
+
+    writeArray(file, labels.forwardOffsets);
+    writeArray(file, labels.forwardHubs);
+    writeArray(file, labels.forwardCosts);
+    writeArray(file, labels.forwardNextStops);
+    writeArray(file, labels.forwardArcs);
+    writeArray(file, labels.backwardOffsets);
+    writeArray(file, labels.backwardHubs);
+    writeArray(file, labels.backwardCosts);
+    writeArray(file, labels.backwardNextStops);
+    writeArray(file, labels.backwardArcs);
+    return (bool)file;
+}
+
+// Labels saved for this exact hierarchy, or null when the file is missing,
+// damaged or was written for another network or metric; the caller then
+// builds them afresh
+template <class Weight>
+shared_ptr<const HubLabels<Weight>> loadHubLabels(const string& path, shared_ptr<const ContractionHierarchy<Weight>> hierarchy) {
+    ifstream file(path, ios::binary | ios::ate);
+    uint32_t header[2] = { 0, 0 };
+    uint64_t fingerprint = 0;
+    uint64_t checksum = 0;
+    if (!file) {
+        return nullptr;
+    }
+    uint64_t bytesLeft = (uint64_t)file.tellg();
+    file.seekg(0);
+    if (bytesLeft < sizeof(header) + sizeof(fingerprint) + sizeof(checksum) || !file.read((char*)header, sizeof(header)) ||
+        !file.read((char*)&fingerprint, sizeof(fingerprint)) || !file.read((char*)&checksum, sizeof(checksum))) {
+        return nullptr;
+    }
+    bytesLeft -= sizeof(header) + sizeof(fingerprint) + sizeof(checksum);
+    if (header[0] != HUB_LABEL_FILE_MAGIC || header[1] != sizeof(Weight) || fingerprint != hierarchyFingerprint(*hierarchy)) {
+        return nullptr;
+    }
+
+    auto labels = make_shared<HubLabels<Weight>>();
+    bool complete = readArray(file, labels->forwardOffsets, bytesLeft) && readArray(file, labels->forwardHubs, bytesLeft) &&
+        readArray(file, labels->forwardCosts, bytesLeft) && readArray(file, labels->forwardNextStops, bytesLeft) &&
+        readArray(file, labels->forwardArcs, bytesLeft) && readArray(file, labels->backwardOffsets, bytesLeft) &&
+        readArray(file, labels->backwardHubs, bytesLeft) && readArray(file, labels->backwardCosts, bytesLeft) &&
+        readArray(file, labels->backwardNextStops, bytesLeft) && readArray(file, labels->backwardArcs, bytesLeft);
+    if (!complete || bytesLeft != 0 || labelChecksum(*labels) != checksum || !validHubLabels(*labels, *hierarchy)) {
+        return nullptr;
+    }
+
+    labels->hierarchy = hierarchy;
+    labels->fingerprint = fingerprint;
+    labels->loadedFromDisk = true;
+    return labels;
+}
+
+// Index of hub in the label stored at hubs[first, last)
+inline uint32_t findLabelEntry(const vector<uint32_t>& hubs, uint32_t first, uint32_t last, uint32_t hub) {
+    return (uint32_t)(lower_bound(hubs.begin() + first, hubs.begin() + last, hub) - hubs.begin());
+}
+
+inline const shared_ptr<const HubLabels<double>>& labelsFor(const CompactGraph& network, const DistanceCost&) { return network.distanceLabels; }
+inline const shared_ptr<const HubLabels<int>>& labelsFor(const CompactGraph& network, const FareCost&) { return network.fareLabels; }
+
+const uint32_t DEFAULT_PARETO_FRONT = 8;
+const uint32_t MAX_PARETO_FRONT = 32;
+// Labels one Pareto search may create before it returns the front found so far
+const uint32_t MAX_PARETO_LABELS = 1 << 18;
+const uint32_t NO_LABEL = UINT32_MAX;
+// Labels within this fraction of the shortest/cheapest routes' cost of one
+// already at the same stop are dropped; it keeps grid-like networks, where
+// nearly every detour is a trade-off, to a few dozen journeys
+const double DEFAULT_PARETO_SLACK = 0.05;
+
+// A journey prefix in the multi-criteria search. The labels at one stop form a
+// bag linked through nextInBag; a label beaten after it was queued is flagged
+// dominated and skipped when it is popped.
+struct ParetoLabel {
+    double distance = 0;
+    int fare = 0;
+    uint32_t transfers = 0;
+    uint32_t stop = NO_STOP;
+    uint32_t bus = NO_BUS;
+    uint32_t parent = NO_LABEL;
+    uint32_t edge = NO_EDGE;
+    uint32_t nextInBag = NO_LABEL;
+    bool dominated = false;
+};
+
+// Per-thread scratch space for the Pareto search. Bag heads are stamped with a
+// generation like SearchLabels, and the label pool and heap keep their capacity.
+struct ParetoWorkspace {
+    vector<uint32_t> stamp;
+    vector<uint32_t> bagHeads;
+    vector<ParetoLabel> labels;
+    vector<pair<double, uint32_t>> heap;
+    uint32_t generation = 0;
+    // Set when MAX_PARETO_LABELS cut the search short, so the front may be partial
+    bool exhausted = false;
+
+    void begin(uint32_t stopCount) {
+        if (stamp.size() < stopCount) {
+            stamp.resize(stopCount, 0);
+            bagHeads.resize(stopCount, NO_LABEL);
+        }
+        exhausted = false;
+
+        generation++;
+        if (generation == 0) {
+            fill(stamp.begin(), stamp.end(), 0);
+            generation = 1;
+        }
+        labels.clear();
+        heap.clear();
+    }
+
+    uint32_t& bagHead(uint32_t stop) {
+        if (stamp[stop] != generation) {
+            stamp[stop] = generation;
+            bagHeads[stop] = NO_LABEL;
+        }
+        return bagHeads[stop];
+    }
+
+    static ParetoWorkspace& forThisThread() {
+        thread_local ParetoWorkspace workspace;
+        return workspace;
+    }
+};
+
+// a is no worse than b in every criterion, allowing b to be better by up to
+// tolerance. Before the target, a label on another bus may need one more
+// transfer to continue the way b would.
+inline bool paretoDominates(const ParetoLabel& a, const ParetoLabel& b, bool atTarget, const ParetoLabel& tolerance) {
+    uint32_t extraTransfer = (!atTarget && a.bus != NO_BUS && a.bus != b.bus) ? 1 : 0;
+    return a.distance <= b.distance + tolerance.distance && a.fare <= b.fare + tolerance.fare &&
+        a.transfers + extraTransfer <= b.transfers;
+}
+
+// Add candidate to its stop's bag unless a label there dominates it within
+// tolerance; labels it dominates outright leave the bag. The target's bag is
+// always compared exactly. Returns false when the candidate was rejected.
+inline bool insertParetoLabel(ParetoWorkspace& workspace, ParetoLabel candidate, bool atTarget,
+    const ParetoLabel& tolerance = ParetoLabel()) {
+    const ParetoLabel exact;
+    uint32_t& head = workspace.bagHead(candidate.stop);
+    for (uint32_t* link = &head; *link != NO_LABEL;) {
+        ParetoLabel& existing = workspace.labels[*link];
+        if (paretoDominates(existing, candidate, atTarget, atTarget ? exact : tolerance)) {
+            return false;
+        }
+        if (paretoDominates(candidate, existing, atTarget, exact)) {
+            existing.dominated = true;
+            *link = existing.nextInBag;
+            continue;
+        }
+        link = &existing.nextInBag;
+    }
+
+    candidate.nextInBag = head;
+    candidate.dominated = false;
+    head = (uint32_t)workspace.labels.size();
+    workspace.labels.push_back(candidate);
+    return true;
+}
+
+// Multi-criteria search for the non-dominated (distance, fare, transfers)
+// journeys in one pass. knownRoutes (e.g. the shortest and the cheapest route)
+// enter the target's bag first so pruning starts early. Labels pop in order
+// of distance plus the ALT distance bound. A new label is dropped when a
+// journey at the target dominates it even after adding the ALT distance and
+// fare bounds for the rest of the trip, or when its stop's bag holds a label
+// at most slack worse (slack is a fraction of the known routes' largest
+// distance and fare; 0 keeps the front exact). Leaves the target's bag in
+// front, sorted by distance, and sets workspace.exhausted when the label cap
+// stopped the search with journeys still queued.
+void runParetoSearch(
+    const CompactGraph& network,
+    uint32_t startId,
+    uint32_t targetId,
+    const vector<vector<uint32_t>>& knownRoutes,
+    double slack,
+    ParetoWorkspace& workspace,
+    vector<uint32_t>& front
+) {
+    workspace.begin(network.stopCount());
+    front.clear();
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return;
+    }
+
+    ParetoLabel start;
+    start.stop = startId;
+    insertParetoLabel(workspace, start, startId == targetId);
+
+    double maxDistance = 0;
+    int maxFare = 0;
+    for (const vector<uint32_t>& route : knownRoutes) {
+        // One label per edge, parent-linked; only the last one joins a bag
+        ParetoLabel journey = start;
+        uint32_t parent = 0;
+        for (uint32_t edge : route) {
+            uint32_t bus = network.edgeBusIds[edge];
+            journey.distance += network.edgeDistances[edge];
+            journey.fare += network.edgeFares[edge];
+            journey.transfers += (journey.bus != NO_BUS && journey.bus != bus) ? 1 : 0;
+            journey.stop = network.edgeTargets[edge];
+            journey.bus = bus;
+            journey.parent = parent;
+            journey.edge = edge;
+            parent = (uint32_t)workspace.labels.size();
+            workspace.labels.push_back(journey);
+        }
+        workspace.labels.pop_back();
+        insertParetoLabel(workspace, journey, true);
+
+        maxDistance = max(maxDistance, journey.distance);
+        maxFare = max(maxFare, journey.fare);
+    }
+
+    ParetoLabel tolerance;
+    tolerance.distance = slack * maxDistance;
+    tolerance.fare = (int)(slack * maxFare);
+
+    LandmarkHeuristic<DistanceCost> distanceBound(network, targetId);
+    LandmarkHeuristic<FareCost> fareBound(network, targetId);
+    auto heapOrder = greater<pair<double, uint32_t>>();
+    uint64_t nodesSettled = 0;
+    uint64_t edgesRelaxed = 0;
+    workspace.heap.push_back(make_pair(distanceBound.estimate(startId), 0u));
+
+    while (!workspace.heap.empty() && workspace.labels.size() < MAX_PARETO_LABELS) {
+        pop_heap(workspace.heap.begin(), workspace.heap.end(), heapOrder);
+        uint32_t currentIndex = workspace.heap.back().second;
+        workspace.heap.pop_back();
+
+        ParetoLabel current = workspace.labels[currentIndex];
+        if (current.dominated || current.stop == targetId) {
+            continue;
+        }
+        nodesSettled++;
+
+        for (uint32_t edge : network.neighbors(current.stop)) {
+            uint32_t bus = network.edgeBusIds[edge];
+            edgesRelaxed++;
+
+            ParetoLabel candidate;
+            candidate.distance = current.distance + network.edgeDistances[edge];
+            candidate.fare = current.fare + network.edgeFares[edge];
+            candidate.transfers = current.transfers + ((current.bus != NO_BUS && current.bus != bus) ? 1 : 0);
+            candidate.stop = network.edgeTargets[edge];
+            candidate.bus = bus;
+            candidate.parent = currentIndex;
+            candidate.edge = edge;
+
+            double distanceEstimate = candidate.distance + distanceBound.estimate(candidate.stop);
+            int fareEstimate = candidate.fare + fareBound.estimate(candidate.stop);
+            bool beaten = false;
+            for (uint32_t arrived = workspace.bagHead(targetId); arrived != NO_LABEL && !beaten;
+                arrived = workspace.labels[arrived].nextInBag) {
+                const ParetoLabel& journey = workspace.labels[arrived];
+                beaten = journey.distance <= distanceEstimate && journey.fare <= fareEstimate &&
+                    journey.transfers <= candidate.transfers;
+            }
+
+            if (beaten || !insertParetoLabel(workspace, candidate, candidate.stop == targetId, tolerance)) {
+                continue;
+            }
+            workspace.heap.push_back(make_pair(distanceEstimate, (uint32_t)workspace.labels.size() - 1));
+            push_heap(workspace.heap.begin(), workspace.heap.end(), heapOrder);
+        }
+    }
+    workspace.exhausted = !workspace.heap.empty();
+
+    for (uint32_t arrived = workspace.bagHead(targetId); arrived != NO_LABEL; arrived = workspace.labels[arrived].nextInBag) {
+        front.push_back(arrived);
+    }
+    sort(front.begin(), front.end(), [&workspace](uint32_t a, uint32_t b) {
+        const ParetoLabel& first = workspace.labels[a];
+        const ParetoLabel& second = workspace.labels[b];
+        return tie(first.distance, first.fare, first.transfers) < tie(second.distance, second.fare, second.transfers);
+    });
+
+    searchStats.nodesSettled += nodesSettled;
+    searchStats.edgesRelaxed += edgesRelaxed;
+}
+
+// At most limit journeys of a front sorted by distance: the shortest, the
+// cheapest and the one with fewest transfers first, then evenly spaced picks
+void boundParetoFront(const ParetoWorkspace& workspace, vector<uint32_t>& front, uint32_t limit) {
+    if (front.size() <= limit) {
+        return;
+    }
+
+    size_t cheapest = 0;
+    size_t fewestTransfers = 0;
+    for (size_t i = 1; i < front.size(); i++) {
+        if (workspace.labels[front[i]].fare < workspace.labels[front[cheapest]].fare) cheapest = i;
+        if (workspace.labels[front[i]].transfers < workspace.labels[front[fewestTransfers]].transfers) fewestTransfers = i;
+    }
+
+    vector<size_t> picks = { 0, cheapest, fewestTransfers };
+    for (size_t i = 0; i < limit; i++) {
+        picks.push_back(limit > 1 ? i * (front.size() - 1) / (limit - 1) : 0);
+    }
+
+    vector<bool> chosen(front.size(), false);
+    uint32_t chosenCount = 0;
+    for (size_t pick : picks) {
+        if (chosenCount < limit && !chosen[pick]) {
+            chosen[pick] = true;
+            chosenCount++;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < front.size(); i++) {
+        if (chosen[i]) front[kept++] = front[i];
+    }
+    front.resize(kept);
+}
+
+const uint32_t DEFAULT_KSHORTEST_PATHS = 3;
+const uint32_t MAX_KSHORTEST_PATHS = 16;
+// Spur searches of one Yen round are spread over worker threads from this many stops up
+const uint32_t PARALLEL_SPUR_MIN_STOPS = 1000;
+
+// Stops and edges a Yen spur search may not use. Blocks are stamped, so the
+// next spur search lifts them all by moving to a new stamp instead of
+// copying or editing the graph. Route checks borrow it as a stop/edge set.
+struct SpurMask {
+    vector<uint32_t> blockedEdges;
+    vector<uint32_t> blockedStops;
+    uint32_t stamp = 0;
+
+    void begin(const CompactGraph& network) {
+        if (blockedEdges.size() < network.edgeCount()) {
+            blockedEdges.resize(network.edgeCount(), 0);
+        }
+        if (blockedStops.size() < network.stopCount()) {
+            blockedStops.resize(network.stopCount(), 0);
+        }
+
+        stamp++;
+        if (stamp == 0) {
+            fill(blockedEdges.begin(), blockedEdges.end(), 0);
+            fill(blockedStops.begin(), blockedStops.end(), 0);
+            stamp = 1;
+        }
+    }
+
+    void blockEdge(uint32_t edge) {
+        blockedEdges[edge] = stamp;
+    }
+
+    void blockStop(uint32_t stop) {
+        blockedStops[stop] = stamp;
+    }
+
+    bool edgeBlocked(uint32_t edge) const {
+        return blockedEdges[edge] == stamp;
+    }
+
+    bool stopBlocked(uint32_t stop) const {
+        return blockedStops[stop] == stamp;
+    }
+
+    bool allows(uint32_t edge, uint32_t stop) const {
+        return !edgeBlocked(edge) && !stopBlocked(stop);
+    }
+
+    static SpurMask& forThisThread() {
+        thread_local SpurMask mask;
+        return mask;
+    }
+};
+
+template <class Weight>
+struct RankedPath {
+    Weight cost;
+    vector<uint32_t> edges;
+};
+
+// One spur search of Yen's algorithm: follow previous for spurIndex edges,
+// then reach targetId without revisiting a stop of that prefix or leaving
+// by an edge some accepted path with the same prefix already took. Runs A*
+// with the landmark bound, which masking edges cannot make inadmissible.
+// Returns false when there is no such route.
+template <class CostPolicy>
+bool findSpurPath(
+    const CompactGraph& network,
+    const CostPolicy& cost,
+    const vector<RankedPath<typename CostPolicy::Weight>>& accepted,
+    const vector<uint32_t>& previous,
+    size_t spurIndex,
+    uint32_t startId,
+    uint32_t targetId,
+    RankedPath<typename CostPolicy::Weight>& candidate
+) {
+    typedef typename CostPolicy::Weight Weight;
+
+    SpurMask& mask = SpurMask::forThisThread();
+    mask.begin(network);
+    for (const RankedPath<Weight>& path : accepted) {
+        if (path.edges.size() > spurIndex && equal(previous.begin(), previous.begin() + spurIndex, path.edges.begin())) {
+            mask.blockEdge(path.edges[spurIndex]);
+        }
+    }
+
+    uint32_t spurStop = startId;
+    for (size_t i = 0; i < spurIndex; i++) {
+        mask.blockStop(spurStop);
+        spurStop = network.edgeTargets[previous[i]];
+    }
+
+    SearchWorkspace<Weight>& workspace = SearchWorkspace<Weight>::forThisThread();
+    runDijkstra(network, cost, LandmarkHeuristic<CostPolicy>(network, targetId), spurStop, targetId, workspace, mask);
+    if (!workspace.reached(targetId)) {
+        return false;
+    }
+
+    candidate.edges.assign(previous.begin(), previous.begin() + spurIndex);
+    for (uint32_t stop = targetId; stop != spurStop; stop = workspace.previousStop[stop]) {
+        candidate.edges.push_back(workspace.previousEdge[stop]);
+    }
+    reverse(candidate.edges.begin() + spurIndex, candidate.edges.end());
+
+    candidate.cost = Weight(0);
+    for (uint32_t edge : candidate.edges) {
+        candidate.cost += cost.edgeCost(network, edge);
+    }
+    return true;
+}
+
+// Yen's algorithm: the k cheapest loopless routes from startId to targetId
+// under cost, cheapest first. Every round spurs off each stop of the route
+// accepted last. Those spur searches are independent, so on large networks
+// they are split over worker threads, each reusing its own workspace and
+// mask across its share; their search counters are added to this thread's.
+template <class CostPolicy>
+void runYen(const CompactGraph& network, const CostPolicy& cost, uint32_t startId, uint32_t targetId, uint32_t k,
+    vector<RankedPath<typename CostPolicy::Weight>>& accepted) {
+    typedef typename CostPolicy::Weight Weight;
+
+    accepted.clear();
+    RankedPath<Weight> shortest;
+    if (k == 0 || !findSpurPath(network, cost, accepted, vector<uint32_t>(), 0, startId, targetId, shortest)) {
+        return;
+    }
+    accepted.push_back(move(shortest));
+
+    vector<RankedPath<Weight>> candidates;
+    vector<RankedPath<Weight>> spurs;
+    vector<char> found;
+    while (accepted.size() < k) {
+        const vector<uint32_t> previous = accepted.back().edges;
+        size_t spurCount = previous.size();
+        spurs.assign(spurCount, RankedPath<Weight>());
+        found.assign(spurCount, 0);
+
+        auto spurRange = [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                found[i] = findSpurPath(network, cost, accepted, previous, i, startId, targetId, spurs[i]);
+            }
+        };
+
+        size_t workerCount = network.stopCount() < PARALLEL_SPUR_MIN_STOPS ? 1 :
+            min<size_t>(max(1u, thread::hardware_concurrency()), spurCount);
+        if (workerCount <= 1) {
+            spurRange(0, spurCount);
+        }
+        else {
+            vector<SearchStats> workerStats(workerCount);
+            vector<thread> workers;
+            size_t chunk = (spurCount + workerCount - 1) / workerCount;
+            for (size_t worker = 0; worker * chunk < spurCount; worker++) {
+                workers.emplace_back([&spurRange, &workerStats, worker, chunk, spurCount]() {
+                    spurRange(worker * chunk, min(spurCount, (worker + 1) * chunk));
+                    workerStats[worker] = searchStats;
+                });
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            for (const SearchStats& stats : workerStats) {
+                searchStats.nodesSettled += stats.nodesSettled;
+                searchStats.edgesRelaxed += stats.edgesRelaxed;
+            }
+        }
+
+        for (size_t i = 0; i < spurCount; i++) {
+            if (!found[i]) {
+                continue;
+            }
+            bool known = false;
+            for (const RankedPath<Weight>& path : accepted) {
+                known = known || path.edges == spurs[i].edges;
+            }
+            for (const RankedPath<Weight>& path : candidates) {
+                known = known || path.edges == spurs[i].edges;
+            }
+            if (!known) {
+                candidates.push_back(move(spurs[i]));
+            }
+        }
+        if (candidates.empty()) {
+            break;
+        }
+
+        // Cheapest candidate next, the one with fewer edges among equals
+        size_t best = 0;
+        for (size_t i = 1; i < candidates.size(); i++) {
+            if (candidates[i].cost < candidates[best].cost ||
+                (candidates[i].cost == candidates[best].cost && candidates[i].edges.size() < candidates[best].edges.size())) {
+                best = i;
+            }
+        }
+        accepted.push_back(move(candidates[best]));
+        candidates.erase(candidates.begin() + best);
+    }
+}
+
+const uint32_t MAX_ALTERNATIVE_ROUTES = 3;
+// Alternatives may cost at most this much more than the best route...
+const double ALTERNATIVE_MAX_STRETCH = 0.3;
+// ...and share at most this fraction of their cost with any route kept before them
+const double ALTERNATIVE_MAX_SHARING = 0.5;
+
+// A maximal chain of edges that lie on both the forward and the backward
+// shortest-path tree, from stop first to stop last
+template <class Weight>
+struct Plateau {
+    uint32_t first;
+    uint32_t last;
+    Weight length;
+};
+
+// Alternative routes by the plateau method. One forward tree from startId
+// and one backward tree into targetId are grown over the whole network; an
+// edge on both trees lies on a plateau, and each maximal plateau gives a
+// route: the forward tree to it, the plateau, and the backward tree on from
+// it. Long plateaus make natural routes, so they are tried longest first,
+// and a route is kept when it is loopless, within the stretch bound and
+// shares little with the routes kept before it. The shortest route, one big
+// plateau, always comes first, taken from the forward tree. Both trees serve
+// every alternative, so the whole query costs two Dijkstra runs plus a
+// linear scan.
+template <class CostPolicy>
+void findPlateauAlternatives(const CompactGraph& network, const CostPolicy& cost, uint32_t startId, uint32_t targetId,
+    uint32_t maxRoutes, vector<RankedPath<typename CostPolicy::Weight>>& routes) {
+    typedef typename CostPolicy::Weight Weight;
+
+    routes.clear();
+    SearchWorkspace<Weight>& forward = SearchWorkspace<Weight>::forThisThread(0);
+    SearchWorkspace<Weight>& backward = SearchWorkspace<Weight>::forThisThread(1);
+    ZeroHeuristic noHeuristic(network, NO_STOP);
+    runDijkstra(network, cost, noHeuristic, startId, NO_STOP, forward);
+    if (startId == NO_STOP || targetId == NO_STOP || !forward.reached(targetId)) {
+        return;
+    }
+    runDijkstra<BackwardSearch>(network, cost, noHeuristic, targetId, NO_STOP, backward);
+
+    Weight best = forward.bestCost[targetId];
+    Weight limit = best + Weight(best * ALTERNATIVE_MAX_STRETCH);
+    auto onPlateau = [&](uint32_t edge) {
+        uint32_t from = network.edgeSources[edge];
+        uint32_t to = network.edgeTargets[edge];
+        return forward.reached(to) && forward.previousEdge[to] == edge && backward.reached(from) && backward.previousEdge[from] == edge;
+    };
+
+    // The forward tree's own route to targetId goes first, ahead of any plateau
+    vector<Plateau<Weight>> plateaus(1, Plateau<Weight>{ targetId, targetId, best });
+    for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+        if (!forward.reached(stop) || !backward.reached(stop) || forward.bestCost[stop] + backward.bestCost[stop] > limit) {
+            continue;
+        }
+        if (forward.previousEdge[stop] != NO_EDGE && onPlateau(forward.previousEdge[stop])) {
+            continue;
+        }
+
+        uint32_t last = stop;
+        while (backward.previousEdge[last] != NO_EDGE && onPlateau(backward.previousEdge[last])) {
+            last = backward.previousStop[last];
+        }
+        if (last != stop) {
+            plateaus.push_back(Plateau<Weight>{ stop, last, forward.bestCost[last] - forward.bestCost[stop] });
+        }
+    }
+    stable_sort(plateaus.begin(), plateaus.end(), [](const Plateau<Weight>& a, const Plateau<Weight>& b) {
+        return a.length > b.length;
+    });
+
+    SpurMask& mask = SpurMask::forThisThread();
+    RankedPath<Weight> candidate;
+    for (const Plateau<Weight>& plateau : plateaus) {
+        if (routes.size() >= maxRoutes) {
+            break;
+        }
+
+        candidate.edges.clear();
+        for (uint32_t stop = plateau.first; stop != startId; stop = forward.previousStop[stop]) {
+            candidate.edges.push_back(forward.previousEdge[stop]);
+        }
+        reverse(candidate.edges.begin(), candidate.edges.end());
+        for (uint32_t stop = plateau.first; stop != targetId; stop = backward.previousStop[stop]) {
+            candidate.edges.push_back(backward.previousEdge[stop]);
+        }
+        candidate.cost = forward.bestCost[plateau.first] + backward.bestCost[plateau.first];
+
+        // The two tree paths may cross each other
+        mask.begin(network);
+        mask.blockStop(startId);
+        bool loopless = true;
+        for (uint32_t edge : candidate.edges) {
+            loopless = loopless && !mask.stopBlocked(network.edgeTargets[edge]);
+            mask.blockStop(network.edgeTargets[edge]);
+        }
+
+        bool distinct = loopless;
+        for (size_t i = 0; distinct && i < routes.size(); i++) {
+            mask.begin(network);
+            for (uint32_t edge : routes[i].edges) {
+                mask.blockEdge(edge);
+            }
+            Weight shared = Weight(0);
+            for (uint32_t edge : candidate.edges) {
+                if (mask.edgeBlocked(edge)) shared += cost.edgeCost(network, edge);
+            }
+            distinct = shared <= candidate.cost * ALTERNATIVE_MAX_SHARING;
+        }
+
+        if (distinct) {
+            routes.push_back(candidate);
+        }
+    }
+}
+
+// Limits for the dfs/bfs traversals; 0 means unlimited
+const uint32_t DEFAULT_TRAVERSAL_DEPTH = 0;
+const uint32_t DEFAULT_TRAVERSAL_BUDGET = 0;
+
+// Scratch space for the iterative traversals: one visited bit per stop
+// (clearing only the words a query touched), the explicit DFS stack and the
+// BFS queue. A stop's parent edge and depth are only meaningful while its
+// bit is set.
+struct TraversalWorkspace {
+    struct Frame {
+        uint32_t stop;
+        uint32_t nextEdge;
+    };
+
+    vector<uint64_t> visited;
+    vector<uint32_t> touchedWords;
+    vector<uint32_t> parentEdge;
+    // Fewest edges on which a depth-limited DFS has reached each stop
+    vector<uint32_t> depth;
+    vector<Frame> stack;
+    vector<uint32_t> queue;
+    // Set when the depth or node budget cut the search short
+    bool exhausted = false;
+
+    void begin(uint32_t stopCount) {
+        if (parentEdge.size() < stopCount) {
+            visited.resize((stopCount + 63) / 64, 0);
+            parentEdge.resize(stopCount);
+            depth.resize(stopCount);
+        }
+        for (uint32_t word : touchedWords) {
+            visited[word] = 0;
+        }
+        touchedWords.clear();
+        stack.clear();
+        queue.clear();
+        exhausted = false;
+    }
+
+    bool wasVisited(uint32_t stop) const {
+        return (visited[stop >> 6] >> (stop & 63)) & 1;
+    }
+
+    void visit(uint32_t stop, uint32_t viaEdge) {
+        uint64_t& word = visited[stop >> 6];
+        if (word == 0) touchedWords.push_back(stop >> 6);
+        word |= uint64_t(1) << (stop & 63);
+        parentEdge[stop] = viaEdge;
+    }
+
+    static TraversalWorkspace& forThisThread() {
+        thread_local TraversalWorkspace workspace;
+        return workspace;
+    }
+};
+
+// Iterative depth-first search from startId for targetId, taking each stop's
+// edges in order and never revisiting a stop. Routes stop at maxDepth edges
+// and the search gives up after visiting maxStops stops (0 for no limit).
+// With a depth limit a stop is expanded again when a branch reaches it on
+// fewer edges than before, since the deeper visit may have been cut short
+// before reaching the target; each stop is expanded at most maxDepth times.
+// On success the route's edges are left in order in edges.
+inline bool runDepthFirst(
+    const CompactGraph& network,
+    uint32_t startId,
+    uint32_t targetId,
+    uint32_t maxDepth,
+    uint32_t maxStops,
+    TraversalWorkspace& ws,
+    vector<uint32_t>& edges
+) {
+    ws.begin(network.stopCount());
+    ws.visit(startId, NO_EDGE);
+    ws.depth[startId] = 0;
+    ws.stack.push_back(TraversalWorkspace::Frame{ startId, network.edgeOffsets[startId] });
+    uint32_t visitedStops = 1;
+    searchStats.nodesSettled++;
+
+    bool found = startId == targetId;
+    while (!found && !ws.stack.empty()) {
+        TraversalWorkspace::Frame& top = ws.stack.back();
+        if (top.nextEdge == network.edgeOffsets[top.stop + 1]) {
+            ws.stack.pop_back();
+            continue;
+        }
+
+        uint32_t edge = top.nextEdge++;
+        uint32_t neighborStop = network.edgeTargets[edge];
+        // The stack holds the route so far, one frame per stop
+        uint32_t neighborDepth = (uint32_t)ws.stack.size();
+        searchStats.edgesRelaxed++;
+        if (ws.wasVisited(neighborStop) && (maxDepth == 0 || ws.depth[neighborStop] <= neighborDepth)) continue;
+
+        if (maxDepth != 0 && neighborDepth > maxDepth) {
+            ws.exhausted = true;
+            continue;
+        }
+        if (maxStops != 0 && visitedStops >= maxStops) {
+            ws.exhausted = true;
+            break;
+        }
+
+        ws.visit(neighborStop, edge);
+        ws.depth[neighborStop] = neighborDepth;
+        ws.stack.push_back(TraversalWorkspace::Frame{ neighborStop, network.edgeOffsets[neighborStop] });
+        visitedStops++;
+        searchStats.nodesSettled++;
+        found = neighborStop == targetId;
+    }
+
+    edges.clear();
+    if (!found) return false;
+    for (size_t i = 1; i < ws.stack.size(); i++) {
+        edges.push_back(ws.parentEdge[ws.stack[i].stop]);
+    }
+    return true;
+}
+
+// Breadth-first search from startId, level by level, so targetId is reached
+// with the fewest edges. Limits work as in runDepthFirst; a depth limit here
+// only drops routes that are genuinely too long.
+inline bool runBreadthFirst(
+    const CompactGraph& network,
+    uint32_t startId,
+    uint32_t targetId,
+    uint32_t maxDepth,
+    uint32_t maxStops,
+    TraversalWorkspace& ws,
+    vector<uint32_t>& edges
+) {
+    ws.begin(network.stopCount());
+    ws.visit(startId, NO_EDGE);
+    ws.queue.push_back(startId);
+    uint32_t visitedStops = 1;
+    searchStats.nodesSettled++;
+
+    bool found = startId == targetId;
+    size_t levelStart = 0;
+    for (uint32_t depth = 0; !found && levelStart < ws.queue.size(); depth++) {
+        size_t levelEnd = ws.queue.size();
+        if (maxDepth != 0 && depth == maxDepth) {
+            ws.exhausted = true;
+            break;
+        }
+
+        for (size_t i = levelStart; !found && i < levelEnd; i++) {
+            for (uint32_t edge : network.neighbors(ws.queue[i])) {
+                uint32_t neighborStop = network.edgeTargets[edge];
+                searchStats.edgesRelaxed++;
+                if (ws.wasVisited(neighborStop)) continue;
+
+                if (maxStops != 0 && visitedStops >= maxStops) {
+                    ws.exhausted = true;
+                    break;
+                }
+                ws.visit(neighborStop, edge);
+                ws.queue.push_back(neighborStop);
+                visitedStops++;
+                searchStats.nodesSettled++;
+                if (neighborStop == targetId) {
+                    found = true;
+                    break;
+                }
+            }
+            if (ws.exhausted) break;
+        }
+        if (ws.exhausted) break;
+        levelStart = levelEnd;
+    }
+
+    edges.clear();
+    if (!found) return false;
+    for (uint32_t stop = targetId; stop != startId; stop = network.edgeSources[ws.parentEdge[stop]]) {
+        edges.push_back(ws.parentEdge[stop]);
+    }
+    reverse(edges.begin(), edges.end());
+    return true;
+}
+
+const uint32_t RAPTOR_MAX_ROUNDS = 8;
+const double WALKING_KMH = 5.0;
+// Static edges up to this long double as footpaths between timetable stops
+const double RAPTOR_MAX_WALK_KM = 1.0;
+
+inline int walkingSeconds(double km) {
+    return (int)ceil(km / WALKING_KMH * 3600);
+}
+
+// How a stop was reached in one RAPTOR round: a ride on trip from
+// boardPosition to alightPosition of route, or a walk along edge. previousStop
+// is where the ride boarded or the walk began; NO_STOP marks the origin.
+struct RaptorLabel {
+    int arrival;
+    uint32_t previousStop;
+    uint32_t route;
+    uint32_t trip;
+    uint32_t boardPosition;
+    uint32_t alightPosition;
+    uint32_t edge;
+};
+
+// Per-thread RAPTOR scratch space. Labels are kept per (round, stop) and
+// stamped with the query's generation; the marked stops and the route queue
+// are stamped with a per-round epoch, so no array is cleared between rounds.
+struct RaptorWorkspace {
+    vector<uint32_t> labelStamps;
+    vector<RaptorLabel> labels;
+    vector<uint32_t> bestStamps;
+    vector<int> bestArrivals;
+    vector<uint32_t> markStamps;
+    vector<uint32_t> markedStops;
+    vector<uint32_t> queueStamps;
+    vector<uint32_t> queuedPositions;
+    vector<uint32_t> queuedRoutes;
+    vector<pair<uint32_t, RaptorLabel>> pendingWalks;
+    uint32_t stopCount = 0;
+    uint32_t generation = 0;
+    uint32_t epoch = 0;
+
+    void begin(uint32_t stops, uint32_t routes) {
+        stopCount = stops;
+        size_t labelCount = (size_t)(RAPTOR_MAX_ROUNDS + 1) * stops;
+        if (labelStamps.size() < labelCount) {
+            labelStamps.resize(labelCount, 0);
+            labels.resize(labelCount);
+        }
+        if (bestStamps.size() < stops) {
+            bestStamps.resize(stops, 0);
+            bestArrivals.resize(stops);
+            markStamps.resize(stops, 0);
+        }
+        if (queueStamps.size() < routes) {
+            queueStamps.resize(routes, 0);
+            queuedPositions.resize(routes);
+        }
+
+        generation++;
+        if (generation == 0) {
+            fill(labelStamps.begin(), labelStamps.end(), 0);
+            fill(bestStamps.begin(), bestStamps.end(), 0);
+            generation = 1;
+        }
+        markedStops.clear();
+        nextRound();
+    }
+
+    void nextRound() {
+        epoch++;
+        if (epoch == 0) {
+            fill(markStamps.begin(), markStamps.end(), 0);
+            fill(queueStamps.begin(), queueStamps.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    int bestArrival(uint32_t stop) const {
+        return bestStamps[stop] == generation ? bestArrivals[stop] : numeric_limits<int>::max();
+    }
+
+    bool reached(uint32_t round, uint32_t stop) const {
+        return labelStamps[(size_t)round * stopCount + stop] == generation;
+    }
+
+    const RaptorLabel& label(uint32_t round, uint32_t stop) const {
+        return labels[(size_t)round * stopCount + stop];
+    }
+
+    // Latest round before this one that reached stop, which is also its best
+    // arrival with fewer trips; NO_STOP when none did
+    uint32_t previousRound(uint32_t round, uint32_t stop) const {
+        for (uint32_t earlier = round; earlier-- > 0;) {
+            if (reached(earlier, stop)) return earlier;
+        }
+        return NO_STOP;
+    }
+
+    void setLabel(uint32_t round, uint32_t stop, const RaptorLabel& label) {
+        size_t slot = (size_t)round * stopCount + stop;
+        labelStamps[slot] = generation;
+        labels[slot] = label;
+        bestStamps[stop] = generation;
+        bestArrivals[stop] = label.arrival;
+        if (markStamps[stop] != epoch) {
+            markStamps[stop] = epoch;
+            markedStops.push_back(stop);
+        }
+    }
+
+    static RaptorWorkspace& forThisThread() {
+        thread_local RaptorWorkspace workspace;
+        return workspace;
+    }
+};
+
+// Walk from every stop a ride reached in this round (or the origin in round
+// 0). Walks are not chained, and all of them are measured before any is
+// applied so each starts from the ride that reached its first stop.
+void relaxFootpaths(const CompactGraph& network, uint32_t round, uint32_t targetId, RaptorWorkspace& workspace) {
+    const Timetable& timetable = network.timetable;
+    workspace.pendingWalks.clear();
+    for (uint32_t stop : workspace.markedStops) {
+        const RaptorLabel& from = workspace.label(round, stop);
+        for (uint32_t slot = timetable.footpathOffsets[stop]; slot < timetable.footpathOffsets[stop + 1]; slot++) {
+            uint32_t edge = timetable.footpathEdges[slot];
+            uint32_t next = network.edgeTargets[edge];
+            int arrival = from.arrival + timetable.footpathSeconds[slot];
+            searchStats.edgesRelaxed++;
+            if (arrival < workspace.bestArrival(next) && arrival < workspace.bestArrival(targetId)) {
+                workspace.pendingWalks.push_back(make_pair(next, RaptorLabel{ arrival, stop, NO_STOP, NO_TRIP, 0, 0, edge }));
+            }
+        }
+    }
+
+    for (const auto& walk : workspace.pendingWalks) {
+        if (walk.second.arrival < workspace.bestArrival(walk.first)) {
+            workspace.setLabel(round, walk.first, walk.second);
+        }
+    }
+}
+
+// RAPTOR earliest-arrival query. Round k extends the journeys of round k - 1
+// by one more trip: every route through a stop improved in the last round is
+// scanned once from its earliest such stop, hopping on the earliest trip
+// catchable there, then short footpaths are walked. Arrivals only count when
+// they beat both the stop's and the target's best so far. Returns the round
+// of the earliest arrival at targetId (the fewest trips among ties), or
+// NO_STOP when it cannot be reached.
+uint32_t runRaptor(const CompactGraph& network, uint32_t startId, uint32_t targetId, int departure, RaptorWorkspace& workspace) {
+    const Timetable& timetable = network.timetable;
+    workspace.begin(network.stopCount(), timetable.routeCount());
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return NO_STOP;
+    }
+
+    workspace.setLabel(0, startId, RaptorLabel{ departure, NO_STOP, NO_STOP, NO_TRIP, 0, 0, NO_EDGE });
+    relaxFootpaths(network, 0, targetId, workspace);
+
+    for (uint32_t round = 1; round <= RAPTOR_MAX_ROUNDS && !workspace.markedStops.empty(); round++) {
+        // Queue each route at the earliest position where one of its stops improved
+        workspace.nextRound();
+        workspace.queuedRoutes.clear();
+        for (uint32_t stop : workspace.markedStops) {
+            for (uint32_t slot = timetable.stopRouteOffsets[stop]; slot < timetable.stopRouteOffsets[stop + 1]; slot++) {
+                uint32_t route = timetable.stopRoutes[slot];
+                uint32_t position = timetable.stopRoutePositions[slot];
+                if (workspace.queueStamps[route] != workspace.epoch) {
+                    workspace.queueStamps[route] = workspace.epoch;
+                    workspace.queuedPositions[route] = position;
+                    workspace.queuedRoutes.push_back(route);
+                }
+                else if (position < workspace.queuedPositions[route]) {
+                    workspace.queuedPositions[route] = position;
+                }
+            }
+        }
+        workspace.markedStops.clear();
+
+        for (uint32_t route : workspace.queuedRoutes) {
+            const uint32_t* stops = timetable.routeStops.data() + timetable.routeStopOffsets[route];
+            uint32_t length = timetable.routeLength(route);
+            uint32_t firstTrip = timetable.routeTripOffsets[route];
+            uint32_t lastTrip = timetable.routeTripOffsets[route + 1];
+            uint32_t trip = NO_TRIP;
+            uint32_t boardPosition = 0;
+
+            for (uint32_t position = workspace.queuedPositions[route]; position < length; position++) {
+                uint32_t stop = stops[position];
+                searchStats.edgesRelaxed++;
+
+                if (trip != NO_TRIP) {
+                    int arrival = timetable.arrivals[timetable.timeIndex(route, trip, position)];
+                    if (arrival < workspace.bestArrival(stop) && arrival < workspace.bestArrival(targetId)) {
+                        workspace.setLabel(round, stop, RaptorLabel{ arrival, stops[boardPosition], route, trip,
+                            boardPosition, position, NO_EDGE });
+                    }
+                }
+
+                // Can an earlier trip be caught here with one trip fewer?
+                uint32_t earlier = workspace.previousRound(round, stop);
+                if (earlier == NO_STOP) {
+                    continue;
+                }
+                int ready = workspace.label(earlier, stop).arrival;
+                if (trip != NO_TRIP && timetable.departures[timetable.timeIndex(route, trip, position)] < ready) {
+                    continue;
+                }
+
+                uint32_t catchable = trip;
+                if (catchable == NO_TRIP) {
+                    uint32_t low = firstTrip;
+                    uint32_t high = lastTrip;
+                    while (low < high) {
+                        uint32_t middle = low + (high - low) / 2;
+                        if (timetable.departures[timetable.timeIndex(route, middle, position)] < ready) low = middle + 1;
+                        else high = middle;
+                    }
+                    catchable = low < lastTrip ? low : NO_TRIP;
+                }
+                else {
+                    while (catchable > firstTrip && timetable.departures[timetable.timeIndex(route, catchable - 1, position)] >= ready) {
+                        catchable--;
+                    }
+                }
+
+                if (catchable != NO_TRIP && catchable != trip) {
+                    trip = catchable;
+                    boardPosition = position;
+                }
+            }
+        }
+
+        relaxFootpaths(network, round, targetId, workspace);
+        searchStats.nodesSettled += workspace.markedStops.size();
+    }
+
+    uint32_t bestRound = NO_STOP;
+    for (uint32_t round = 0; round <= RAPTOR_MAX_ROUNDS; round++) {
+        if (workspace.reached(round, targetId) &&
+            (bestRound == NO_STOP || workspace.label(round, targetId).arrival < workspace.label(bestRound, targetId).arrival)) {
+            bestRound = round;
+        }
+    }
+    return bestRound;
+}
+
+// One leg of a timetable journey: a ride on trip of route from boardPosition
+// to alightPosition, or a walk along a static edge when edge is set
+struct JourneyLeg {
+    uint32_t fromStop;
+    uint32_t toStop;
+    uint32_t route;
+    uint32_t trip;
+    uint32_t boardPosition;
+    uint32_t alightPosition;
+    uint32_t edge;
+    int departure;
+    int arrival;
+};
+
+// Walk the RAPTOR labels back from targetId in round and fill legs in travel order
+void collectRaptorJourney(const CompactGraph& network, const RaptorWorkspace& workspace, uint32_t round, uint32_t targetId, vector<JourneyLeg>& legs) {
+    const Timetable& timetable = network.timetable;
+    legs.clear();
+
+    uint32_t stop = targetId;
+    while (workspace.label(round, stop).previousStop != NO_STOP) {
+        const RaptorLabel& label = workspace.label(round, stop);
+        if (label.edge != NO_EDGE) {
+            int departure = workspace.label(round, label.previousStop).arrival;
+            legs.push_back(JourneyLeg{ label.previousStop, stop, NO_STOP, NO_TRIP, 0, 0, label.edge, departure, label.arrival });
+        }
+        else {
+            int departure = timetable.departures[timetable.timeIndex(label.route, label.trip, label.boardPosition)];
+            legs.push_back(JourneyLeg{ label.previousStop, stop, label.route, label.trip,
+                label.boardPosition, label.alightPosition, NO_EDGE, departure, label.arrival });
+            round = workspace.previousRound(round, label.previousStop);
+        }
+        stop = label.previousStop;
+    }
+    reverse(legs.begin(), legs.end());
+}
+
+// "HH:MM" or "HH:MM:SS" as seconds after midnight; -1 when malformed. Hours
+// may run past 24 for trips that continue after midnight.
+int parseClockTime(const string& text) {
+    int hours = 0;
+    int minutes = 0;
+    int seconds = 0;
+    char extra = 0;
+    int fields = sscanf(text.c_str(), "%d:%d:%d%c", &hours, &minutes, &seconds, &extra);
+    if (fields < 2 || fields > 3 || hours < 0 || hours > 47 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 59) {
+        return -1;
+    }
+    return hours * 3600 + minutes * 60 + seconds;
+}
+
+string formatClockTime(int seconds) {
+    char text[16];
+    snprintf(text, sizeof(text), "%02d:%02d", seconds / 3600, seconds / 60 % 60);
+    return text;
+}
+
+// Seconds since local midnight, the departure time when /route gives none
+int currentClockTime() {
+    time_t now = time(0);
+    tm* ltm = localtime(&now);
+    return ltm->tm_hour * 3600 + ltm->tm_min * 60 + ltm->tm_sec;
+}
+
+const uint32_t NO_CONNECTION = UINT32_MAX;
+const int DEFAULT_PROFILE_WINDOW_MINUTES = 60;
+const int MAX_PROFILE_WINDOW_MINUTES = 24 * 60;
+
+// Best way found to reach a stop in a CSA earliest-arrival query: a ride on
+// one trip from enterConnection through exitConnection, or a walk along edge
+// that left at departure. The origin has neither.
+struct ConnectionLabel {
+    int arrival;
+    int departure;
+    uint32_t enterConnection;
+    uint32_t exitConnection;
+    uint32_t edge;
+};
+
+// A Pareto-optimal (departure, arrival) pair at a stop for profile queries:
+// board at enterConnection, stay on the trip until exitConnection, then carry
+// on as the profile of the stop reached says
+struct ProfileEntry {
+    int departure;
+    int arrival;
+    uint32_t enterConnection;
+    uint32_t exitConnection;
+};
+
+// Per-thread CSA scratch space. Stop labels are generation-stamped. Trip
+// flags are one bit per trip, and only the words a query set are cleared by
+// the next one. Profiles are kept per stop and emptied the same way, so
+// steady-state queries reuse their capacity.
+struct ConnectionScanWorkspace {
+    vector<uint32_t> stamp;
+    vector<ConnectionLabel> labels;
+    vector<uint32_t> walkStamp;
+    vector<int> walkToTarget;
+    uint32_t generation = 0;
+
+    vector<uint64_t> tripFlags;
+    vector<uint32_t> touchedWords;
+    vector<uint32_t> tripEnter;
+    vector<int> tripArrival;
+    vector<uint32_t> tripExit;
+
+    vector<vector<ProfileEntry>> profiles;
+    vector<uint32_t> touchedStops;
+
+    void begin(uint32_t stopCount, uint32_t tripCount) {
+        if (stamp.size() < stopCount) {
+            stamp.resize(stopCount, 0);
+            labels.resize(stopCount);
+            walkStamp.resize(stopCount, 0);
+            walkToTarget.resize(stopCount);
+            profiles.resize(stopCount);
+        }
+        if (tripEnter.size() < tripCount) {
+            tripFlags.resize((tripCount + 63) / 64, 0);
+            tripEnter.resize(tripCount);
+            tripArrival.resize(tripCount);
+            tripExit.resize(tripCount);
+        }
+
+        generation++;
+        if (generation == 0) {
+            fill(stamp.begin(), stamp.end(), 0);
+            fill(walkStamp.begin(), walkStamp.end(), 0);
+            generation = 1;
+        }
+        for (uint32_t word : touchedWords) {
+            tripFlags[word] = 0;
+        }
+        touchedWords.clear();
+        for (uint32_t stop : touchedStops) {
+            profiles[stop].clear();
+        }
+        touchedStops.clear();
+    }
+
+    int arrivalAt(uint32_t stop) const {
+        return stamp[stop] == generation ? labels[stop].arrival : numeric_limits<int>::max();
+    }
+
+    void setLabel(uint32_t stop, const ConnectionLabel& label) {
+        stamp[stop] = generation;
+        labels[stop] = label;
+    }
+
+    int walkSecondsToTarget(uint32_t stop) const {
+        return walkStamp[stop] == generation ? walkToTarget[stop] : numeric_limits<int>::max();
+    }
+
+    bool tripFlagged(uint32_t trip) const {
+        return (tripFlags[trip >> 6] >> (trip & 63)) & 1;
+    }
+
+    void flagTrip(uint32_t trip) {
+        uint64_t& word = tripFlags[trip >> 6];
+        if (word == 0) touchedWords.push_back(trip >> 6);
+        word |= uint64_t(1) << (trip & 63);
+    }
+
+    vector<ProfileEntry>& profileOf(uint32_t stop) {
+        if (profiles[stop].empty()) touchedStops.push_back(stop);
+        return profiles[stop];
+    }
+
+    static ConnectionScanWorkspace& forThisThread() {
+        thread_local ConnectionScanWorkspace workspace;
+        return workspace;
+    }
+};
+
+// Index of the first connection departing at or after time
+inline uint32_t firstConnectionFrom(const Timetable& timetable, int time) {
+    return (uint32_t)(lower_bound(timetable.connectionDepartures.begin(), timetable.connectionDepartures.end(), time) -
+        timetable.connectionDepartures.begin());
+}
+
+// Walk from stop after arriving there at arrival, improving any stop reached sooner
+void walkFromConnection(const CompactGraph& network, uint32_t stop, int arrival, ConnectionScanWorkspace& workspace) {
+    const Timetable& timetable = network.timetable;
+    for (uint32_t slot = timetable.footpathOffsets[stop]; slot < timetable.footpathOffsets[stop + 1]; slot++) {
+        uint32_t next = network.edgeTargets[timetable.footpathEdges[slot]];
+        int walkArrival = arrival + timetable.footpathSeconds[slot];
+        searchStats.edgesRelaxed++;
+        if (walkArrival < workspace.arrivalAt(next)) {
+            workspace.setLabel(next, ConnectionLabel{ walkArrival, arrival, NO_CONNECTION, NO_CONNECTION, timetable.footpathEdges[slot] });
+        }
+    }
+}
+
+// Connection Scan earliest-arrival query. Connections are scanned once in
+// departure order from the departure time; a connection is usable when its
+// trip was already boarded or its stop was reached in time, and the scan
+// stops at the first connection leaving after the best arrival at targetId.
+// Walks follow rides only, as in runRaptor. Returns whether targetId was reached.
+bool runConnectionScan(const CompactGraph& network, uint32_t startId, uint32_t targetId, int departure, ConnectionScanWorkspace& workspace) {
+    const Timetable& timetable = network.timetable;
+    workspace.begin(network.stopCount(), timetable.tripCount());
+    if (startId == NO_STOP || targetId == NO_STOP) {
+        return false;
+    }
+
+    workspace.setLabel(startId, ConnectionLabel{ departure, departure, NO_CONNECTION, NO_CONNECTION, NO_EDGE });
+    walkFromConnection(network, startId, departure, workspace);
+
+    const int* departures = timetable.connectionDepartures.data();
+    const int* arrivals = timetable.connectionArrivals.data();
+    const uint32_t* fromStops = timetable.connectionFromStops.data();
+    const uint32_t* toStops = timetable.connectionToStops.data();
+    const uint32_t* trips = timetable.connectionTrips.data();
+    uint32_t connectionCount = (uint32_t)timetable.connectionDepartures.size();
+    uint64_t scanned = 0;
+
+    for (uint32_t connection = firstConnectionFrom(timetable, departure); connection < connectionCount; connection++) {
+        if (departures[connection] >= workspace.arrivalAt(targetId)) {
+            break;
+        }
+        scanned++;
+
+        uint32_t trip = trips[connection];
+        if (!workspace.tripFlagged(trip)) {
+            if (workspace.arrivalAt(fromStops[connection]) > departures[connection]) {
+                continue;
+            }
+            workspace.flagTrip(trip);
+            workspace.tripEnter[trip] = connection;
+        }
+
+        uint32_t stop = toStops[connection];
+        if (arrivals[connection] < workspace.arrivalAt(stop)) {
+            workspace.setLabel(stop, ConnectionLabel{ arrivals[connection], departures[workspace.tripEnter[trip]],
+                workspace.tripEnter[trip], connection, NO_EDGE });
+            searchStats.nodesSettled++;
+            walkFromConnection(network, stop, arrivals[connection], workspace);
+        }
+    }
+
+    searchStats.edgesRelaxed += scanned;
+    return workspace.arrivalAt(targetId) != numeric_limits<int>::max();
+}
+
+// The ride that runs a trip from its enter to its exit connection as a journey leg
+inline JourneyLeg connectionLeg(const Timetable& timetable, uint32_t enterConnection, uint32_t exitConnection) {
+    uint32_t trip = timetable.connectionTrips[enterConnection];
+    return JourneyLeg{ timetable.connectionFromStops[enterConnection], timetable.connectionToStops[exitConnection],
+        timetable.tripRoutes[trip], trip, timetable.connectionPositions[enterConnection],
+        timetable.connectionPositions[exitConnection] + 1, NO_EDGE,
+        timetable.connectionDepartures[enterConnection], timetable.connectionArrivals[exitConnection] };
+}
+
+// Walk the CSA labels back from targetId and fill legs in travel order
+void collectConnectionJourney(const CompactGraph& network, const ConnectionScanWorkspace& workspace, uint32_t targetId, vector<JourneyLeg>& legs) {
+    legs.clear();
+    uint32_t stop = targetId;
+    while (true) {
+        const ConnectionLabel& label = workspace.labels[stop];
+        if (label.edge != NO_EDGE) {
+            uint32_t from = network.edgeSources[label.edge];
+            legs.push_back(JourneyLeg{ from, stop, NO_STOP, NO_TRIP, 0, 0, label.edge, label.departure, label.arrival });
+            stop = from;
+        }
+        else if (label.enterConnection != NO_CONNECTION) {
+            legs.push_back(connectionLeg(network.timetable, label.enterConnection, label.exitConnection));
+            stop = legs.back().fromStop;
+        }
+        else {
+            break;
+        }
+    }
+    reverse(legs.begin(), legs.end());
+}
+
+// Earliest arrival at targetId for someone reaching the profiled stop at
+// time, as the stop's profile entry to take (NO_CONNECTION when none).
+// Entries are appended in falling departure and arrival order, so the last
+// one leaving at or after time is the best.
+inline uint32_t profileLookup(const vector<ProfileEntry>& profile, int time, int& arrival) {
+    uint32_t low = 0;
+    uint32_t high = (uint32_t)profile.size();
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (profile[middle].departure >= time) low = middle + 1;
+        else high = middle;
+    }
+    if (low == 0) {
+        arrival = numeric_limits<int>::max();
+        return NO_CONNECTION;
+    }
+    arrival = profile[low - 1].arrival;
+    return low - 1;
+}
+
+// Earliest arrival at targetId after alighting at stop at time: stay there,
+// walk to targetId, or walk to a nearby stop and carry on from its profile.
+// Fills nextStop/nextEntry with where the journey continues (NO_STOP when
+// it ends here or by walking to the target) and walkEdge with any walk taken.
+int bestContinuation(const CompactGraph& network, ConnectionScanWorkspace& workspace, uint32_t stop, int time, uint32_t targetId,
+    uint32_t& nextStop, uint32_t& nextEntry, uint32_t& walkEdge) {
+    const Timetable& timetable = network.timetable;
+    nextStop = NO_STOP;
+    nextEntry = NO_CONNECTION;
+    walkEdge = NO_EDGE;
+    if (stop == targetId) {
+        return time;
+    }
+
+    int best = numeric_limits<int>::max();
+    int walk = workspace.walkSecondsToTarget(stop);
+    if (walk != numeric_limits<int>::max()) {
+        best = time + walk;
+        for (uint32_t slot = timetable.footpathOffsets[stop]; slot < timetable.footpathOffsets[stop + 1]; slot++) {
+            if (network.edgeTargets[timetable.footpathEdges[slot]] == targetId && timetable.footpathSeconds[slot] == walk) {
+                walkEdge = timetable.footpathEdges[slot];
+                break;
+            }
+        }
+    }
+
+    int arrival;
+    uint32_t entry = profileLookup(workspace.profiles[stop], time, arrival);
+    if (arrival < best) {
+        best = arrival;
+        nextStop = stop;
+        nextEntry = entry;
+        walkEdge = NO_EDGE;
+    }
+    for (uint32_t slot = timetable.footpathOffsets[stop]; slot < timetable.footpathOffsets[stop + 1]; slot++) {
+        uint32_t next = network.edgeTargets[timetable.footpathEdges[slot]];
+        entry = profileLookup(workspace.profiles[next], time + timetable.footpathSeconds[slot], arrival);
+        if (arrival < best) {
+            best = arrival;
+            nextStop = next;
+            nextEntry = entry;
+            walkEdge = timetable.footpathEdges[slot];
+        }
+    }
+    return best;
+}
+
+// Connection Scan profile query: every Pareto-optimal (departure, arrival)
+// pair to targetId, built by scanning connections backwards in departure
+// order from latestArrival down to windowStart. Each stop keeps the
+// journeys that leave it later and arrive sooner than anything seen so far;
+// each trip keeps its arrival if one stays seated. Afterwards the profile of
+// startId (and of stops a walk away) holds the answers.
+void runProfileScan(const CompactGraph& network, uint32_t targetId, int windowStart, int latestArrival, ConnectionScanWorkspace& workspace) {
+    const Timetable& timetable = network.timetable;
+    workspace.begin(network.stopCount(), timetable.tripCount());
+    if (targetId == NO_STOP) {
+        return;
+    }
+
+    for (uint32_t edge : network.incoming(targetId)) {
+        uint32_t stop = network.edgeSources[edge];
+        if (network.edgeDistances[edge] <= RAPTOR_MAX_WALK_KM && stop != targetId) {
+            int seconds = walkingSeconds(network.edgeDistances[edge]);
+            if (seconds < workspace.walkSecondsToTarget(stop)) {
+                workspace.walkStamp[stop] = workspace.generation;
+                workspace.walkToTarget[stop] = seconds;
+            }
+        }
+    }
+
+    uint32_t first = firstConnectionFrom(timetable, windowStart);
+    uint32_t last = firstConnectionFrom(timetable, latestArrival);
+    uint64_t scanned = 0;
+
+    for (uint32_t connection = last; connection-- > first;) {
+        int arrival = timetable.connectionArrivals[connection];
+        if (arrival >= latestArrival) {
+            continue;
+        }
+        scanned++;
+        uint32_t trip = timetable.connectionTrips[connection];
+        uint32_t stop = timetable.connectionToStops[connection];
+
+        uint32_t nextStop;
+        uint32_t nextEntry;
+        uint32_t walkEdge;
+        int best = bestContinuation(network, workspace, stop, arrival, targetId, nextStop, nextEntry, walkEdge);
+        uint32_t exit = connection;
+        if (workspace.tripFlagged(trip) && workspace.tripArrival[trip] <= best) {
+            best = workspace.tripArrival[trip];
+            exit = workspace.tripExit[trip];
+        }
+        if (best == numeric_limits<int>::max()) {
+            continue;
+        }
+
+        if (!workspace.tripFlagged(trip) || best < workspace.tripArrival[trip]) {
+            workspace.flagTrip(trip);
+            workspace.tripArrival[trip] = best;
+            workspace.tripExit[trip] = exit;
+        }
+
+        uint32_t from = timetable.connectionFromStops[connection];
+        int departure = timetable.connectionDepartures[connection];
+        vector<ProfileEntry>& profile = workspace.profileOf(from);
+        if (!profile.empty() && profile.back().arrival <= best) {
+            continue;
+        }
+        if (!profile.empty() && profile.back().departure == departure) {
+            profile.back() = ProfileEntry{ departure, best, connection, exit };
+        }
+        else {
+            profile.push_back(ProfileEntry{ departure, best, connection, exit });
+        }
+        searchStats.nodesSettled++;
+    }
+
+    searchStats.edgesRelaxed += scanned;
+}
+
+// Follow a profile entry at stop through its rides and walks to targetId
+void collectProfileJourney(const CompactGraph& network, ConnectionScanWorkspace& workspace, uint32_t stop, uint32_t entry,
+    uint32_t targetId, vector<JourneyLeg>& legs) {
+    const Timetable& timetable = network.timetable;
+    while (entry != NO_CONNECTION) {
+        const ProfileEntry& current = workspace.profiles[stop][entry];
+        legs.push_back(connectionLeg(timetable, current.enterConnection, current.exitConnection));
+
+        uint32_t alightStop = legs.back().toStop;
+        int time = legs.back().arrival;
+        uint32_t walkEdge;
+        bestContinuation(network, workspace, alightStop, time, targetId, stop, entry, walkEdge);
+        if (walkEdge != NO_EDGE) {
+            int walkArrival = time + walkingSeconds(network.edgeDistances[walkEdge]);
+            legs.push_back(JourneyLeg{ alightStop, network.edgeTargets[walkEdge], NO_STOP, NO_TRIP, 0, 0, walkEdge, time, walkArrival });
+        }
+    }
+}
+
+// Append helpers for building results in place. Numbers use the same
+// formatting as to_string but go through a stack buffer, and strings are
+// quoted, so a result sized up front needs no temporaries.
+inline void appendJsonString(string& out, const string& text) {
+    out += '"';
+    out += text;
+    out += '"';
+}
+
+inline void appendJsonNumber(string& out, double value) {
+    char buffer[64];
+    out.append(buffer, (size_t)snprintf(buffer, sizeof(buffer), "%f", value));
+}
+
+inline void appendJsonNumber(string& out, long long value) {
+    char buffer[24];
+    out.append(buffer, (size_t)snprintf(buffer, sizeof(buffer), "%lld", value));
+}
+
+// Room for one number in a result sized up front
+const size_t JSON_NUMBER_BYTES = 24;
+
+// Kilometres a change of bus is worth to algo=transfers unless penalty= says otherwise
+const double DEFAULT_TRANSFER_PENALTY_KM = 2.0;
+// Large enough that one transfer outweighs any route's distance
+const double MIN_TRANSFERS_PENALTY_KM = 1e7;
+
+// Scheduled trips that run the same bus over the same stops, as staged by
+// Graph::addTrip. Times are seconds after midnight, stored trip by trip.
+struct TripPattern {
+    string bus;
+    vector<string> stops;
+    vector<int> arrivals;
+    vector<int> departures;
+};
+
+class Graph {
+public:
+    // A pinned network version; it stays valid, unchanged, while the pin lives
+    typedef Published<CompactGraph>::Pin Snapshot;
+
+    // Mutable staging area; addStop/addRoute edit it under the edit lock and
+    // publish() freezes it into a new version for the searches
+    unordered_map<string, vector<Edge>> adjacencyList;
+    vector<string> stopNames;
+    vector<double> stopLatitudes;
+    vector<double> stopLongitudes;
+
+    // Scheduled trips, one pattern per bus and stop sequence; the next freeze
+    // lays them out as the RAPTOR timetable
+    vector<TripPattern> tripPatterns;
+
+    // Console logging for edits and queries; the benchmark switches it off
+    bool verbose = true;
+
+    // Hub labels share this budget, distance first; 0 disables them. With a
+    // path set, labels are loaded from <path>.distance / <path>.fare when they
+    // match the hierarchy and saved there after a build.
+    size_t hubLabelBudgetBytes = DEFAULT_HUB_LABEL_BUDGET_MB << 20;
+    string hubLabelPath;
+
+    // Coordinates are optional; stops without them get NaN and disable A*'s bound
+    void addStop(string name, double latitude = NAN, double longitude = NAN) {
+        lock_guard<mutex> lock(editGuard);
+        if (!stageStop(name, latitude, longitude)) {
+            if (verbose) cout << "[!] Stop already exists: " << name << endl;
+            return;
+        }
+        if (verbose) cout << "[+] Added stop: " << name << endl;
+    }
+
+    void addRoute(string from, string to, double distance, int fare, string busName) {
+        lock_guard<mutex> lock(editGuard);
+        stageRoute(from, to, distance, fare, busName);
+
+        if (verbose) {
+            cout << "[+] Added route: " << from << " <-> " << to;
+            cout << " (" << distance << " km, Rs." << fare << ", " << busName << ")" << endl;
+        }
+    }
+
+    // Holds the edit lock for a bulk load and stages stops and routes without
+    // logging each one; nothing is visible until the next publish(), which
+    // must come after the BulkEdit is gone
+    class BulkEdit {
+    public:
+        explicit BulkEdit(Graph& graph) : graph(graph), lock(graph.editGuard) {}
+
+        // False when the stop already exists
+        bool addStop(const string& name, double latitude, double longitude) {
+            return graph.stageStop(name, latitude, longitude);
+        }
+
+        void addRoute(const string& from, const string& to, double distance, int fare, const string& busName) {
+            graph.stageRoute(from, to, distance, fare, busName);
+        }
+
+        // False when the stops and times do not form a valid trip
+        bool addTrip(const string& busName, const vector<string>& stops, const vector<int>& arrivals, const vector<int>& departures) {
+            return graph.stageTrip(busName, stops, arrivals, departures);
+        }
+
+    private:
+        Graph& graph;
+        lock_guard<mutex> lock;
+    };
+
+    // Add one scheduled trip of busName calling at stops at the given times
+    // (seconds after midnight). Trips over the same stops on the same bus are
+    // grouped into one pattern. Returns false when the times are inconsistent.
+    bool addTrip(string busName, const vector<string>& stops, const vector<int>& arrivals, const vector<int>& departures) {
+        lock_guard<mutex> lock(editGuard);
+        if (!stageTrip(busName, stops, arrivals, departures)) {
+            if (verbose) cout << "[!] Invalid trip on " << busName << endl;
+            return false;
+        }
+
+        if (verbose) {
+            cout << "[+] Added trip: " << busName << " " << stops.front() << " " << formatClockTime(departures.front())
+                << " -> " << stops.back() << " " << formatClockTime(arrivals.back()) << endl;
+        }
+        return true;
+    }
+
+    // Freeze staged edits into a new version and publish it. Queries already
+    // running keep the version they pinned; later ones see the new one.
+    void publish() {
+        lock_guard<mutex> lock(editGuard);
+        if (stagingDirty.load()) {
+            published.store(freeze());
+            stagingDirty.store(false);
+        }
+    }
+
+    // Publish a network read from a snapshot file as the next version. The
+    // staging area is only rebuilt from it when the first edit arrives.
+    void publishSnapshot(shared_ptr<CompactGraph> network) {
+        lock_guard<mutex> lock(editGuard);
+        network->version = ++versionsPublished;
+        published.store(move(network));
+        stagingDirty.store(false);
+        stagingStale = true;
+    }
+
+    // Pin the latest published version without taking a lock. Staged edits
+    // show up once their writer calls publish(); only the very first
+    // snapshot publishes by itself, so a freshly built graph is usable.
+    Snapshot snapshot() {
+        if (published.empty()) {
+            publish();
+        }
+        return published.pin();
+    }
+
+    // Versions replaced but still pinned by some reader
+    size_t retiredVersions() const {
+        return EpochDomain::instance().retiredCount();
+    }
+
+    // Rebuild the CSR arrays from the staging adjacency list; needs editGuard
+    shared_ptr<const CompactGraph> freeze() {
+        CompactGraph network;
+
+        for (const string& stopName : stopNames) {
+            internStop(network, stopName);
+        }
+
+        // Routes may reference stops that were never added through addStop
+        for (const auto& pair : adjacencyList) {
+            internStop(network, pair.first);
+            for (const Edge& edge : pair.second) {
+                internStop(network, edge.to);
+            }
+        }
+        for (const TripPattern& pattern : tripPatterns) {
+            for (const string& stop : pattern.stops) {
+                internStop(network, stop);
+            }
+        }
+
+        network.stopLatitudes.assign(network.stopCount(), NAN);
+        network.stopLongitudes.assign(network.stopCount(), NAN);
+        network.stopPositions.assign(3 * (size_t)network.stopCount(), 0.0);
+        for (size_t stop = 0; stop < stopNames.size(); stop++) {
+            double latitude = stopLatitudes[stop] * DEGREES_TO_RADIANS;
+            double longitude = stopLongitudes[stop] * DEGREES_TO_RADIANS;
+            network.stopLatitudes[stop] = stopLatitudes[stop];
+            network.stopLongitudes[stop] = stopLongitudes[stop];
+            network.stopPositions[3 * stop] = cos(latitude) * cos(longitude);
+            network.stopPositions[3 * stop + 1] = cos(latitude) * sin(longitude);
+            network.stopPositions[3 * stop + 2] = sin(latitude);
+        }
+
+        unordered_map<string, uint32_t> busIds;
+        size_t totalEdges = 0;
+        for (const auto& pair : adjacencyList) {
+            totalEdges += pair.second.size();
+        }
+
+        network.edgeOffsets.reserve(network.stopCount() + 1);
+        network.edgeTargets.reserve(totalEdges);
+        network.edgeDistances.reserve(totalEdges);
+        network.edgeFares.reserve(totalEdges);
+        network.edgeBusIds.reserve(totalEdges);
+        network.edgeSources.reserve(totalEdges);
+
+        network.edgeOffsets.push_back(0);
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            auto routes = adjacencyList.find(network.stopNames[stop]);
+            if (routes != adjacencyList.end()) {
+                for (const Edge& edge : routes->second) {
+                    auto bus = busIds.find(edge.bus);
+                    if (bus == busIds.end()) {
+                        bus = busIds.emplace(edge.bus, (uint32_t)network.busNames.size()).first;
+                        network.busNames.push_back(edge.bus);
+                    }
+
+                    network.edgeTargets.push_back(network.stopIds[edge.to]);
+                    network.edgeDistances.push_back(edge.distance);
+                    network.edgeFares.push_back(edge.fare);
+                    network.edgeBusIds.push_back(bus->second);
+                    network.edgeSources.push_back(stop);
+                }
+            }
+            network.edgeOffsets.push_back((uint32_t)network.edgeTargets.size());
+        }
+
+        // Counting sort of the edges by target gives the reverse CSR
+        network.reverseOffsets.assign(network.stopCount() + 1, 0);
+        for (uint32_t target : network.edgeTargets) {
+            network.reverseOffsets[target + 1]++;
+        }
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            network.reverseOffsets[stop + 1] += network.reverseOffsets[stop];
+        }
+
+        vector<uint32_t> nextSlot(network.reverseOffsets.begin(), network.reverseOffsets.end() - 1);
+        network.reverseEdges.resize(network.edgeCount());
+        for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+            network.reverseEdges[nextSlot[network.edgeTargets[edge]]++] = edge;
+        }
+
+        buildTimetable(network, busIds);
+        buildTransferStates(network);
+        network.minKmPerGreatCircleKm = minKmPerGreatCircleKm(network);
+
+        buildLandmarkIndex(network, DEFAULT_LANDMARKS);
+        if (verbose) {
+            cout << "[*] ALT preprocessing: " << network.landmarks.landmarks.size() << " landmarks in "
+                << network.landmarks.preprocessingMs << " ms, "
+                << network.landmarks.memoryBytes() / 1024.0 << " KB" << endl;
+        }
+
+        // Distance contraction and the fare order are independent, so build them side by side
+        auto distanceHierarchy = make_shared<ContractionHierarchy<double>>();
+        thread distanceContraction([&network, &distanceHierarchy]() {
+            HierarchyBuilder<DistanceCost>(network, DistanceCost()).build(*distanceHierarchy);
+        });
+        buildCustomizableHierarchy(network, network.customizable);
+        auto fareHierarchy = make_shared<ContractionHierarchy<int>>();
+        customizeHierarchy(network, network.customizable, FareCost(), *fareHierarchy);
+        distanceContraction.join();
+
+        network.distanceHierarchy = distanceHierarchy;
+        network.fareHierarchy = fareHierarchy;
+
+        if (verbose) {
+            cout << "[*] Contraction hierarchies: distance " << distanceHierarchy->shortcutCount << " shortcuts in "
+                << distanceHierarchy->preprocessingMs << " ms; fare order " << network.customizable.arcCount()
+                << " arcs in " << network.customizable.preprocessingMs << " ms, customized in "
+                << fareHierarchy->preprocessingMs << " ms" << endl;
+        }
+
+        auto distanceLabels = loadOrBuildHubLabels<double>(distanceHierarchy, hubLabelBudgetBytes, "distance");
+        network.distanceLabels = distanceLabels;
+        network.fareLabels = loadOrBuildHubLabels<int>(fareHierarchy, fareLabelBudget(network), "fare");
+
+        network.version = ++versionsPublished;
+        return make_shared<const CompactGraph>(move(network));
+    }
+
+    // Change the fare of the route from <-> to run by busName, in both
+    // directions. Topology is untouched, so unless a freeze is pending only the
+    // fare metric is redone on a copy of the current version: the ALT fare
+    // tables are recomputed and the fare hierarchy is customized again on the
+    // existing order. Queries keep using the previous version until the copy
+    // is published. Returns false when no such route exists.
+    bool updateFare(string from, string to, string busName, int fare) {
+        lock_guard<mutex> lock(editGuard);
+        bool updated = setStagedFare(from, to, busName, fare);
+        updated = setStagedFare(to, from, busName, fare) || updated;
+
+        if (!updated) {
+            if (verbose) cout << "[!] No route " << from << " <-> " << to << " on " << busName << endl;
+            return false;
+        }
+        if (verbose) cout << "[~] Updated fare: " << from << " <-> " << to << " (" << busName << ") is now Rs." << fare << endl;
+        if (stagingDirty.load()) {
+            return true;
+        }
+
+        auto next = make_shared<CompactGraph>(*published.pin());
+        CompactGraph& network = *next;
+        setFrozenFare(network, network.findStop(from), network.findStop(to), busName, fare);
+        setFrozenFare(network, network.findStop(to), network.findStop(from), busName, fare);
+
+        refreshLandmarkFares(network);
+        auto fareHierarchy = make_shared<ContractionHierarchy<int>>();
+        customizeHierarchy(network, network.customizable, FareCost(), *fareHierarchy);
+        network.fareHierarchy = fareHierarchy;
+        if (verbose) cout << "[*] Fare hierarchy customized in " << fareHierarchy->preprocessingMs << " ms" << endl;
+
+        network.fareLabels = loadOrBuildHubLabels<int>(fareHierarchy, fareLabelBudget(network), "fare");
+        network.version = ++versionsPublished;
+        published.store(next);
+        return true;
+    }
+
+    string findShortestPath(string startStop, string endStop) {
+        return findPathWithPolicy(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Finding optimal route...",
+            "Shortest Distance (Dijkstra's Algorithm)");
+    }
+
+    string findCheapestPath(string startStop, string endStop) {
+        return findPathWithPolicy(startStop, endStop, FareCost(),
+            "[LOWEST FARE] Finding most economical route...",
+            "Lowest Fare (Dijkstra's Algorithm - Fare Optimized)");
+    }
+
+    string findShortestPathBidirectional(string startStop, string endStop) {
+        return findPathBidirectional(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Finding optimal route from both ends...",
+            "Shortest Distance (Bidirectional Dijkstra)");
+    }
+
+    string findCheapestPathBidirectional(string startStop, string endStop) {
+        return findPathBidirectional(startStop, endStop, FareCost(),
+            "[LOWEST FARE] Finding most economical route from both ends...",
+            "Lowest Fare (Bidirectional Dijkstra)");
+    }
+
+    string findShortestPathAStar(string startStop, string endStop) {
+        return findPathWithPolicy<DistanceCost, GreatCircleHeuristic>(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Finding optimal route towards the destination...",
+            "Shortest Distance (A* Search - Great-Circle Bound)");
+    }
+
+    string findShortestPathALT(string startStop, string endStop) {
+        return findPathWithPolicy<DistanceCost, LandmarkHeuristic<DistanceCost>>(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Finding optimal route guided by landmarks...",
+            "Shortest Distance (ALT - A* with Landmarks)");
+    }
+
+    string findCheapestPathALT(string startStop, string endStop) {
+        return findPathWithPolicy<FareCost, LandmarkHeuristic<FareCost>>(startStop, endStop, FareCost(),
+            "[LOWEST FARE] Finding most economical route guided by landmarks...",
+            "Lowest Fare (ALT - A* with Landmarks)");
+    }
+
+    string findShortestPathCH(string startStop, string endStop) {
+        return findPathWithHierarchy(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Finding optimal route through the hierarchy...",
+            "Shortest Distance (Contraction Hierarchies)");
+    }
+
+    string findCheapestPathCH(string startStop, string endStop) {
+        return findPathWithHierarchy(startStop, endStop, FareCost(),
+            "[LOWEST FARE] Finding most economical route through the hierarchy...",
+            "Lowest Fare (Contraction Hierarchies)");
+    }
+
+    string findShortestPathHubLabels(string startStop, string endStop) {
+        return findPathWithLabels(startStop, endStop, DistanceCost(),
+            "[SHORTEST DISTANCE] Looking up optimal route in the hub labels...",
+            "Shortest Distance (Hub Labels)", "Shortest Distance (Contraction Hierarchies)");
+    }
+
+    string findCheapestPathHubLabels(string startStop, string endStop) {
+        return findPathWithLabels(startStop, endStop, FareCost(),
+            "[LOWEST FARE] Looking up most economical route in the hub labels...",
+            "Lowest Fare (Hub Labels)", "Lowest Fare (Contraction Hierarchies)");
+    }
+
+    bool hasDistanceLabels() {
+        return snapshot()->distanceLabels != nullptr;
+    }
+
+    bool hasFareLabels() {
+        return snapshot()->fareLabels != nullptr;
+    }
+
+    // The Pareto front of (distance, fare, transfers) journeys as an array of
+    // route results, at most frontLimit of them. See runParetoSearch for slack.
+    string findParetoRoutes(string startStop, string endStop, uint32_t frontLimit, double slack) {
+        if (verbose) {
+            cout << "\n[PARETO] Finding every distance/fare/transfer trade-off..." << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+        const char* algorithmName = "Pareto Front (Multi-Criteria Label Search)";
+
+        searchStats = SearchStats();
+        if (startStop == endStop) {
+            return "[" + buildPathJSON(network, startStop, endStop, startId, vector<uint32_t>(), algorithmName, "\"transfers\":0") + "]";
+        }
+
+        // The shortest and the cheapest route seed the front
+        vector<vector<uint32_t>> knownRoutes(2);
+        if (startId == NO_STOP || endId == NO_STOP ||
+            !findHierarchyPath(*network.distanceHierarchy, startId, endId, knownRoutes[0])) {
+            noPathJSON();
+            return "[]";
+        }
+        findHierarchyPath(*network.fareHierarchy, startId, endId, knownRoutes[1]);
+
+        ParetoWorkspace& workspace = ParetoWorkspace::forThisThread();
+        vector<uint32_t> front;
+        runParetoSearch(network, startId, endId, knownRoutes, slack, workspace, front);
+        boundParetoFront(workspace, front, frontLimit);
+        if (front.empty()) {
+            noPathJSON();
+            return "[]";
+        }
+
+        if (workspace.exhausted && verbose) {
+            cout << "   Label limit reached; the front may be incomplete" << endl;
+        }
+
+        // Transfers tell apart journeys that tie on distance and fare
+        string result = "[";
+        vector<uint32_t> edges;
+        for (size_t i = 0; i < front.size(); i++) {
+            edges.clear();
+            for (uint32_t label = front[i]; workspace.labels[label].parent != NO_LABEL; label = workspace.labels[label].parent) {
+                edges.push_back(workspace.labels[label].edge);
+            }
+            reverse(edges.begin(), edges.end());
+
+            string extraFields = "\"transfers\":" + to_string(workspace.labels[front[i]].transfers);
+            if (workspace.exhausted) extraFields += ",\"limitReached\":true";
+            if (i > 0) result += ",";
+            result += buildPathJSON(network, startStop, endStop, startId, edges, algorithmName, extraFields);
+        }
+        result += "]";
+        return result;
+    }
+
+    // Earliest arrival by scheduled trips leaving startStop at or after
+    // departure (seconds after midnight), walking short static edges between
+    // trips. Among equally early journeys, the one with fewest trips wins.
+    string findRaptorPath(string startStop, string endStop, int departure) {
+        if (verbose) {
+            cout << "\n[TIMETABLE] Finding earliest arrival from " << formatClockTime(departure) << "..." << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        searchStats = SearchStats();
+        RaptorWorkspace& workspace = RaptorWorkspace::forThisThread();
+        uint32_t round = runRaptor(network, startId, endId, departure, workspace);
+        if (round == NO_STOP) {
+            return noPathJSON();
+        }
+
+        vector<JourneyLeg> legs;
+        collectRaptorJourney(network, workspace, round, endId, legs);
+        return buildJourneyJSON(network, startId, legs, departure, "Earliest Arrival (RAPTOR Timetable Search)");
+    }
+
+    // Earliest arrival like findRaptorPath, answered by one Connection Scan pass
+    string findConnectionScanPath(string startStop, string endStop, int departure) {
+        if (verbose) {
+            cout << "\n[TIMETABLE] Scanning connections from " << formatClockTime(departure) << "..." << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        searchStats = SearchStats();
+        ConnectionScanWorkspace& workspace = ConnectionScanWorkspace::forThisThread();
+        if (!runConnectionScan(network, startId, endId, departure, workspace)) {
+            return noPathJSON();
+        }
+
+        vector<JourneyLeg> legs;
+        collectConnectionJourney(network, workspace, endId, legs);
+        return buildJourneyJSON(network, startId, legs, departure, "Earliest Arrival (Connection Scan Algorithm)");
+    }
+
+    // Every journey leaving startStop in [departure, departure + windowMinutes]
+    // that no later departure beats, as an array of results in departure order.
+    // The latest departure's earliest arrival bounds the profile scan.
+    string findDepartureProfile(string startStop, string endStop, int departure, int windowMinutes) {
+        if (verbose) {
+            cout << "\n[TIMETABLE] Listing departures from " << formatClockTime(departure) << " for "
+                << windowMinutes << " minutes..." << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        const Timetable& timetable = network.timetable;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+        const char* algorithmName = "Departure Profile (Connection Scan Algorithm)";
+
+        searchStats = SearchStats();
+        if (startId == NO_STOP || endId == NO_STOP) {
+            noPathJSON();
+            return "[]";
+        }
+        if (startId == endId) {
+            return "[" + buildJourneyJSON(network, startId, vector<JourneyLeg>(), departure, algorithmName) + "]";
+        }
+
+        ConnectionScanWorkspace& workspace = ConnectionScanWorkspace::forThisThread();
+        int windowEnd = departure + windowMinutes * 60;
+        int latestArrival = numeric_limits<int>::max();
+        if (runConnectionScan(network, startId, endId, windowEnd, workspace)) {
+            latestArrival = workspace.arrivalAt(endId) + 1;
+        }
+        runProfileScan(network, endId, departure, latestArrival, workspace);
+
+        // Journeys start by boarding here or a short walk away: (departure, arrival, stop, entry, walk).
+        // Those leaving after the window are only kept to rule out in-window journeys they beat.
+        vector<tuple<int, int, uint32_t, uint32_t, uint32_t>> starts;
+        for (uint32_t entry = 0; entry < workspace.profiles[startId].size(); entry++) {
+            const ProfileEntry& option = workspace.profiles[startId][entry];
+            starts.push_back(make_tuple(option.departure, option.arrival, startId, entry, NO_EDGE));
+        }
+        for (uint32_t slot = timetable.footpathOffsets[startId]; slot < timetable.footpathOffsets[startId + 1]; slot++) {
+            uint32_t next = network.edgeTargets[timetable.footpathEdges[slot]];
+            for (uint32_t entry = 0; entry < workspace.profiles[next].size(); entry++) {
+                const ProfileEntry& option = workspace.profiles[next][entry];
+                int leave = option.departure - timetable.footpathSeconds[slot];
+                if (leave >= departure) {
+                    starts.push_back(make_tuple(leave, option.arrival, next, entry, timetable.footpathEdges[slot]));
+                }
+            }
+        }
+
+        // Keep the journeys that arrive sooner than every later departure
+        sort(starts.begin(), starts.end(), [](const auto& a, const auto& b) {
+            return get<0>(a) != get<0>(b) ? get<0>(a) > get<0>(b) : get<1>(a) < get<1>(b);
+        });
+        vector<size_t> kept;
+        int bestArrival = numeric_limits<int>::max();
+        for (size_t i = 0; i < starts.size(); i++) {
+            if (get<1>(starts[i]) < bestArrival) {
+                bestArrival = get<1>(starts[i]);
+                if (get<0>(starts[i]) <= windowEnd) kept.push_back(i);
+            }
+        }
+        if (kept.empty()) {
+            noPathJSON();
+            return "[]";
+        }
+
+        string result = "[";
+        vector<JourneyLeg> legs;
+        for (size_t k = kept.size(); k-- > 0;) {
+            const auto& start = starts[kept[k]];
+            legs.clear();
+            uint32_t walkEdge = get<4>(start);
+            if (walkEdge != NO_EDGE) {
+                int leave = get<0>(start);
+                legs.push_back(JourneyLeg{ startId, get<2>(start), NO_STOP, NO_TRIP, 0, 0, walkEdge,
+                    leave, leave + walkingSeconds(network.edgeDistances[walkEdge]) });
+            }
+            collectProfileJourney(network, workspace, get<2>(start), get<3>(start), endId, legs);
+
+            if (k + 1 < kept.size()) result += ",";
+            result += buildJourneyJSON(network, startId, legs, get<0>(start), algorithmName);
+        }
+        result += "]";
+        return result;
+    }
+
+    // The k shortest loopless routes as an array of route results, shortest first
+    string findKShortestPaths(string startStop, string endStop, uint32_t k) {
+        return findRankedPaths(startStop, endStop, k, DistanceCost(),
+            "[K SHORTEST] Finding alternative routes by distance...",
+            "K Shortest Distance (Yen's Algorithm)");
+    }
+
+    // The k cheapest loopless routes as an array of route results, cheapest first
+    string findKCheapestPaths(string startStop, string endStop, uint32_t k) {
+        return findRankedPaths(startStop, endStop, k, FareCost(),
+            "[K CHEAPEST] Finding alternative routes by fare...",
+            "K Lowest Fare (Yen's Algorithm)");
+    }
+
+    // Up to k meaningfully different routes by distance (at most three), best first
+    string findAlternativeRoutes(string startStop, string endStop, uint32_t k) {
+        return findRankedPaths(startStop, endStop, min(k, MAX_ALTERNATIVE_ROUTES), DistanceCost(),
+            "[ALTERNATIVES] Finding different routes by distance...",
+            "Alternative Routes by Distance (Plateau Method)", false);
+    }
+
+    // Up to k meaningfully different routes by fare (at most three), cheapest first
+    string findCheapAlternativeRoutes(string startStop, string endStop, uint32_t k) {
+        return findRankedPaths(startStop, endStop, min(k, MAX_ALTERNATIVE_ROUTES), FareCost(),
+            "[ALTERNATIVES] Finding different routes by fare...",
+            "Alternative Routes by Fare (Plateau Method)", false);
+    }
+
+    // Shortest distance where each change of bus also costs penaltyKm
+    string findTransferAwarePath(string startStop, string endStop, double penaltyKm) {
+        return findPathWithTransfers(startStop, endStop, penaltyKm,
+            "[FEWER TRANSFERS] Finding optimal route that avoids changing buses...",
+            "Shortest Distance with Transfer Penalty (Route-Expanded Dijkstra)");
+    }
+
+    // Fewest bus changes, ties broken by distance
+    string findMinTransfersPath(string startStop, string endStop) {
+        return findPathWithTransfers(startStop, endStop, MIN_TRANSFERS_PENALTY_KM,
+            "[MIN TRANSFERS] Finding route with the fewest bus changes...",
+            "Fewest Transfers (Route-Expanded Dijkstra)");
+    }
+
+    string findBalancedPath(string startStop, string endStop) {
+        return findPathWithPolicy(startStop, endStop, BlendedCost(),
+            "[BALANCED] Finding best distance/fare trade-off...",
+            "Balanced (Dijkstra's Algorithm - Distance and Fare Blend)");
+    }
+
+    string findFewestStopsPath(string startStop, string endStop) {
+        return findPathWithPolicy(startStop, endStop, HopCost(),
+            "[FEWEST STOPS] Finding route with the fewest stops...",
+            "Fewest Stops (Dijkstra's Algorithm - Hop Count)");
+    }
+
+    // Any route, by iterative depth-first search; 0 leaves a limit off
+    string findAnyPath(string startStop, string endStop,
+        uint32_t maxDepth = DEFAULT_TRAVERSAL_DEPTH, uint32_t maxStops = DEFAULT_TRAVERSAL_BUDGET) {
+        return findTraversalPath(startStop, endStop, false, maxDepth, maxStops,
+            "[QUICK PATHFINDING] Finding available route...",
+            "Quick Pathfinding (Depth-First Search)");
+    }
+
+    // Route with the fewest stops, by breadth-first search; 0 leaves a limit off
+    string findFewestHopsPath(string startStop, string endStop,
+        uint32_t maxDepth = DEFAULT_TRAVERSAL_DEPTH, uint32_t maxStops = DEFAULT_TRAVERSAL_BUDGET) {
+        return findTraversalPath(startStop, endStop, true, maxDepth, maxStops,
+            "[FEWEST STOPS] Finding route with the fewest stops...",
+            "Fewest Stops (Breadth-First Search)");
+    }
+
+    // Get all unique bus numbers that run on some route
+    vector<string> getAllBuses() {
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        vector<bool> running(network.busNames.size(), false);
+        for (uint32_t bus : network.edgeBusIds) {
+            running[bus] = true;
+        }
+
+        vector<string> buses;
+        for (size_t bus = 0; bus < running.size(); bus++) {
+            if (running[bus]) buses.push_back(network.busNames[bus]);
+        }
+        return buses;
+    }
+
+    // Get network statistics
+    string getStatistics() {
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        int totalRoutes = network.edgeCount();
+        double totalDistance = 0;
+        int totalFare = 0;
+        vector<bool> running(network.busNames.size(), false);
+        size_t uniqueBuses = 0;
+
+        for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+            totalDistance += network.edgeDistances[edge];
+            totalFare += network.edgeFares[edge];
+            if (!running[network.edgeBusIds[edge]]) {
+                running[network.edgeBusIds[edge]] = true;
+                uniqueBuses++;
+            }
+        }
+
+        totalRoutes /= 2; // Each route is counted twice
+        totalDistance /= 2;
+        totalFare /= 2;
+
+        double avgDistance = totalRoutes > 0 ? totalDistance / totalRoutes : 0;
+        double avgFare = totalRoutes > 0 ? (double)totalFare / totalRoutes : 0;
+
+        string result = "{";
+        result += "\"stops\":" + to_string(network.stopCount()) + ",";
+        result += "\"routes\":" + to_string(totalRoutes) + ",";
+        result += "\"buses\":" + to_string(uniqueBuses) + ",";
+        result += "\"totalDistance\":" + to_string(totalDistance) + ",";
+        result += "\"avgDistance\":" + to_string(avgDistance) + ",";
+        result += "\"avgFare\":" + to_string(avgFare) + ",";
+
+        const LandmarkIndex& landmarks = network.landmarks;
+        result += "\"landmarks\":" + to_string(landmarks.landmarks.size()) + ",";
+        result += "\"landmarkPreprocessingMs\":" + to_string(landmarks.preprocessingMs) + ",";
+        result += "\"landmarkMemoryBytes\":" + to_string(landmarks.memoryBytes()) + ",";
+        auto distanceHierarchy = network.distanceHierarchy;
+        auto fareHierarchy = network.fareHierarchy;
+        result += "\"distanceShortcuts\":" + to_string(distanceHierarchy->shortcutCount) + ",";
+        result += "\"fareShortcuts\":" + to_string(fareHierarchy->shortcutCount) + ",";
+        result += "\"hierarchyPreprocessingMs\":" + to_string(distanceHierarchy->preprocessingMs + network.customizable.preprocessingMs) + ",";
+        result += "\"fareCustomizationMs\":" + to_string(fareHierarchy->preprocessingMs) + ",";
+        result += "\"hierarchyMemoryBytes\":" + to_string(distanceHierarchy->memoryBytes() +
+            network.customizable.memoryBytes() + fareHierarchy->memoryBytes()) + ",";
+        auto distanceLabels = network.distanceLabels;
+        auto fareLabels = network.fareLabels;
+        result += "\"distanceLabelEntries\":" + to_string(distanceLabels ? distanceLabels->entryCount() : 0) + ",";
+        result += "\"fareLabelEntries\":" + to_string(fareLabels ? fareLabels->entryCount() : 0) + ",";
+        result += "\"hubLabelPreprocessingMs\":" + to_string((distanceLabels ? distanceLabels->preprocessingMs : 0) +
+            (fareLabels ? fareLabels->preprocessingMs : 0)) + ",";
+        result += "\"hubLabelMemoryBytes\":" + to_string((distanceLabels ? distanceLabels->memoryBytes() : 0) +
+            (fareLabels ? fareLabels->memoryBytes() : 0)) + ",";
+        const Timetable& timetable = network.timetable;
+        result += "\"timetableRoutes\":" + to_string(timetable.routeCount()) + ",";
+        result += "\"trips\":" + to_string(timetable.tripCount()) + ",";
+        result += "\"stopTimes\":" + to_string(timetable.arrivals.size()) + ",";
+        result += "\"connections\":" + to_string(timetable.connectionDepartures.size()) + ",";
+        result += "\"footpaths\":" + to_string(timetable.footpathEdges.size()) + ",";
+        result += "\"timetableMemoryBytes\":" + to_string(timetable.memoryBytes()) + ",";
+        result += "\"version\":" + to_string(network.version) + "}";
+
+        return result;
+    }
+
+    // Search stops by name
+    string searchStops(string query) {
+        Snapshot pinned = snapshot();
+        vector<string> results;
+        string lowerQuery = query;
+        transform(lowerQuery.begin(), lowerQuery.end(), lowerQuery.begin(), ::tolower);
+
+        for (const string& stop : pinned->stopNames) {
+            string lowerStop = stop;
+            transform(lowerStop.begin(), lowerStop.end(), lowerStop.begin(), ::tolower);
+            if (lowerStop.find(lowerQuery) != string::npos) {
+                results.push_back(stop);
+            }
+        }
+
+        string result = "[";
+        for (size_t i = 0; i < results.size(); i++) {
+            if (i > 0) result += ",";
+            result += "\"" + results[i] + "\"";
+        }
+        result += "]";
+
+        return result;
+    }
+
+private:
+    Published<CompactGraph> published;
+    // Set by every staged edit until publish() freezes it; editGuard
+    // serializes the edits, the freeze and publication
+    atomic<bool> stagingDirty{ true };
+    mutex editGuard;
+    uint64_t versionsPublished = 0;
+    unordered_map<string, uint32_t> tripPatternIds;
+    // The published version came from a snapshot file and the staging area
+    // is still empty; the first edit refills it
+    bool stagingStale = false;
+
+    // Staging edits for callers that hold editGuard
+    bool stageStop(const string& name, double latitude, double longitude) {
+        if (stagingStale) thawStaging();
+        if (!adjacencyList.emplace(name, vector<Edge>()).second) {
+            return false;
+        }
+
+        stopNames.push_back(name);
+        stopLatitudes.push_back(latitude);
+        stopLongitudes.push_back(longitude);
+        stagingDirty.store(true);
+        return true;
+    }
+
+    void stageRoute(const string& from, const string& to, double distance, int fare, const string& busName) {
+        if (stagingStale) thawStaging();
+        Edge forwardEdge;
+        forwardEdge.to = to;
+        forwardEdge.distance = distance;
+        forwardEdge.fare = fare;
+        forwardEdge.bus = busName;
+
+        Edge reverseEdge;
+        reverseEdge.to = from;
+        reverseEdge.distance = distance;
+        reverseEdge.fare = fare;
+        reverseEdge.bus = busName;
+
+        adjacencyList[from].push_back(move(forwardEdge));
+        adjacencyList[to].push_back(move(reverseEdge));
+        stagingDirty.store(true);
+    }
+
+    bool stageTrip(const string& busName, const vector<string>& stops, const vector<int>& arrivals, const vector<int>& departures) {
+        if (stagingStale) thawStaging();
+        bool valid = stops.size() >= 2 && arrivals.size() == stops.size() && departures.size() == stops.size();
+        for (size_t i = 0; valid && i < stops.size(); i++) {
+            valid = arrivals[i] >= 0 && arrivals[i] <= departures[i] && (i + 1 == stops.size() || departures[i] <= arrivals[i + 1]);
+        }
+        if (!valid) {
+            return false;
+        }
+
+        string key = busName;
+        for (const string& stop : stops) {
+            key += '\n';
+            key += stop;
+        }
+        auto pattern = tripPatternIds.find(key);
+        if (pattern == tripPatternIds.end()) {
+            pattern = tripPatternIds.emplace(move(key), (uint32_t)tripPatterns.size()).first;
+            tripPatterns.push_back(TripPattern{ busName, stops, vector<int>(), vector<int>() });
+        }
+
+        TripPattern& trips = tripPatterns[pattern->second];
+        trips.arrivals.insert(trips.arrivals.end(), arrivals.begin(), arrivals.end());
+        trips.departures.insert(trips.departures.end(), departures.begin(), departures.end());
+        stagingDirty.store(true);
+        return true;
+    }
+
+    // Rebuild the staging area from the published version, which freezes
+    // back into the same stop ids, edges and trips
+    void thawStaging() {
+        stagingStale = false;
+        Snapshot pinned = published.pin();
+        const CompactGraph& network = *pinned;
+
+        adjacencyList.clear();
+        adjacencyList.reserve(network.stopCount());
+        stopNames = network.stopNames;
+        stopLatitudes = network.stopLatitudes;
+        stopLongitudes = network.stopLongitudes;
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            vector<Edge>& routes = adjacencyList[network.stopNames[stop]];
+            routes.reserve(network.neighbors(stop).size());
+            for (uint32_t edge : network.neighbors(stop)) {
+                routes.push_back(Edge{ network.stopNames[network.edgeTargets[edge]], network.edgeDistances[edge],
+                    network.edgeFares[edge], network.busNames[network.edgeBusIds[edge]] });
+            }
+        }
+
+        const Timetable& timetable = network.timetable;
+        tripPatterns.clear();
+        tripPatternIds.clear();
+        vector<string> stops;
+        for (uint32_t route = 0; route < timetable.routeCount(); route++) {
+            stops.clear();
+            for (uint32_t slot = timetable.routeStopOffsets[route]; slot < timetable.routeStopOffsets[route + 1]; slot++) {
+                stops.push_back(network.stopNames[timetable.routeStops[slot]]);
+            }
+            for (uint32_t trip = timetable.routeTripOffsets[route]; trip < timetable.routeTripOffsets[route + 1]; trip++) {
+                auto first = timetable.arrivals.begin() + timetable.timeIndex(route, trip, 0);
+                auto firstDeparture = timetable.departures.begin() + timetable.timeIndex(route, trip, 0);
+                stageTrip(network.busNames[timetable.routeBusIds[route]], stops,
+                    vector<int>(first, first + stops.size()), vector<int>(firstDeparture, firstDeparture + stops.size()));
+            }
+        }
+        stagingDirty.store(false);
+    }
+
+    static string searchStatsJSON() {
+        string result;
+        appendSearchStatsJSON(result);
+        return result;
+    }
+
+    static void appendSearchStatsJSON(string& out) {
+        out += "\"nodesSettled\":";
+        appendJsonNumber(out, (long long)searchStats.nodesSettled);
+        out += ",\"edgesRelaxed\":";
+        appendJsonNumber(out, (long long)searchStats.edgesRelaxed);
+    }
+
+    // Smallest ratio of edge distance to straight-line distance, or 0 when the
+    // network has stops without coordinates
+    static double minKmPerGreatCircleKm(const CompactGraph& network) {
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            if (std::isnan(network.stopLatitudes[stop]) || std::isnan(network.stopLongitudes[stop])) {
+                return 0;
+            }
+        }
+
+        double minRatio = numeric_limits<double>::max();
+        for (uint32_t edge = 0; edge < network.edgeCount(); edge++) {
+            uint32_t from = network.edgeSources[edge];
+            uint32_t to = network.edgeTargets[edge];
+            double straightLine = greatCircleKm(network.stopLatitudes[from], network.stopLongitudes[from],
+                network.stopLatitudes[to], network.stopLongitudes[to]);
+            if (straightLine > 1e-9) {
+                minRatio = min(minRatio, network.edgeDistances[edge] / straightLine);
+            }
+        }
+
+        return minRatio == numeric_limits<double>::max() ? 0 : minRatio;
+    }
+
+    // Labels for one metric: the saved file when it matches this hierarchy,
+    // otherwise a fresh build that is saved for next time. Null when disabled
+    // or when the labels do not fit in budgetBytes.
+    template <class Weight>
+    shared_ptr<const HubLabels<Weight>> loadOrBuildHubLabels(
+        shared_ptr<const ContractionHierarchy<Weight>> hierarchy,
+        size_t budgetBytes,
+        const string& metricName
+    ) {
+        if (budgetBytes == 0) {
+            return nullptr;
+        }
+
+        string path = hubLabelPath.empty() ? "" : hubLabelPath + "." + metricName;
+        shared_ptr<const HubLabels<Weight>> labels;
+        if (!path.empty()) {
+            labels = loadHubLabels(path, hierarchy);
+            if (labels && labels->memoryBytes() > budgetBytes) {
+                labels = nullptr;
+            }
+        }
+        if (!labels) {
+            labels = buildHubLabels(hierarchy, budgetBytes);
+            if (labels && !path.empty() && !saveHubLabels(*labels, path) && verbose) {
+                cout << "[!] Could not save hub labels to " << path << endl;
+            }
+        }
+
+        if (verbose) {
+            if (labels) {
+                cout << "[*] Hub labels (" << metricName << "): " << labels->entryCount() << " entries, "
+                    << labels->memoryBytes() / 1024.0 << " KB, "
+                    << (labels->loadedFromDisk ? "loaded from " + path : "built in " + to_string(labels->preprocessingMs) + " ms") << endl;
+            }
+            else {
+                cout << "[*] Hub labels (" << metricName << "): over the " << budgetBytes / 1024.0 << " KB budget, using the hierarchy" << endl;
+            }
+        }
+        return labels;
+    }
+
+    // Whatever the distance labels left of the budget
+    size_t fareLabelBudget(const CompactGraph& network) const {
+        auto distanceLabels = network.distanceLabels;
+        size_t used = distanceLabels ? distanceLabels->memoryBytes() : 0;
+        return used < hubLabelBudgetBytes ? hubLabelBudgetBytes - used : 0;
+    }
+
+    // Lay the staged trips out as RAPTOR routes. Each pattern's trips are
+    // taken in order of first departure and split greedily into routes in
+    // which no trip overtakes the one before it, so a route's trips stay
+    // sorted at every stop.
+    void buildTimetable(CompactGraph& network, unordered_map<string, uint32_t>& busIds) const {
+        Timetable& timetable = network.timetable;
+        timetable.routeStopOffsets.assign(1, 0);
+        timetable.routeTripOffsets.assign(1, 0);
+
+        for (const TripPattern& pattern : tripPatterns) {
+            auto bus = busIds.find(pattern.bus);
+            if (bus == busIds.end()) {
+                bus = busIds.emplace(pattern.bus, (uint32_t)network.busNames.size()).first;
+                network.busNames.push_back(pattern.bus);
+            }
+
+            uint32_t length = (uint32_t)pattern.stops.size();
+            uint32_t tripCount = (uint32_t)(pattern.departures.size() / length);
+            vector<uint32_t> order(tripCount);
+            for (uint32_t trip = 0; trip < tripCount; trip++) {
+                order[trip] = trip;
+            }
+            stable_sort(order.begin(), order.end(), [&pattern, length](uint32_t a, uint32_t b) {
+                return pattern.departures[(size_t)a * length] < pattern.departures[(size_t)b * length];
+            });
+
+            vector<vector<uint32_t>> groups;
+            for (uint32_t trip : order) {
+                size_t group = 0;
+                for (; group < groups.size(); group++) {
+                    size_t last = (size_t)groups[group].back() * length;
+                    size_t next = (size_t)trip * length;
+                    bool overtakes = false;
+                    for (uint32_t position = 0; position < length && !overtakes; position++) {
+                        overtakes = pattern.arrivals[next + position] < pattern.arrivals[last + position] ||
+                            pattern.departures[next + position] < pattern.departures[last + position];
+                    }
+                    if (!overtakes) break;
+                }
+                if (group == groups.size()) groups.emplace_back();
+                groups[group].push_back(trip);
+            }
+
+            for (const vector<uint32_t>& group : groups) {
+                timetable.routeBusIds.push_back(bus->second);
+                timetable.routeTimeOffsets.push_back((uint32_t)timetable.arrivals.size());
+                for (const string& stop : pattern.stops) {
+                    timetable.routeStops.push_back(network.stopIds[stop]);
+                }
+                timetable.routeStopOffsets.push_back((uint32_t)timetable.routeStops.size());
+                for (uint32_t trip : group) {
+                    size_t first = (size_t)trip * length;
+                    timetable.arrivals.insert(timetable.arrivals.end(), pattern.arrivals.begin() + first, pattern.arrivals.begin() + first + length);
+                    timetable.departures.insert(timetable.departures.end(), pattern.departures.begin() + first, pattern.departures.begin() + first + length);
+                }
+                timetable.routeTripOffsets.push_back(timetable.routeTripOffsets.back() + (uint32_t)group.size());
+            }
+        }
+
+        // Counting sort of the route stops by stop gives the routes serving each stop
+        timetable.stopRouteOffsets.assign(network.stopCount() + 1, 0);
+        for (uint32_t stop : timetable.routeStops) {
+            timetable.stopRouteOffsets[stop + 1]++;
+        }
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            timetable.stopRouteOffsets[stop + 1] += timetable.stopRouteOffsets[stop];
+        }
+        vector<uint32_t> nextSlot(timetable.stopRouteOffsets.begin(), timetable.stopRouteOffsets.end() - 1);
+        timetable.stopRoutes.resize(timetable.routeStops.size());
+        timetable.stopRoutePositions.resize(timetable.routeStops.size());
+        for (uint32_t route = 0; route < timetable.routeCount(); route++) {
+            for (uint32_t position = 0; position < timetable.routeLength(route); position++) {
+                uint32_t slot = nextSlot[timetable.routeStops[timetable.routeStopOffsets[route] + position]]++;
+                timetable.stopRoutes[slot] = route;
+                timetable.stopRoutePositions[slot] = position;
+            }
+        }
+
+        // Connections in departure order (then arrival, so zero-length hops come first)
+        timetable.tripRoutes.resize(timetable.tripCount());
+        vector<uint32_t> connections;
+        for (uint32_t route = 0; route < timetable.routeCount(); route++) {
+            for (uint32_t trip = timetable.routeTripOffsets[route]; trip < timetable.routeTripOffsets[route + 1]; trip++) {
+                timetable.tripRoutes[trip] = route;
+                for (uint32_t position = 0; position + 1 < timetable.routeLength(route); position++) {
+                    connections.push_back((uint32_t)timetable.timeIndex(route, trip, position));
+                }
+            }
+        }
+        stable_sort(connections.begin(), connections.end(), [&timetable](uint32_t a, uint32_t b) {
+            return timetable.departures[a] != timetable.departures[b] ? timetable.departures[a] < timetable.departures[b] :
+                timetable.arrivals[a + 1] < timetable.arrivals[b + 1];
+        });
+
+        timetable.connectionDepartures.clear();
+        timetable.connectionArrivals.clear();
+        timetable.connectionFromStops.clear();
+        timetable.connectionToStops.clear();
+        timetable.connectionTrips.clear();
+        timetable.connectionPositions.clear();
+        vector<uint32_t> routeOfTime;
+        for (uint32_t route = 0; route < timetable.routeCount(); route++) {
+            routeOfTime.resize(timetable.routeTimeOffsets[route] + (size_t)(timetable.routeTripOffsets[route + 1] -
+                timetable.routeTripOffsets[route]) * timetable.routeLength(route), route);
+        }
+        for (uint32_t index : connections) {
+            uint32_t route = routeOfTime[index];
+            uint32_t offset = index - timetable.routeTimeOffsets[route];
+            uint32_t position = offset % timetable.routeLength(route);
+            timetable.connectionDepartures.push_back(timetable.departures[index]);
+            timetable.connectionArrivals.push_back(timetable.arrivals[index + 1]);
+            timetable.connectionFromStops.push_back(timetable.routeStops[timetable.routeStopOffsets[route] + position]);
+            timetable.connectionToStops.push_back(timetable.routeStops[timetable.routeStopOffsets[route] + position + 1]);
+            timetable.connectionTrips.push_back(timetable.routeTripOffsets[route] + offset / timetable.routeLength(route));
+            timetable.connectionPositions.push_back(position);
+        }
+
+        timetable.footpathOffsets.assign(1, 0);
+        timetable.footpathEdges.clear();
+        timetable.footpathSeconds.clear();
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            for (uint32_t edge : network.neighbors(stop)) {
+                if (network.edgeDistances[edge] <= RAPTOR_MAX_WALK_KM && network.edgeTargets[edge] != stop) {
+                    timetable.footpathEdges.push_back(edge);
+                    timetable.footpathSeconds.push_back(walkingSeconds(network.edgeDistances[edge]));
+                }
+            }
+            timetable.footpathOffsets.push_back((uint32_t)timetable.footpathEdges.size());
+        }
+    }
+
+    // Number the distinct (stop, arriving bus) pairs from the reverse CSR
+    static void buildTransferStates(CompactGraph& network) {
+        vector<uint32_t> stateOfBus(network.busNames.size(), NO_STOP);
+        network.edgeStates.assign(network.edgeCount(), NO_STOP);
+        network.stateStops.clear();
+        network.stateBuses.clear();
+
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            uint32_t firstState = network.stateCount();
+            for (uint32_t edge : network.incoming(stop)) {
+                uint32_t bus = network.edgeBusIds[edge];
+                if (stateOfBus[bus] == NO_STOP || stateOfBus[bus] < firstState) {
+                    stateOfBus[bus] = network.stateCount();
+                    network.stateStops.push_back(stop);
+                    network.stateBuses.push_back(bus);
+                }
+                network.edgeStates[edge] = stateOfBus[bus];
+            }
+        }
+    }
+
+    bool setStagedFare(const string& from, const string& to, const string& busName, int fare) {
+        if (stagingStale) thawStaging();
+        auto routes = adjacencyList.find(from);
+        if (routes == adjacencyList.end()) {
+            return false;
+        }
+
+        bool updated = false;
+        for (Edge& edge : routes->second) {
+            if (edge.to == to && edge.bus == busName) {
+                edge.fare = fare;
+                updated = true;
+            }
+        }
+        return updated;
+    }
+
+    static void setFrozenFare(CompactGraph& network, uint32_t fromId, uint32_t toId, const string& busName, int fare) {
+        if (fromId == NO_STOP || toId == NO_STOP) {
+            return;
+        }
+        for (uint32_t edge : network.neighbors(fromId)) {
+            if (network.edgeTargets[edge] == toId && network.busNames[network.edgeBusIds[edge]] == busName) {
+                network.edgeFares[edge] = fare;
+            }
+        }
+    }
+
+    static void internStop(CompactGraph& network, const string& name) {
+        if (network.stopIds.find(name) == network.stopIds.end()) {
+            network.stopIds.emplace(name, (uint32_t)network.stopNames.size());
+            network.stopNames.push_back(name);
+        }
+    }
+
+    // Ranked routes as an array of results: exact k shortest by Yen's
+    // algorithm, or plateau alternatives when exact is false
+    template <class CostPolicy>
+    string findRankedPaths(
+        const string& startStop,
+        const string& endStop,
+        uint32_t k,
+        const CostPolicy& cost,
+        const char* logHeader,
+        const char* algorithmName,
+        bool exact = true
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        searchStats = SearchStats();
+        if (startStop == endStop) {
+            return "[" + buildPathJSON(network, startStop, endStop, startId, vector<uint32_t>(), algorithmName) + "]";
+        }
+        if (startId == NO_STOP || endId == NO_STOP) {
+            noPathJSON();
+            return "[]";
+        }
+
+        vector<RankedPath<typename CostPolicy::Weight>> paths;
+        if (exact) {
+            runYen(network, cost, startId, endId, k, paths);
+        }
+        else {
+            findPlateauAlternatives(network, cost, startId, endId, k, paths);
+        }
+        if (paths.empty()) {
+            noPathJSON();
+            return "[]";
+        }
+
+        string result = "[";
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (i > 0) result += ",";
+            result += buildPathJSON(network, startStop, endStop, startId, paths[i].edges, algorithmName);
+        }
+        result += "]";
+        return result;
+    }
+
+    template <class CostPolicy, class Heuristic = ZeroHeuristic>
+    string findPathWithPolicy(
+        const string& startStop,
+        const string& endStop,
+        const CostPolicy& cost,
+        const char* logHeader,
+        const char* algorithmName
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        SearchWorkspace<typename CostPolicy::Weight>& workspace = SearchWorkspace<typename CostPolicy::Weight>::forThisThread();
+        searchStats = SearchStats();
+
+        // An unknown destination can never be reached, so skip the search entirely
+        Heuristic heuristic(network, endId);
+        runDijkstra(network, cost, heuristic, endId == NO_STOP ? NO_STOP : startId, endId, workspace);
+
+        return buildResultJSON(network, startStop, endStop, startId, endId, workspace, algorithmName);
+    }
+
+    template <class CostPolicy>
+    string findPathBidirectional(
+        const string& startStop,
+        const string& endStop,
+        const CostPolicy& cost,
+        const char* logHeader,
+        const char* algorithmName
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        typedef SearchWorkspace<typename CostPolicy::Weight> Workspace;
+        Workspace& forward = Workspace::forThisThread(0);
+        Workspace& backward = Workspace::forThisThread(1);
+        searchStats = SearchStats();
+
+        uint32_t meetingStop = runBidirectionalDijkstra(network, cost, startId, endId, forward, backward);
+        if (startStop != endStop && meetingStop == NO_STOP) {
+            return noPathJSON();
+        }
+
+        vector<uint32_t> edges;
+        if (startStop != endStop) {
+            size_t forwardHops = 0;
+            size_t backwardHops = 0;
+            for (uint32_t current = meetingStop; current != startId; current = forward.previousStop[current]) {
+                forwardHops++;
+            }
+            for (uint32_t current = meetingStop; current != endId; current = backward.previousStop[current]) {
+                backwardHops++;
+            }
+
+            edges.resize(forwardHops + backwardHops);
+            size_t position = forwardHops;
+            for (uint32_t current = meetingStop; current != startId; current = forward.previousStop[current]) {
+                edges[--position] = forward.previousEdge[current];
+            }
+            position = forwardHops;
+            for (uint32_t current = meetingStop; current != endId; current = backward.previousStop[current]) {
+                edges[position++] = backward.previousEdge[current];
+            }
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    template <class CostPolicy>
+    string findPathWithHierarchy(
+        const string& startStop,
+        const string& endStop,
+        const CostPolicy& cost,
+        const char* logHeader,
+        const char* algorithmName
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        searchStats = SearchStats();
+
+        // Hold on to this version: a fare update may publish a new one meanwhile
+        const auto& currentHierarchy = hierarchyFor(network, cost);
+        const auto& hierarchy = *currentHierarchy;
+        vector<uint32_t> edges;
+        if (startStop != endStop && !findHierarchyPath(hierarchy, startId, endId, edges)) {
+            return noPathJSON();
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    // Hub label lookup: the cheapest hub shared by the start's forward label and
+    // the end's backward label gives the cost, and following each entry's next
+    // stop back to the endpoints gives the hierarchy arcs. Falls back to the
+    // hierarchy search when labels are disabled or over budget.
+    template <class CostPolicy>
+    string findPathWithLabels(
+        const string& startStop,
+        const string& endStop,
+        const CostPolicy& cost,
+        const char* logHeader,
+        const char* algorithmName,
+        const char* fallbackName
+    ) {
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        const auto& currentLabels = labelsFor(network, cost);
+        if (!currentLabels) {
+            return findPathWithHierarchy(startStop, endStop, cost, logHeader, fallbackName);
+        }
+
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        const auto& labels = *currentLabels;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+        searchStats = SearchStats();
+        if (startStop == endStop) {
+            return buildPathJSON(network, startStop, endStop, startId, vector<uint32_t>(), algorithmName);
+        }
+        if (startId == NO_STOP || endId == NO_STOP) {
+            return noPathJSON();
+        }
+
+        uint32_t forwardBegin = labels.forwardOffsets[startId];
+        uint32_t forwardEnd = labels.forwardOffsets[startId + 1];
+        uint32_t backwardBegin = labels.backwardOffsets[endId];
+        uint32_t backwardEnd = labels.backwardOffsets[endId + 1];
+        searchStats.edgesRelaxed = (forwardEnd - forwardBegin) + (backwardEnd - backwardBegin);
+
+        pair<uint32_t, uint32_t> hub = cheapestCommonHub(
+            labels.forwardHubs.data() + forwardBegin, labels.forwardCosts.data() + forwardBegin, forwardEnd - forwardBegin,
+            labels.backwardHubs.data() + backwardBegin, labels.backwardCosts.data() + backwardBegin, backwardEnd - backwardBegin);
+        if (hub.first == NO_STOP) {
+            return noPathJSON();
+        }
+
+        vector<uint32_t> arcs;
+        for (uint32_t entry = forwardBegin + hub.first; labels.forwardHubs[entry] != startId;
+            entry = findLabelEntry(labels.forwardHubs, forwardBegin, forwardEnd, labels.forwardNextStops[entry])) {
+            arcs.push_back(labels.forwardArcs[entry]);
+            searchStats.nodesSettled++;
+        }
+        reverse(arcs.begin(), arcs.end());
+        for (uint32_t entry = backwardBegin + hub.second; labels.backwardHubs[entry] != endId;
+            entry = findLabelEntry(labels.backwardHubs, backwardBegin, backwardEnd, labels.backwardNextStops[entry])) {
+            arcs.push_back(labels.backwardArcs[entry]);
+            searchStats.nodesSettled++;
+        }
+
+        vector<uint32_t> edges;
+        for (uint32_t arc : arcs) {
+            unpackHierarchyArc(*labels.hierarchy, arc, edges);
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    string findPathWithTransfers(
+        const string& startStop,
+        const string& endStop,
+        double penaltyKm,
+        const char* logHeader,
+        const char* algorithmName
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        SearchWorkspace<double>& workspace = SearchWorkspace<double>::forThisThread();
+        searchStats = SearchStats();
+        uint32_t endState = runTransferSearch(network, DistanceCost(), penaltyKm, startId, endId, workspace);
+        if (startStop != endStop && endState == NO_STOP) {
+            return noPathJSON();
+        }
+
+        vector<uint32_t> edges;
+        if (startStop != endStop) {
+            for (uint32_t state = endState; workspace.previousEdge[state] != NO_EDGE; state = workspace.previousStop[state]) {
+                edges.push_back(workspace.previousEdge[state]);
+            }
+            reverse(edges.begin(), edges.end());
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    string findTraversalPath(
+        const string& startStop,
+        const string& endStop,
+        bool breadthFirst,
+        uint32_t maxDepth,
+        uint32_t maxStops,
+        const char* logHeader,
+        const char* algorithmName
+    ) {
+        if (verbose) {
+            cout << "\n" << logHeader << endl;
+            cout << "   From: " << startStop << endl;
+            cout << "   To:   " << endStop << endl;
+        }
+
+        Snapshot pinned = snapshot();
+        const CompactGraph& network = *pinned;
+        uint32_t startId = network.findStop(startStop);
+        uint32_t endId = network.findStop(endStop);
+
+        searchStats = SearchStats();
+        if (startId == NO_STOP || endId == NO_STOP) {
+            return noPathJSON();
+        }
+
+        TraversalWorkspace& workspace = TraversalWorkspace::forThisThread();
+        vector<uint32_t> edges;
+        bool found = breadthFirst
+            ? runBreadthFirst(network, startId, endId, maxDepth, maxStops, workspace, edges)
+            : runDepthFirst(network, startId, endId, maxDepth, maxStops, workspace, edges);
+
+        if (!found) {
+            if (!workspace.exhausted) return noPathJSON();
+            if (verbose) cout << "   Result: Search limit reached before a path was found" << endl;
+            return "{\"found\":false,\"limitReached\":true," + searchStatsJSON() + "}";
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    string buildResultJSON(
+        const CompactGraph& network,
+        const string& startStop,
+        const string& endStop,
+        uint32_t startId,
+        uint32_t endId,
+        const SearchLabels& labels,
+        string algorithmName
+    ) {
+        if (startStop != endStop && (startId == NO_STOP || endId == NO_STOP || !labels.reached(endId))) {
+            return noPathJSON();
+        }
+
+        vector<uint32_t> edges;
+        if (startStop != endStop) {
+            // Count the hops first so the edges can be written back to front in place
+            size_t hops = 0;
+            for (uint32_t current = endId; current != startId; current = labels.previousStop[current]) {
+                hops++;
+            }
+
+            edges.resize(hops);
+            for (uint32_t current = endId; current != startId; current = labels.previousStop[current]) {
+                edges[--hops] = labels.previousEdge[current];
+            }
+        }
+
+        return buildPathJSON(network, startStop, endStop, startId, edges, algorithmName);
+    }
+
+    // Result JSON for a timetable journey: the buildPathJSON fields plus the
+    // departure and arrival clock times, the number of transfers and the legs.
+    // Rides take their distance and fare from the static edge of the same bus
+    // between each pair of stops; walks are free and show up as bus "Walk".
+    string buildJourneyJSON(
+        const CompactGraph& network,
+        uint32_t startId,
+        const vector<JourneyLeg>& legs,
+        int departure,
+        string algorithmName
+    ) {
+        const Timetable& timetable = network.timetable;
+        vector<uint32_t> path;
+        vector<string> buses;
+        double totalDistance = 0;
+        int totalFare = 0;
+        int rides = 0;
+
+        path.push_back(startId);
+        for (const JourneyLeg& leg : legs) {
+            if (leg.edge != NO_EDGE) {
+                path.push_back(leg.toStop);
+                buses.push_back("Walk");
+                totalDistance += network.edgeDistances[leg.edge];
+                continue;
+            }
+
+            rides++;
+            uint32_t bus = timetable.routeBusIds[leg.route];
+            const uint32_t* stops = timetable.routeStops.data() + timetable.routeStopOffsets[leg.route];
+            for (uint32_t position = leg.boardPosition; position < leg.alightPosition; position++) {
+                uint32_t edge = findBusEdge(network, stops[position], stops[position + 1], bus);
+                if (edge != NO_EDGE) {
+                    totalDistance += network.edgeDistances[edge];
+                    totalFare += network.edgeFares[edge];
+                }
+                path.push_back(stops[position + 1]);
+                buses.push_back(network.busNames[bus]);
+            }
+        }
+
+        int arrival = legs.empty() ? departure : legs.back().arrival;
+        if (!legs.empty()) departure = legs.front().departure;
+
+        if (verbose) {
+            cout << "   Result: Depart " << formatClockTime(departure) << ", arrive " << formatClockTime(arrival)
+                << " with " << max(0, rides - 1) << " transfers, " << path.size() << " stops" << endl;
+        }
+
+        string result = "{\"found\":true,";
+        result += "\"algorithm\":\"" + algorithmName + "\",";
+        result += "\"distance\":" + to_string(totalDistance) + ",";
+        result += "\"fare\":" + to_string(totalFare) + ",";
+        result += "\"stops\":" + to_string(path.size()) + ",";
+        result += "\"departure\":\"" + formatClockTime(departure) + "\",";
+        result += "\"arrival\":\"" + formatClockTime(arrival) + "\",";
+        result += "\"transfers\":" + to_string(max(0, rides - 1)) + ",";
+
+        result += "\"path\":[";
+        for (size_t i = 0; i < path.size(); i++) {
+            if (i > 0) result += ",";
+            result += "\"" + network.stopNames[path[i]] + "\"";
+        }
+        result += "],";
+
+        result += "\"buses\":[";
+        for (size_t i = 0; i < buses.size(); i++) {
+            if (i > 0) result += ",";
+            result += "\"" + buses[i] + "\"";
+        }
+        result += "],";
+
+        result += "\"legs\":[";
+        for (size_t i = 0; i < legs.size(); i++) {
+            const JourneyLeg& leg = legs[i];
+            if (i > 0) result += ",";
+            result += "{\"bus\":\"" + (leg.edge != NO_EDGE ? string("Walk") : network.busNames[timetable.routeBusIds[leg.route]]) + "\",";
+            result += "\"from\":\"" + network.stopNames[leg.fromStop] + "\",";
+            result += "\"to\":\"" + network.stopNames[leg.toStop] + "\",";
+            result += "\"departure\":\"" + formatClockTime(leg.departure) + "\",";
+            result += "\"arrival\":\"" + formatClockTime(leg.arrival) + "\"}";
+        }
+        result += "],";
+        result += searchStatsJSON();
+        result += "}";
+
+        return result;
+    }
+
+    // The static edge from -> to run by bus, or else the shortest one between them
+    static uint32_t findBusEdge(const CompactGraph& network, uint32_t from, uint32_t to, uint32_t bus) {
+        uint32_t found = NO_EDGE;
+        for (uint32_t edge : network.neighbors(from)) {
+            if (network.edgeTargets[edge] != to) continue;
+            if (network.edgeBusIds[edge] == bus) return edge;
+            if (found == NO_EDGE || network.edgeDistances[edge] < network.edgeDistances[found]) found = edge;
+        }
+        return found;
+    }
+
+    string noPathJSON() {
+        if (verbose) cout << "   Result: No path found!" << endl;
+        return "{\"found\":false}";
+    }
+
+    // Result JSON for the route that leaves startId and follows the given edge
+    // ids; extraFields ("key":value pairs) are added after the stop count
+    string buildPathJSON(
+        const CompactGraph& network,
+        const string& startStop,
+        const string& endStop,
+        uint32_t startId,
+        const vector<uint32_t>& edges,
+        string algorithmName,
+        const string& extraFields = string()
+    ) {
+        if (startStop == endStop) {
+            string result = "{\"found\":true,";
+            result += "\"algorithm\":\"" + algorithmName + "\",";
+            result += "\"distance\":0,";
+            result += "\"fare\":0,";
+            result += "\"stops\":1,";
+            if (!extraFields.empty()) result += extraFields + ",";
+            result += "\"path\":[\"" + startStop + "\"],";
+            result += "\"buses\":[]}";
+            return result;
+        }
+
+        double totalDistance = 0;
+        int totalFare = 0;
+
+        // One pass over the route for the totals and the exact result size
+        size_t size = 128 + algorithmName.size() + extraFields.size() + 5 * JSON_NUMBER_BYTES + network.stopNames[startId].size();
+        for (uint32_t edge : edges) {
+            totalDistance += network.edgeDistances[edge];
+            totalFare += network.edgeFares[edge];
+            size += network.stopNames[network.edgeTargets[edge]].size() + network.busNames[network.edgeBusIds[edge]].size() + 6;
+        }
+
+        if (verbose) {
+            cout << "   Result: Found path with " << edges.size() + 1 << " stops, ";
+            cout << totalDistance << " km, Rs." << totalFare << endl;
+        }
+
+        string result;
+        result.reserve(size);
+        result += "{\"found\":true,\"algorithm\":";
+        appendJsonString(result, algorithmName);
+        result += ",\"distance\":";
+        appendJsonNumber(result, totalDistance);
+        result += ",\"fare\":";
+        appendJsonNumber(result, (long long)totalFare);
+        result += ",\"stops\":";
+        appendJsonNumber(result, (long long)edges.size() + 1);
+        if (!extraFields.empty()) {
+            result += ',';
+            result += extraFields;
+        }
+
+        result += ",\"path\":[";
+        appendJsonString(result, network.stopNames[startId]);
+        for (uint32_t edge : edges) {
+            result += ',';
+            appendJsonString(result, network.stopNames[network.edgeTargets[edge]]);
+        }
+
+        result += "],\"buses\":[";
+        for (size_t i = 0; i < edges.size(); i++) {
+            if (i > 0) result += ',';
+            appendJsonString(result, network.busNames[network.edgeBusIds[edges[i]]]);
+        }
+        result += "],";
+        appendSearchStatsJSON(result);
+        result += '}';
+
+        return result;
+    }
+};
+
+Graph busNetwork;
+
+// Staged edits are published together once this many have queued up or the
+// oldest has waited this long, whichever comes first
+const uint32_t DEFAULT_BATCH_MAX_EDITS = 1000;
+const uint32_t DEFAULT_BATCH_WINDOW_MS = 200;
+
+// Groups the edit endpoints' changes so a burst of /addstop and /addroute
+// calls costs one freeze and publication instead of one each. Edits go
+// straight into the staging area; a background thread publishes them when
+// the batch is full or its window closes, and flush() publishes right away
+// for callers that must read their own writes.
+class WriteBatcher {
+public:
+    ~WriteBatcher() {
+        stop();
+    }
+
+    void start(Graph& graph, uint32_t maxEdits, uint32_t windowMs) {
+        network = &graph;
+        batchMaxEdits = max(1u, maxEdits);
+        batchWindow = chrono::milliseconds(windowMs);
+        worker = thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    // Record one edit just staged on the graph
+    void noteEdit() {
+        lock_guard<mutex> lock(guard);
+        // Wake the publisher to start a new window, or early for a full batch
+        if (pendingEdits++ == 0) {
+            oldestEdit = chrono::steady_clock::now();
+            wakeUp.notify_all();
+        }
+        else if (pendingEdits >= batchMaxEdits) {
+            wakeUp.notify_all();
+        }
+    }
+
+    // Publish everything staged so far and return the version now visible
+    uint64_t flush() {
+        {
+            lock_guard<mutex> lock(guard);
+            pendingEdits = 0;
+        }
+        network->publish();
+        return network->snapshot()->version;
+    }
+
+    uint32_t pending() {
+        lock_guard<mutex> lock(guard);
+        return pendingEdits;
+    }
+
+private:
+    Graph* network = nullptr;
+    uint32_t batchMaxEdits = DEFAULT_BATCH_MAX_EDITS;
+    chrono::milliseconds batchWindow{ DEFAULT_BATCH_WINDOW_MS };
+
+    mutex guard;
+    condition_variable wakeUp;
+    uint32_t pendingEdits = 0;
+    chrono::steady_clock::time_point oldestEdit;
+    bool stopping = false;
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> lock(guard);
+        while (!stopping) {
+            if (pendingEdits == 0) {
+                wakeUp.wait(lock);
+                continue;
+            }
+            if (pendingEdits < batchMaxEdits &&
+                wakeUp.wait_until(lock, oldestEdit + batchWindow) == cv_status::no_timeout) {
+                continue;
+            }
+
+            uint32_t batch = pendingEdits;
+            pendingEdits = 0;
+            lock.unlock();
+            network->publish();
+            if (network->verbose) {
+                cout << "[*] Published " << batch << " edits as version " << network->snapshot()->version << endl;
+            }
+            lock.lock();
+        }
+    }
+};
+
+WriteBatcher writeBatcher;
+
+// Body formats /import understands; AUTO picks NDJSON when the first record
+// starts with '{' and CSV otherwise
+enum class ImportFormat { AUTO, CSV, NDJSON };
+
+struct ImportSummary {
+    uint64_t lines = 0;
+    uint64_t stops = 0;
+    uint64_t routes = 0;
+    uint64_t duplicateStops = 0;
+    uint64_t errors = 0;
+    uint64_t firstErrorLine = 0;
+    string firstError;
+};
+
+// Longest record /import accepts; anything longer is counted as a bad record
+// rather than buffered, so one endless line cannot grow the carry without bound
+const size_t IMPORT_MAX_LINE_BYTES = 64 << 10;
+
+// Streams a bulk load of stops and routes straight into the staging area.
+// Records are parsed in place as string_views over the request chunks (only
+// a line split across two chunks is copied) and numbers go through
+// from_chars, so nothing but the stop and bus names is allocated.
+//
+// CSV:    stop,<name>[,<lat>,<lon>]
+//         route,<from>,<to>,<distance>,<fare>,<bus>
+// NDJSON: {"type":"stop","name":...,"lat":...,"lon":...}
+//         {"type":"route","from":...,"to":...,"distance":...,"fare":...,"bus":...}
+//
+// Blank lines, '#' comments and a CSV header starting with "type" are
+// skipped; NDJSON may leave out "type" when the keys make it obvious.
+// The importer holds the edit lock for its whole lifetime, so publish only
+// after it has been destroyed.
+class NetworkImporter {
+public:
+    NetworkImporter(Graph& graph, ImportFormat format) : edits(graph), format(format) {}
+
+    void feed(const char* data, size_t length) {
+        const char* end = data + length;
+        if (!carry.empty() || skippingLine) {
+            const char* newline = (const char*)memchr(data, '\n', length);
+            if (newline == nullptr) {
+                appendCarry(data, length);
+                return;
+            }
+            appendCarry(data, newline - data);
+            finishCarry();
+            data = newline + 1;
+        }
+
+        while (data < end) {
+            const char* newline = (const char*)memchr(data, '\n', end - data);
+            if (newline == nullptr) {
+                appendCarry(data, end - data);
+                return;
+            }
+            if ((size_t)(newline - data) > IMPORT_MAX_LINE_BYTES) {
+                skipLine();
+            }
+            else {
+                parseLine(string_view(data, newline - data));
+            }
+            data = newline + 1;
+        }
+    }
+
+    // Parse a final line with no trailing newline and return the totals
+    const ImportSummary& finish() {
+        if (!carry.empty() || skippingLine) {
+            finishCarry();
+        }
+        return summary;
+    }
+
+private:
+    Graph::BulkEdit edits;
+    ImportFormat format;
+    ImportSummary summary;
+    string carry;
+    // The carried line passed IMPORT_MAX_LINE_BYTES; drop it up to its newline
+    bool skippingLine = false;
+
+    // Reused so staging a record only allocates inside the graph
+    string nameBuffer;
+    string toBuffer;
+    string busBuffer;
+
+    static string_view trim(string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) text.remove_suffix(1);
+        return text;
+    }
+
+    template<typename Number>
+    static bool parseNumber(string_view text, Number& value) {
+        text = trim(text);
+        if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return !text.empty() && result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+
+    // An empty or null coordinate means "unknown"
+    static bool parseCoordinate(string_view text, double& value) {
+        text = trim(text);
+        if (text.empty() || text == "null") {
+            value = NAN;
+            return true;
+        }
+        return parseNumber(text, value);
+    }
+
+    void fail(const char* message) {
+        if (summary.errors++ == 0) {
+            summary.firstErrorLine = summary.lines;
+            summary.firstError = message;
+        }
+    }
+
+    void skipLine() {
+        summary.lines++;
+        fail("line too long");
+    }
+
+    void appendCarry(const char* data, size_t length) {
+        if (skippingLine) return;
+        if (carry.size() + length > IMPORT_MAX_LINE_BYTES) {
+            skippingLine = true;
+            string().swap(carry);
+            return;
+        }
+        carry.append(data, length);
+    }
+
+    void finishCarry() {
+        if (skippingLine) {
+            skipLine();
+            skippingLine = false;
+        }
+        else {
+            parseLine(carry);
+        }
+        carry.clear();
+    }
+
+    void parseLine(string_view line) {
+        summary.lines++;
+        line = trim(line);
+        if (line.empty() || line.front() == '#') return;
+
+        if (format == ImportFormat::AUTO) {
+            format = line.front() == '{' ? ImportFormat::NDJSON : ImportFormat::CSV;
+        }
+        if (format == ImportFormat::NDJSON) {
+            parseJsonRecord(line);
+        }
+        else {
+            parseCsvRecord(line);
+        }
+    }
+
+    // Split off the next comma-separated field; a field wrapped in double
+    // quotes may contain commas (but not quotes). more says whether a comma
+    // followed it.
+    static bool nextField(string_view& line, string_view& field, bool& more) {
+        line = trim(line);
+        size_t end;
+        if (!line.empty() && line.front() == '"') {
+            size_t close = line.find('"', 1);
+            if (close == string_view::npos) return false;
+            field = line.substr(1, close - 1);
+            end = line.find(',', close + 1);
+        }
+        else {
+            end = line.find(',');
+            field = trim(line.substr(0, end));
+        }
+        more = end != string_view::npos;
+        line = more ? line.substr(end + 1) : string_view();
+        return true;
+    }
+
+    void parseCsvRecord(string_view line) {
+        string_view fields[6];
+        size_t fieldCount = 0;
+        bool more = true;
+        while (more) {
+            if (fieldCount == 6) return fail("too many fields");
+            if (!nextField(line, fields[fieldCount++], more)) return fail("unterminated quote");
+        }
+
+        if (fields[0] == "stop") {
+            double latitude = NAN;
+            double longitude = NAN;
+            if (fieldCount != 2 && fieldCount != 4) return fail("stop needs name[,lat,lon]");
+            if (fieldCount == 4 && (!parseCoordinate(fields[2], latitude) || !parseCoordinate(fields[3], longitude))) {
+                return fail("bad coordinate");
+            }
+            stageStop(fields[1], latitude, longitude);
+        }
+        else if (fields[0] == "route") {
+            double distance;
+            int fare;
+            if (fieldCount != 6) return fail("route needs from,to,distance,fare,bus");
+            if (!parseNumber(fields[3], distance)) return fail("bad distance");
+            if (!parseNumber(fields[4], fare)) return fail("bad fare");
+            stageRoute(fields[1], fields[2], distance, fare, fields[5]);
+        }
+        else if (fields[0] != "type") {
+            fail("unknown record type");
+        }
+    }
+
+    // Flat objects only: string values without escapes, or bare numbers
+    void parseJsonRecord(string_view line) {
+        string_view type, name, from, to, bus, latitudeText, longitudeText, distanceText, fareText;
+        size_t at = 1;
+        auto skipSpace = [&]() {
+            while (at < line.size() && (line[at] == ' ' || line[at] == '\t')) at++;
+        };
+        auto readString = [&](string_view& text) {
+            size_t close = line.find('"', at + 1);
+            if (close == string_view::npos) return false;
+            text = line.substr(at + 1, close - at - 1);
+            at = close + 1;
+            return text.find('\\') == string_view::npos;
+        };
+
+        if (line.front() != '{' || line.back() != '}') return fail("expected one JSON object per line");
+        skipSpace();
+        while (at < line.size() && line[at] != '}') {
+            string_view key, value;
+            if (line[at] != '"' || !readString(key)) return fail("bad JSON key");
+            skipSpace();
+            if (at >= line.size() || line[at++] != ':') return fail("expected ':'");
+            skipSpace();
+            if (at < line.size() && line[at] == '"') {
+                if (!readString(value)) return fail("bad JSON string");
+            }
+            else {
+                size_t end = line.find_first_of(",}", at);
+                if (end == string_view::npos) return fail("bad JSON value");
+                value = trim(line.substr(at, end - at));
+                at = end;
+            }
+            skipSpace();
+            if (at < line.size() && line[at] == ',') {
+                at++;
+                skipSpace();
+            }
+
+            if (key == "type") type = value;
+            else if (key == "name") name = value;
+            else if (key == "from") from = value;
+            else if (key == "to") to = value;
+            else if (key == "bus") bus = value;
+            else if (key == "lat") latitudeText = value;
+            else if (key == "lon") longitudeText = value;
+            else if (key == "distance") distanceText = value;
+            else if (key == "fare") fareText = value;
+        }
+
+        if (type.empty()) {
+            type = from.empty() ? "stop" : "route";
+        }
+        if (type == "stop") {
+            double latitude = NAN;
+            double longitude = NAN;
+            if (name.empty()) return fail("stop needs a name");
+            if (!parseCoordinate(latitudeText, latitude) || !parseCoordinate(longitudeText, longitude)) {
+                return fail("bad coordinate");
+            }
+            stageStop(name, latitude, longitude);
+        }
+        else if (type == "route") {
+            double distance;
+            int fare;
+            if (from.empty() || to.empty()) return fail("route needs from and to");
+            if (!parseNumber(distanceText, distance)) return fail("bad distance");
+            if (!parseNumber(fareText, fare)) return fail("bad fare");
+            stageRoute(from, to, distance, fare, bus);
+        }
+        else {
+            fail("unknown record type");
+        }
+    }
+
+    void stageStop(string_view name, double latitude, double longitude) {
+        if (name.empty()) return fail("stop needs a name");
+        nameBuffer.assign(name.data(), name.size());
+        if (edits.addStop(nameBuffer, latitude, longitude)) {
+            summary.stops++;
+        }
+        else {
+            summary.duplicateStops++;
+        }
+    }
+
+    void stageRoute(string_view from, string_view to, double distance, int fare, string_view bus) {
+        if (from.empty() || to.empty()) return fail("route needs from and to");
+        if (!isfinite(distance) || distance < 0 || fare < 0) return fail("distance and fare must be finite and not negative");
+        nameBuffer.assign(from.data(), from.size());
+        toBuffer.assign(to.data(), to.size());
+        busBuffer.assign(bus.data(), bus.size());
+        edits.addRoute(nameBuffer, toBuffer, distance, fare, busBuffer);
+        summary.routes++;
+    }
+};
+
+ImportFormat parseImportFormat(const string& format, const string& contentType) {
+    if (format == "csv") return ImportFormat::CSV;
+    if (format == "ndjson" || format == "jsonl") return ImportFormat::NDJSON;
+    if (contentType.find("csv") != string::npos) return ImportFormat::CSV;
+    if (contentType.find("ndjson") != string::npos || contentType.find("jsonl") != string::npos) return ImportFormat::NDJSON;
+    return ImportFormat::AUTO;
+}
+
+// Whole-file read-only view: memory-mapped where the platform allows it,
+// read into memory otherwise
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+#ifndef _WIN32
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return;
+        struct stat status;
+        if (fstat(descriptor, &status) == 0) {
+            opened = status.st_size == 0;
+            void* mapping = opened ? MAP_FAILED : mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, (size_t)status.st_size, MADV_SEQUENTIAL);
+                bytes = (const char*)mapping;
+                length = (size_t)status.st_size;
+                opened = mapped = true;
+            }
+        }
+        ::close(descriptor);
+#else
+        ifstream file(path, ios::binary);
+        if (!file) return;
+        buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+        opened = true;
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (mapped) munmap((void*)bytes, length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool opened = false;
+    bool mapped = false;
+#ifdef _WIN32
+    string buffer;
+#endif
+};
+
+// Split one CSV record into fields in place. Quoted fields lose their outer
+// quotes but keep any doubled "" inside; unquoteCsv() undoes those.
+void splitCsvLine(string_view line, vector<string_view>& fields) {
+    fields.clear();
+    size_t at = 0;
+    while (true) {
+        if (at < line.size() && line[at] == '"') {
+            size_t close = at + 1;
+            while (close < line.size() && (line[close] != '"' || (close + 1 < line.size() && line[close + 1] == '"'))) {
+                close += line[close] == '"' ? 2 : 1;
+            }
+            fields.push_back(line.substr(at + 1, close - at - 1));
+            at = line.find(',', close);
+        }
+        else {
+            size_t end = line.find(',', at);
+            fields.push_back(line.substr(at, end == string_view::npos ? string_view::npos : end - at));
+            at = end;
+        }
+        if (at == string_view::npos) return;
+        at++;
+    }
+}
+
+string unquoteCsv(string_view field) {
+    string text(field);
+    for (size_t quote = text.find("\"\""); quote != string::npos; quote = text.find("\"\"", quote + 1)) {
+        text.erase(quote, 1);
+    }
+    return text;
+}
+
+// Tables below this size are parsed on one thread
+const size_t CSV_PARALLEL_MIN_BYTES = 1 << 20;
+
+// One CSV file with a header row: column positions by name and the records
+// after it, all viewed in place in the mapped file
+class CsvTable {
+public:
+    explicit CsvTable(const string& path) : file(path) {
+        if (file.size() == 0) return;
+        body = file.data();
+        end = file.data() + file.size();
+        if (end - body >= 3 && memcmp(body, "\xEF\xBB\xBF", 3) == 0) body += 3;
+
+        const char* newline = (const char*)memchr(body, '\n', end - body);
+        const char* headerEnd = newline != nullptr ? newline : end;
+        string_view header(body, headerEnd - body);
+        if (!header.empty() && header.back() == '\r') header.remove_suffix(1);
+        splitCsvLine(header, columns);
+        for (string_view& column : columns) {
+            while (!column.empty() && column.back() == ' ') column.remove_suffix(1);
+            while (!column.empty() && column.front() == ' ') column.remove_prefix(1);
+        }
+        body = newline != nullptr ? newline + 1 : end;
+    }
+
+    bool isOpen() const { return file.isOpen(); }
+
+    // -1 when the file has no such column
+    int column(string_view name) const {
+        for (size_t i = 0; i < columns.size(); i++) {
+            if (columns[i] == name) return (int)i;
+        }
+        return -1;
+    }
+
+    static string_view field(const vector<string_view>& fields, int column) {
+        return column >= 0 && (size_t)column < fields.size() ? fields[column] : string_view();
+    }
+
+    // Hand every record to parseRow(fields, records) on all cores. The body
+    // is cut into one slice per thread at line boundaries, so a quoted field
+    // must not span lines, and the slices' records are joined in file order.
+    template<typename Record, typename RowParser>
+    vector<Record> parse(RowParser parseRow) const {
+        size_t bytes = end - body;
+        size_t sliceCount = bytes < CSV_PARALLEL_MIN_BYTES ? 1 : max(1u, thread::hardware_concurrency());
+        vector<const char*> cuts(1, body);
+        for (size_t slice = 1; slice < sliceCount; slice++) {
+            const char* cut = max(body + bytes * slice / sliceCount, cuts.back());
+            const char* newline = (const char*)memchr(cut, '\n', end - cut);
+            cuts.push_back(newline != nullptr ? newline + 1 : end);
+        }
+        cuts.push_back(end);
+
+        vector<vector<Record>> slices(sliceCount);
+        auto parseSlice = [&](size_t slice) {
+            vector<string_view> fields;
+            const char* line = cuts[slice];
+            while (line < cuts[slice + 1]) {
+                const char* newline = (const char*)memchr(line, '\n', cuts[slice + 1] - line);
+                const char* lineEnd = newline != nullptr ? newline : cuts[slice + 1];
+                string_view record(line, lineEnd - line);
+                if (!record.empty() && record.back() == '\r') record.remove_suffix(1);
+                if (!record.empty()) {
+                    splitCsvLine(record, fields);
+                    parseRow(fields, slices[slice]);
+                }
+                line = lineEnd + 1;
+            }
+        };
+
+        vector<thread> workers;
+        for (size_t slice = 1; slice < sliceCount; slice++) {
+            workers.emplace_back(parseSlice, slice);
+        }
+        parseSlice(0);
+        for (thread& worker : workers) {
+            worker.join();
+        }
+
+        vector<Record> records = move(slices[0]);
+        size_t total = 0;
+        for (const vector<Record>& slice : slices) {
+            total += slice.size();
+        }
+        records.reserve(total);
+        for (size_t slice = 1; slice < sliceCount; slice++) {
+            records.insert(records.end(), slices[slice].begin(), slices[slice].end());
+        }
+        return records;
+    }
+
+private:
+    MappedFile file;
+    vector<string_view> columns;
+    const char* body = nullptr;
+    const char* end = nullptr;
+};
+
+// GTFS "H:MM:SS" with hours past 24 for trips running after midnight; -1
+// when the field is empty or malformed
+int parseGtfsTime(string_view text) {
+    int parts[3];
+    const char* at = text.data();
+    const char* end = text.data() + text.size();
+    while (at < end && *at == ' ') at++;
+    for (int part = 0; part < 3; part++) {
+        auto result = from_chars(at, end, parts[part]);
+        if (result.ec != errc() || parts[part] < 0) return -1;
+        at = result.ptr;
+        if (part < 2 && (at == end || *at++ != ':')) return -1;
+    }
+    if (parts[1] > 59 || parts[2] > 59) return -1;
+    return parts[0] * 3600 + parts[1] * 60 + parts[2];
+}
+
+// Bus name on the static edges made from transfers.txt
+const char* const GTFS_TRANSFER_BUS = "Transfer";
+
+// Populate the graph and timetable from an unzipped GTFS feed: stops.txt,
+// routes.txt, trips.txt and stop_times.txt, plus transfers.txt if present.
+// Platforms are merged into their parent station and stops sharing a name
+// into one graph stop, since the graph names its stops. Every pair of
+// consecutive stops on a trip becomes a static route with the route's
+// short name as the bus, its great-circle length as the distance and no
+// fare (fares are not read); every trip with usable times is added to the
+// timetable. Nothing is published here.
+bool loadGtfsFeed(Graph& network, const string& directory) {
+    auto startTime = chrono::steady_clock::now();
+    string prefix = directory.empty() || directory.back() == '/' ? directory : directory + "/";
+    if (directory.size() >= 4 && directory.compare(directory.size() - 4, 4, ".zip") == 0) {
+        cout << "[!] Unzip the GTFS feed and pass its directory: " << directory << endl;
+        return false;
+    }
+
+    CsvTable stopsTable(prefix + "stops.txt");
+    CsvTable routesTable(prefix + "routes.txt");
+    CsvTable tripsTable(prefix + "trips.txt");
+    CsvTable stopTimesTable(prefix + "stop_times.txt");
+    CsvTable transfersTable(prefix + "transfers.txt");
+    if (!stopsTable.isOpen() || !routesTable.isOpen() || !tripsTable.isOpen() || !stopTimesTable.isOpen()) {
+        cout << "[!] " << directory << " needs stops.txt, routes.txt, trips.txt and stop_times.txt" << endl;
+        return false;
+    }
+
+    // Ids stay string_views into the mapped tables, which outlive the load
+    struct GtfsStop {
+        string_view id;
+        string_view name;
+        string_view parent;
+        double latitude;
+        double longitude;
+    };
+    int stopId = stopsTable.column("stop_id");
+    int stopName = stopsTable.column("stop_name");
+    int stopParent = stopsTable.column("parent_station");
+    int stopLatitude = stopsTable.column("stop_lat");
+    int stopLongitude = stopsTable.column("stop_lon");
+    vector<GtfsStop> stops = stopsTable.parse<GtfsStop>([&](const vector<string_view>& fields, vector<GtfsStop>& out) {
+        GtfsStop stop{ CsvTable::field(fields, stopId), CsvTable::field(fields, stopName), CsvTable::field(fields, stopParent), NAN, NAN };
+        string_view latitude = CsvTable::field(fields, stopLatitude);
+        string_view longitude = CsvTable::field(fields, stopLongitude);
+        from_chars(latitude.data(), latitude.data() + latitude.size(), stop.latitude);
+        from_chars(longitude.data(), longitude.data() + longitude.size(), stop.longitude);
+        if (stop.name.empty()) stop.name = stop.id;
+        out.push_back(stop);
+    });
+
+    unordered_map<string_view, uint32_t> stopIndex;
+    for (uint32_t stop = 0; stop < stops.size(); stop++) {
+        stopIndex.emplace(stops[stop].id, stop);
+    }
+
+    // Graph stops by name, stations first so platforms take their coordinates
+    vector<uint32_t> graphStopOf(stops.size());
+    vector<string> graphStopNames;
+    vector<double> graphLatitudes;
+    vector<double> graphLongitudes;
+    unordered_map<string, uint32_t> graphStopIndex;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t stop = 0; stop < stops.size(); stop++) {
+            auto parent = stops[stop].parent.empty() ? stopIndex.end() : stopIndex.find(stops[stop].parent);
+            if ((parent == stopIndex.end()) != (pass == 0)) continue;
+            const GtfsStop& station = parent == stopIndex.end() ? stops[stop] : stops[parent->second];
+            auto inserted = graphStopIndex.emplace(unquoteCsv(station.name), (uint32_t)graphStopNames.size());
+            if (inserted.second) {
+                graphStopNames.push_back(inserted.first->first);
+                graphLatitudes.push_back(station.latitude);
+                graphLongitudes.push_back(station.longitude);
+            }
+            graphStopOf[stop] = inserted.first->second;
+        }
+    }
+
+    int routeId = routesTable.column("route_id");
+    int routeShortName = routesTable.column("route_short_name");
+    int routeLongName = routesTable.column("route_long_name");
+    unordered_map<string_view, uint32_t> routeIndex;
+    vector<string> busNames;
+    for (const auto& route : routesTable.parse<pair<string_view, string_view>>([&](const vector<string_view>& fields, vector<pair<string_view, string_view>>& out) {
+        string_view name = CsvTable::field(fields, routeShortName);
+        if (name.empty()) name = CsvTable::field(fields, routeLongName);
+        if (name.empty()) name = CsvTable::field(fields, routeId);
+        out.emplace_back(CsvTable::field(fields, routeId), name);
+    })) {
+        if (routeIndex.emplace(route.first, (uint32_t)busNames.size()).second) {
+            busNames.push_back(unquoteCsv(route.second));
+        }
+    }
+
+    int tripId = tripsTable.column("trip_id");
+    int tripRoute = tripsTable.column("route_id");
+    unordered_map<string_view, uint32_t> tripIndex;
+    vector<uint32_t> tripRoutes;
+    for (const auto& trip : tripsTable.parse<pair<string_view, string_view>>([&](const vector<string_view>& fields, vector<pair<string_view, string_view>>& out) {
+        out.emplace_back(CsvTable::field(fields, tripId), CsvTable::field(fields, tripRoute));
+    })) {
+        auto route = routeIndex.find(trip.second);
+        if (route != routeIndex.end() && tripIndex.emplace(trip.first, (uint32_t)tripRoutes.size()).second) {
+            tripRoutes.push_back(route->second);
+        }
+    }
+
+    // The bulk of a feed: resolved to indices while parsing, on every core
+    struct GtfsStopTime {
+        uint32_t trip;
+        uint32_t sequence;
+        uint32_t stop;
+        int arrival;
+        int departure;
+    };
+    int timeTrip = stopTimesTable.column("trip_id");
+    int timeSequence = stopTimesTable.column("stop_sequence");
+    int timeStop = stopTimesTable.column("stop_id");
+    int timeArrival = stopTimesTable.column("arrival_time");
+    int timeDeparture = stopTimesTable.column("departure_time");
+    vector<GtfsStopTime> stopTimes = stopTimesTable.parse<GtfsStopTime>([&](const vector<string_view>& fields, vector<GtfsStopTime>& out) {
+        auto trip = tripIndex.find(CsvTable::field(fields, timeTrip));
+        auto stop = stopIndex.find(CsvTable::field(fields, timeStop));
+        if (trip == tripIndex.end() || stop == stopIndex.end()) return;
+        GtfsStopTime stopTime{ trip->second, 0, graphStopOf[stop->second],
+            parseGtfsTime(CsvTable::field(fields, timeArrival)), parseGtfsTime(CsvTable::field(fields, timeDeparture)) };
+        string_view sequence = CsvTable::field(fields, timeSequence);
+        from_chars(sequence.data(), sequence.data() + sequence.size(), stopTime.sequence);
+        out.push_back(stopTime);
+    });
+    auto byTripAndSequence = [](const GtfsStopTime& a, const GtfsStopTime& b) {
+        return a.trip != b.trip ? a.trip < b.trip : a.sequence < b.sequence;
+    };
+    if (!is_sorted(stopTimes.begin(), stopTimes.end(), byTripAndSequence)) {
+        sort(stopTimes.begin(), stopTimes.end(), byTripAndSequence);
+    }
+    double parseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
+    Graph::BulkEdit edits(network);
+    for (uint32_t stop = 0; stop < graphStopNames.size(); stop++) {
+        edits.addStop(graphStopNames[stop], graphLatitudes[stop], graphLongitudes[stop]);
+    }
+
+    // One static route per stop pair and bus, whichever direction it was seen in
+    unordered_map<uint64_t, vector<uint32_t>> linkedBuses;
+    auto addLink = [&](uint32_t from, uint32_t to, uint32_t bus, double distance, const string& busName) {
+        if (from == to) return;
+        vector<uint32_t>& buses = linkedBuses[(uint64_t)min(from, to) << 32 | max(from, to)];
+        if (find(buses.begin(), buses.end(), bus) != buses.end()) return;
+        buses.push_back(bus);
+        edits.addRoute(graphStopNames[from], graphStopNames[to], distance, 0, busName);
+    };
+    auto linkKm = [&](uint32_t from, uint32_t to) {
+        double km = greatCircleKm(graphLatitudes[from], graphLongitudes[from], graphLatitudes[to], graphLongitudes[to]);
+        return std::isnan(km) ? 0.0 : km;
+    };
+
+    uint64_t tripsAdded = 0;
+    uint64_t tripsSkipped = 0;
+    vector<string> tripStops;
+    vector<int> arrivals;
+    vector<int> departures;
+    for (size_t first = 0, last; first < stopTimes.size(); first = last) {
+        last = first + 1;
+        while (last < stopTimes.size() && stopTimes[last].trip == stopTimes[first].trip) last++;
+        uint32_t bus = tripRoutes[stopTimes[first].trip];
+
+        size_t length = last - first;
+        tripStops.resize(length);
+        arrivals.resize(length);
+        departures.resize(length);
+        for (size_t position = 0; position < length; position++) {
+            const GtfsStopTime& stopTime = stopTimes[first + position];
+            tripStops[position] = graphStopNames[stopTime.stop];
+            arrivals[position] = stopTime.arrival >= 0 ? stopTime.arrival : stopTime.departure;
+            departures[position] = stopTime.departure >= 0 ? stopTime.departure : stopTime.arrival;
+            if (position > 0) {
+                addLink(stopTimes[first + position - 1].stop, stopTime.stop, bus, linkKm(stopTimes[first + position - 1].stop, stopTime.stop), busNames[bus]);
+            }
+        }
+
+        // Stops without times are spread evenly between the timed ones around them
+        size_t timed = 0;
+        for (size_t position = 1; position < length && arrivals[0] >= 0; position++) {
+            if (arrivals[position] < 0) continue;
+            for (size_t between = timed + 1; between < position; between++) {
+                arrivals[between] = departures[between] = departures[timed] +
+                    (int)((long long)(arrivals[position] - departures[timed]) * (between - timed) / (position - timed));
+            }
+            timed = position;
+        }
+
+        if (timed + 1 == length && edits.addTrip(busNames[bus], tripStops, arrivals, departures)) {
+            tripsAdded++;
+        }
+        else {
+            tripsSkipped++;
+        }
+    }
+
+    uint64_t transfers = 0;
+    if (transfersTable.isOpen()) {
+        int transferFrom = transfersTable.column("from_stop_id");
+        int transferTo = transfersTable.column("to_stop_id");
+        int transferType = transfersTable.column("transfer_type");
+        int transferTime = transfersTable.column("min_transfer_time");
+        struct GtfsTransfer {
+            uint32_t from;
+            uint32_t to;
+            int seconds;
+        };
+        vector<GtfsTransfer> links = transfersTable.parse<GtfsTransfer>([&](const vector<string_view>& fields, vector<GtfsTransfer>& out) {
+            auto from = stopIndex.find(CsvTable::field(fields, transferFrom));
+            auto to = stopIndex.find(CsvTable::field(fields, transferTo));
+            if (from == stopIndex.end() || to == stopIndex.end() || CsvTable::field(fields, transferType) == "3") return;
+            GtfsTransfer transfer{ graphStopOf[from->second], graphStopOf[to->second], -1 };
+            string_view seconds = CsvTable::field(fields, transferTime);
+            from_chars(seconds.data(), seconds.data() + seconds.size(), transfer.seconds);
+            out.push_back(transfer);
+        });
+
+        // A transfer walks its minimum time, or the straight line when none is given
+        string transferBus = GTFS_TRANSFER_BUS;
+        for (const GtfsTransfer& transfer : links) {
+            double km = transfer.seconds >= 0 ? transfer.seconds / 3600.0 * WALKING_KMH : linkKm(transfer.from, transfer.to);
+            addLink(transfer.from, transfer.to, UINT32_MAX, km, transferBus);
+        }
+        transfers = links.size();
+    }
+
+    double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+    cout << "[*] GTFS feed " << directory << ": " << stops.size() << " stops as " << graphStopNames.size() << " graph stops, "
+        << busNames.size() << " routes, " << tripsAdded << " trips (" << tripsSkipped << " without usable times), "
+        << stopTimes.size() << " stop times, " << transfers << " transfers; parsed in " << parseMs << " ms, staged in "
+        << totalMs - parseMs << " ms" << endl;
+    return tripsAdded > 0 || !graphStopNames.empty();
+}
+
+// Network snapshot files: a header, then every array of a frozen CompactGraph
+// in a fixed order, each as a 64-bit element count followed by the elements in
+// memory order and padded to 8 bytes. The checksum covers everything after
+// the header; bump the format version whenever the field list changes.
+const uint32_t SNAPSHOT_FILE_MAGIC = 0x4E535254;
+const uint32_t SNAPSHOT_FORMAT_VERSION = 1;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t formatVersion;
+    uint64_t payloadBytes;
+    uint64_t checksum;
+};
+
+class SnapshotWriter {
+public:
+    template <class T>
+    void field(const T& value) {
+        static_assert(is_trivially_copyable<T>::value, "snapshot fields are raw memory");
+        append(&value, sizeof(T));
+    }
+
+    template <class T>
+    void field(const vector<T>& values) {
+        static_assert(is_trivially_copyable<T>::value, "snapshot arrays are raw memory");
+        uint64_t count = values.size();
+        append(&count, sizeof(count));
+        append(values.data(), values.size() * sizeof(T));
+    }
+
+    // Strings go as an offset table and one block of characters
+    void field(const vector<string>& values) {
+        vector<uint64_t> offsets(1, 0);
+        string characters;
+        for (const string& value : values) {
+            characters += value;
+            offsets.push_back(characters.size());
+        }
+        field(offsets);
+        uint64_t count = characters.size();
+        append(&count, sizeof(count));
+        append(characters.data(), characters.size());
+    }
+
+    bool save(const string& path) const {
+        SnapshotHeader header{ SNAPSHOT_FILE_MAGIC, SNAPSHOT_FORMAT_VERSION, payload.size(), fileChecksum(payload.data(), payload.size()) };
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write(payload.data(), payload.size());
+        return (bool)file;
+    }
+
+private:
+    string payload;
+
+    void append(const void* data, size_t bytes) {
+        payload.append((const char*)data, bytes);
+        payload.resize((payload.size() + 7) & ~(size_t)7, '\0');
+    }
+};
+
+// Reads a snapshot straight out of the mapped file: arrays are copied in one
+// block each, so nothing is parsed but the string tables
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const string& path) : file(path) {
+        SnapshotHeader header;
+        if (!file.isOpen() || file.size() < sizeof(header)) return;
+        memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != SNAPSHOT_FILE_MAGIC || header.formatVersion != SNAPSHOT_FORMAT_VERSION ||
+            header.payloadBytes != file.size() - sizeof(header)) {
+            return;
+        }
+        at = file.data() + sizeof(header);
+        end = file.data() + file.size();
+        valid = fileChecksum(at, end - at) == header.checksum;
+    }
+
+    // False once anything was wrong: bad header or checksum, or a read past
+    // the end. Complete also means every byte was read.
+    bool complete() const {
+        return valid && at == end;
+    }
+
+    template <class T>
+    void field(T& value) {
+        take(&value, sizeof(T));
+    }
+
+    template <class T>
+    void field(vector<T>& values) {
+        uint64_t count = 0;
+        take(&count, sizeof(count));
+        if (!valid || count > (uint64_t)(end - at) / max<size_t>(1, sizeof(T))) {
+            valid = false;
+            return;
+        }
+        values.resize((size_t)count);
+        take(values.data(), values.size() * sizeof(T));
+    }
+
+    void field(vector<string>& values) {
+        vector<uint64_t> offsets;
+        field(offsets);
+        uint64_t count = 0;
+        take(&count, sizeof(count));
+        if (!valid || offsets.empty() || offsets.back() != count || count > (uint64_t)(end - at)) {
+            valid = false;
+            return;
+        }
+        values.clear();
+        values.reserve(offsets.size() - 1);
+        for (size_t value = 0; value + 1 < offsets.size() && valid; value++) {
+            valid = offsets[value] <= offsets[value + 1];
+            values.emplace_back(at + offsets[value], valid ? offsets[value + 1] - offsets[value] : 0);
+        }
+        skip(count);
+    }
+
+private:
+    MappedFile file;
+    const char* at = nullptr;
+    const char* end = nullptr;
+    bool valid = false;
+
+    void take(void* data, size_t bytes) {
+        if (valid && bytes <= (size_t)(end - at)) {
+            memcpy(data, at, bytes);
+        }
+        skip(bytes);
+    }
+
+    void skip(size_t bytes) {
+        size_t padded = (bytes + 7) & ~(size_t)7;
+        if (!valid || padded > (size_t)(end - at)) {
+            valid = false;
+            return;
+        }
+        at += padded;
+    }
+};
+
+// The field lists shared by saving and loading, so the two cannot drift
+// apart; the structures are const when saving and filled in when loading
+template <class Archive, class Hierarchy>
+void snapshotHierarchy(Archive& archive, Hierarchy& hierarchy) {
+    archive.field(hierarchy.rank);
+    archive.field(hierarchy.arcs);
+    archive.field(hierarchy.upwardOffsets);
+    archive.field(hierarchy.upwardTargets);
+    archive.field(hierarchy.upwardCosts);
+    archive.field(hierarchy.upwardArcIds);
+    archive.field(hierarchy.downwardOffsets);
+    archive.field(hierarchy.downwardTargets);
+    archive.field(hierarchy.downwardCosts);
+    archive.field(hierarchy.downwardArcIds);
+    archive.field(hierarchy.shortcutCount);
+    archive.field(hierarchy.preprocessingMs);
+}
+
+template <class Archive, class Labels>
+void snapshotLabels(Archive& archive, Labels& labels) {
+    archive.field(labels.forwardOffsets);
+    archive.field(labels.forwardHubs);
+    archive.field(labels.forwardCosts);
+    archive.field(labels.forwardNextStops);
+    archive.field(labels.forwardArcs);
+    archive.field(labels.backwardOffsets);
+    archive.field(labels.backwardHubs);
+    archive.field(labels.backwardCosts);
+    archive.field(labels.backwardNextStops);
+    archive.field(labels.backwardArcs);
+    archive.field(labels.preprocessingMs);
+}
+
+template <class Archive, class Network>
+void snapshotNetwork(Archive& archive, Network& network) {
+    archive.field(network.stopNames);
+    archive.field(network.busNames);
+    archive.field(network.edgeOffsets);
+    archive.field(network.edgeTargets);
+    archive.field(network.edgeDistances);
+    archive.field(network.edgeFares);
+    archive.field(network.edgeBusIds);
+    archive.field(network.edgeSources);
+    archive.field(network.reverseOffsets);
+    archive.field(network.reverseEdges);
+    archive.field(network.stateStops);
+    archive.field(network.stateBuses);
+    archive.field(network.edgeStates);
+    archive.field(network.stopLatitudes);
+    archive.field(network.stopLongitudes);
+    archive.field(network.stopPositions);
+    archive.field(network.minKmPerGreatCircleKm);
+
+    archive.field(network.landmarks.landmarks);
+    archive.field(network.landmarks.distanceFrom);
+    archive.field(network.landmarks.distanceTo);
+    archive.field(network.landmarks.fareFrom);
+    archive.field(network.landmarks.fareTo);
+    archive.field(network.landmarks.preprocessingMs);
+
+    archive.field(network.customizable.rank);
+    archive.field(network.customizable.upwardOffsets);
+    archive.field(network.customizable.upwardTargets);
+    archive.field(network.customizable.downwardOffsets);
+    archive.field(network.customizable.downwardSources);
+    archive.field(network.customizable.downwardArcIds);
+    archive.field(network.customizable.edgeArcs);
+    archive.field(network.customizable.levelOffsets);
+    archive.field(network.customizable.levelStops);
+    archive.field(network.customizable.preprocessingMs);
+
+    auto& timetable = network.timetable;
+    archive.field(timetable.routeStopOffsets);
+    archive.field(timetable.routeStops);
+    archive.field(timetable.routeBusIds);
+    archive.field(timetable.routeTripOffsets);
+    archive.field(timetable.routeTimeOffsets);
+    archive.field(timetable.arrivals);
+    archive.field(timetable.departures);
+    archive.field(timetable.stopRouteOffsets);
+    archive.field(timetable.stopRoutes);
+    archive.field(timetable.stopRoutePositions);
+    archive.field(timetable.footpathOffsets);
+    archive.field(timetable.footpathEdges);
+    archive.field(timetable.footpathSeconds);
+    archive.field(timetable.connectionDepartures);
+    archive.field(timetable.connectionArrivals);
+    archive.field(timetable.connectionFromStops);
+    archive.field(timetable.connectionToStops);
+    archive.field(timetable.connectionTrips);
+    archive.field(timetable.connectionPositions);
+    archive.field(timetable.tripRoutes);
+}
+
+// Write a frozen network with all of its preprocessing; false on I/O failure
+bool saveNetworkSnapshot(const CompactGraph& network, const string& path) {
+    SnapshotWriter writer;
+    snapshotNetwork(writer, network);
+    snapshotHierarchy(writer, *network.distanceHierarchy);
+    snapshotHierarchy(writer, *network.fareHierarchy);
+
+    uint32_t labelSets = (network.distanceLabels ? 1 : 0) | (network.fareLabels ? 2 : 0);
+    writer.field(labelSets);
+    if (network.distanceLabels) snapshotLabels(writer, *network.distanceLabels);
+    if (network.fareLabels) snapshotLabels(writer, *network.fareLabels);
+    return writer.save(path);
+}
+
+// The checksum only catches damage in transit; a snapshot from a faulty
+// writer or edited by hand passes it. The checks below make sure every id a
+// search follows is in range and every CSR index fits its arrays, so such a
+// file is refused instead of read out of bounds.
+
+// Ranks read from disk number the stops 0 .. stopCount - 1 once each
+inline bool validRanks(const vector<uint32_t>& rank, uint32_t stopCount) {
+    if (rank.size() != stopCount) {
+        return false;
+    }
+    vector<char> taken(stopCount, 0);
+    for (uint32_t value : rank) {
+        if (value >= stopCount || taken[value]) return false;
+        taken[value] = 1;
+    }
+    return true;
+}
+
+template <class Weight>
+bool validHierarchy(const ContractionHierarchy<Weight>& hierarchy, uint32_t stopCount, uint32_t edgeCount) {
+    if (!validRanks(hierarchy.rank, stopCount) || hierarchy.arcs.size() >= NO_EDGE) {
+        return false;
+    }
+
+    uint32_t arcCount = (uint32_t)hierarchy.arcs.size();
+    bool childrenFirst = true;
+    for (uint32_t arcId = 0; arcId < arcCount; arcId++) {
+        const HierarchyArc& arc = hierarchy.arcs[arcId];
+        if (arc.edge != NO_EDGE) {
+            if (arc.edge >= edgeCount || arc.firstChild != NO_EDGE || arc.secondChild != NO_EDGE) return false;
+        }
+        else if (arc.firstChild != NO_EDGE || arc.secondChild != NO_EDGE) {
+            if (arc.firstChild >= arcCount || arc.secondChild >= arcCount ||
+                !usableArc(hierarchy, arc.firstChild) || !usableArc(hierarchy, arc.secondChild)) {
+                return false;
+            }
+            childrenFirst = childrenFirst && arc.firstChild < arcId && arc.secondChild < arcId;
+        }
+    }
+
+    // Unpacking only ends if shortcuts never contain themselves. Contraction
+    // adds every shortcut after its children, which proves it; a customized
+    // hierarchy numbers arcs by slot, so peel off arcs no remaining shortcut
+    // refers to instead, and any left over lie on a cycle.
+    if (!childrenFirst) {
+        vector<uint32_t> parents(arcCount, 0);
+        for (const HierarchyArc& arc : hierarchy.arcs) {
+            if (arc.edge == NO_EDGE && arc.firstChild != NO_EDGE) {
+                parents[arc.firstChild]++;
+                parents[arc.secondChild]++;
+            }
+        }
+        vector<uint32_t> ready;
+        for (uint32_t arc = 0; arc < arcCount; arc++) {
+            if (parents[arc] == 0) ready.push_back(arc);
+        }
+        uint32_t peeled = 0;
+        while (!ready.empty()) {
+            const HierarchyArc& arc = hierarchy.arcs[ready.back()];
+            ready.pop_back();
+            peeled++;
+            if (arc.edge == NO_EDGE && arc.firstChild != NO_EDGE) {
+                if (--parents[arc.firstChild] == 0) ready.push_back(arc.firstChild);
+                if (--parents[arc.secondChild] == 0) ready.push_back(arc.secondChild);
+            }
+        }
+        if (peeled != arcCount) {
+            return false;
+        }
+    }
+
+    auto validSide = [&](const vector<uint32_t>& offsets, const vector<uint32_t>& targets,
+        const vector<Weight>& costs, const vector<uint32_t>& arcIds) {
+        if (!validOffsets(offsets, stopCount, targets.size()) || costs.size() != targets.size() ||
+            arcIds.size() != targets.size() || !validIds(targets, stopCount) || !validIds(arcIds, arcCount)) {
+            return false;
+        }
+        for (uint32_t arc : arcIds) {
+            if (!usableArc(hierarchy, arc)) return false;
+        }
+        return true;
+    };
+    return validSide(hierarchy.upwardOffsets, hierarchy.upwardTargets, hierarchy.upwardCosts, hierarchy.upwardArcIds) &&
+        validSide(hierarchy.downwardOffsets, hierarchy.downwardTargets, hierarchy.downwardCosts, hierarchy.downwardArcIds);
+}
+
+inline bool validCustomizable(const CustomizableHierarchy& hierarchy, uint32_t stopCount, uint32_t edgeCount) {
+    uint32_t arcCount = hierarchy.arcCount();
+    return validRanks(hierarchy.rank, stopCount) &&
+        validOffsets(hierarchy.upwardOffsets, stopCount, arcCount) && validIds(hierarchy.upwardTargets, stopCount) &&
+        validOffsets(hierarchy.downwardOffsets, stopCount, arcCount) && hierarchy.downwardSources.size() == arcCount &&
+        hierarchy.downwardArcIds.size() == arcCount && validIds(hierarchy.downwardSources, stopCount) &&
+        validIds(hierarchy.downwardArcIds, arcCount) &&
+        hierarchy.edgeArcs.size() == edgeCount && validIds(hierarchy.edgeArcs, arcCount, true) &&
+        !hierarchy.levelOffsets.empty() && validOffsets(hierarchy.levelOffsets, hierarchy.levelOffsets.size() - 1, stopCount) &&
+        hierarchy.levelStops.size() == stopCount && validIds(hierarchy.levelStops, stopCount);
+}
+
+inline bool validTimetable(const Timetable& timetable, uint32_t stopCount, uint32_t edgeCount, size_t busCount) {
+    uint32_t routeCount = timetable.routeCount();
+    if (!validOffsets(timetable.routeStopOffsets, routeCount, timetable.routeStops.size()) ||
+        !validIds(timetable.routeStops, stopCount) || !validIds(timetable.routeBusIds, busCount) ||
+        timetable.routeTripOffsets.size() != (size_t)routeCount + 1 || timetable.routeTripOffsets.front() != 0 ||
+        timetable.routeTimeOffsets.size() != routeCount || timetable.departures.size() != timetable.arrivals.size()) {
+        return false;
+    }
+
+    // Each route's stop times follow the previous route's, trip by trip
+    uint64_t times = 0;
+    for (uint32_t route = 0; route < routeCount; route++) {
+        if (timetable.routeTripOffsets[route] > timetable.routeTripOffsets[route + 1] ||
+            timetable.routeTimeOffsets[route] != times) {
+            return false;
+        }
+        times += (uint64_t)(timetable.routeTripOffsets[route + 1] - timetable.routeTripOffsets[route]) * timetable.routeLength(route);
+    }
+    if (times != timetable.arrivals.size()) {
+        return false;
+    }
+
+    if (!validOffsets(timetable.stopRouteOffsets, stopCount, timetable.stopRoutes.size()) ||
+        timetable.stopRoutes.size() != timetable.routeStops.size() ||
+        timetable.stopRoutePositions.size() != timetable.stopRoutes.size()) {
+        return false;
+    }
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        for (uint32_t slot = timetable.stopRouteOffsets[stop]; slot < timetable.stopRouteOffsets[stop + 1]; slot++) {
+            uint32_t route = timetable.stopRoutes[slot];
+            uint32_t position = timetable.stopRoutePositions[slot];
+            if (route >= routeCount || position >= timetable.routeLength(route) ||
+                timetable.routeStops[timetable.routeStopOffsets[route] + position] != stop) {
+                return false;
+            }
+        }
+    }
+
+    if (!validOffsets(timetable.footpathOffsets, stopCount, timetable.footpathEdges.size()) ||
+        timetable.footpathSeconds.size() != timetable.footpathEdges.size() || !validIds(timetable.footpathEdges, edgeCount)) {
+        return false;
+    }
+
+    uint32_t tripCount = timetable.tripCount();
+    if (timetable.tripRoutes.size() != tripCount) {
+        return false;
+    }
+    for (uint32_t route = 0; route < routeCount; route++) {
+        for (uint32_t trip = timetable.routeTripOffsets[route]; trip < timetable.routeTripOffsets[route + 1]; trip++) {
+            if (timetable.tripRoutes[trip] != route) return false;
+        }
+    }
+
+    size_t connectionCount = timetable.connectionDepartures.size();
+    if (timetable.connectionArrivals.size() != connectionCount || timetable.connectionFromStops.size() != connectionCount ||
+        timetable.connectionToStops.size() != connectionCount || timetable.connectionTrips.size() != connectionCount ||
+        timetable.connectionPositions.size() != connectionCount ||
+        !validIds(timetable.connectionFromStops, stopCount) || !validIds(timetable.connectionToStops, stopCount) ||
+        !validIds(timetable.connectionTrips, tripCount)) {
+        return false;
+    }
+    for (size_t connection = 0; connection < connectionCount; connection++) {
+        uint32_t route = timetable.tripRoutes[timetable.connectionTrips[connection]];
+        if ((uint64_t)timetable.connectionPositions[connection] + 1 >= timetable.routeLength(route)) return false;
+    }
+    return true;
+}
+
+// The CSR arrays, transfer states, coordinates and landmark tables
+inline bool validNetworkArrays(const CompactGraph& network) {
+    uint32_t stopCount = network.stopCount();
+    uint32_t edgeCount = network.edgeCount();
+    size_t busCount = network.busNames.size();
+    if (network.edgeTargets.size() >= NO_EDGE || !validOffsets(network.edgeOffsets, stopCount, edgeCount) ||
+        network.edgeDistances.size() != edgeCount || network.edgeFares.size() != edgeCount ||
+        network.edgeBusIds.size() != edgeCount || network.edgeSources.size() != edgeCount ||
+        !validIds(network.edgeTargets, stopCount) || !validIds(network.edgeBusIds, busCount)) {
+        return false;
+    }
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        for (uint32_t edge : network.neighbors(stop)) {
+            if (network.edgeSources[edge] != stop) return false;
+        }
+    }
+
+    if (!validOffsets(network.reverseOffsets, stopCount, edgeCount) || network.reverseEdges.size() != edgeCount ||
+        !validIds(network.reverseEdges, edgeCount)) {
+        return false;
+    }
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        for (uint32_t edge : network.incoming(stop)) {
+            if (network.edgeTargets[edge] != stop) return false;
+        }
+    }
+
+    if (network.stateBuses.size() != network.stateStops.size() || !validIds(network.stateStops, stopCount) ||
+        !validIds(network.stateBuses, busCount) || network.edgeStates.size() != edgeCount ||
+        !validIds(network.edgeStates, network.stateCount())) {
+        return false;
+    }
+
+    if (network.stopLatitudes.size() != stopCount || network.stopLongitudes.size() != stopCount ||
+        network.stopPositions.size() != 3 * (size_t)stopCount || !(network.minKmPerGreatCircleKm >= 0)) {
+        return false;
+    }
+
+    const LandmarkIndex& landmarks = network.landmarks;
+    size_t tableSize = (size_t)stopCount * landmarks.landmarks.size();
+    return landmarks.landmarks.size() <= min(MAX_LANDMARKS, stopCount) && validIds(landmarks.landmarks, stopCount) &&
+        landmarks.distanceFrom.size() == tableSize && landmarks.distanceTo.size() == tableSize &&
+        landmarks.fareFrom.size() == tableSize && landmarks.fareTo.size() == tableSize;
+}
+
+// A network saved by saveNetworkSnapshot, ready to publish, or null when the
+// file is missing, damaged, inconsistent or was written by another format
+// version
+shared_ptr<CompactGraph> loadNetworkSnapshot(const string& path) {
+    SnapshotReader reader(path);
+    auto network = make_shared<CompactGraph>();
+    snapshotNetwork(reader, *network);
+    auto distanceHierarchy = make_shared<ContractionHierarchy<double>>();
+    auto fareHierarchy = make_shared<ContractionHierarchy<int>>();
+    snapshotHierarchy(reader, *distanceHierarchy);
+    snapshotHierarchy(reader, *fareHierarchy);
+
+    uint32_t labelSets = 0;
+    reader.field(labelSets);
+    shared_ptr<HubLabels<double>> distanceLabels;
+    shared_ptr<HubLabels<int>> fareLabels;
+    if (labelSets & 1) {
+        distanceLabels = make_shared<HubLabels<double>>();
+        snapshotLabels(reader, *distanceLabels);
+    }
+    if (labelSets & 2) {
+        fareLabels = make_shared<HubLabels<int>>();
+        snapshotLabels(reader, *fareLabels);
+    }
+
+    if (!reader.complete() || !validNetworkArrays(*network)) {
+        return nullptr;
+    }
+    uint32_t stopCount = network->stopCount();
+    uint32_t edgeCount = network->edgeCount();
+    if (!validCustomizable(network->customizable, stopCount, edgeCount) ||
+        !validTimetable(network->timetable, stopCount, edgeCount, network->busNames.size()) ||
+        !validHierarchy(*distanceHierarchy, stopCount, edgeCount) || !validHierarchy(*fareHierarchy, stopCount, edgeCount) ||
+        fareHierarchy->rank != network->customizable.rank ||
+        fareHierarchy->arcs.size() != 2 * (size_t)network->customizable.arcCount() ||
+        (distanceLabels && !validHubLabels(*distanceLabels, *distanceHierarchy)) ||
+        (fareLabels && !validHubLabels(*fareLabels, *fareHierarchy))) {
+        return nullptr;
+    }
+
+    network->stopIds.reserve(stopCount);
+    for (uint32_t stop = 0; stop < stopCount; stop++) {
+        network->stopIds.emplace(network->stopNames[stop], stop);
+    }
+    network->distanceHierarchy = distanceHierarchy;
+    network->fareHierarchy = fareHierarchy;
+    if (distanceLabels) {
+        distanceLabels->hierarchy = distanceHierarchy;
+        distanceLabels->fingerprint = hierarchyFingerprint(*distanceHierarchy);
+        distanceLabels->loadedFromDisk = true;
+        network->distanceLabels = distanceLabels;
+    }
+    if (fareLabels) {
+        fareLabels->hierarchy = fareHierarchy;
+        fareLabels->fingerprint = hierarchyFingerprint(*fareHierarchy);
+        fareLabels->loadedFromDisk = true;
+        network->fareLabels = fareLabels;
+    }
+    return network;
+}
+
+// Networks at least this large route dijkstra/cheapest through the bidirectional
+// search, which settles about a third fewer stops on the benchmark grids
+const uint32_t BIDIRECTIONAL_MIN_STOPS = 1000;
+
+// Extra /route parameters that only some algorithms read
+struct RouteOptions {
+    uint32_t frontLimit = DEFAULT_PARETO_FRONT;
+    double frontSlack = DEFAULT_PARETO_SLACK;
+    double transferPenaltyKm = DEFAULT_TRANSFER_PENALTY_KM;
+    // Seconds after midnight for timetable searches; -1 means now
+    int departSeconds = -1;
+    int windowMinutes = DEFAULT_PROFILE_WINDOW_MINUTES;
+    uint32_t pathCount = DEFAULT_KSHORTEST_PATHS;
+    // Limits for dfs/bfs; 0 means unlimited
+    uint32_t maxDepth = DEFAULT_TRAVERSAL_DEPTH;
+    uint32_t maxStops = DEFAULT_TRAVERSAL_BUDGET;
+};
+
+// Dispatch an algo= value from /route to the matching search
+string findRoute(Graph& network, const string& algorithm, const string& fromStop, const string& toStop,
+    const RouteOptions& options = RouteOptions()) {
+    bool largeNetwork = network.snapshot()->stopCount() >= BIDIRECTIONAL_MIN_STOPS;
+
+    if (algorithm == "cheapest") {
+        if (network.hasFareLabels()) return network.findCheapestPathHubLabels(fromStop, toStop);
+        return largeNetwork ? network.findCheapestPathBidirectional(fromStop, toStop) : network.findCheapestPath(fromStop, toStop);
+    }
+    else if (algorithm == "cheapest-forward") {
+        return network.findCheapestPath(fromStop, toStop);
+    }
+    else if (algorithm == "bidi") {
+        return network.findShortestPathBidirectional(fromStop, toStop);
+    }
+    else if (algorithm == "bidi-cheapest") {
+        return network.findCheapestPathBidirectional(fromStop, toStop);
+    }
+    else if (algorithm == "astar") {
+        return network.findShortestPathAStar(fromStop, toStop);
+    }
+    else if (algorithm == "ch") {
+        return network.findShortestPathCH(fromStop, toStop);
+    }
+    else if (algorithm == "ch-cheapest") {
+        return network.findCheapestPathCH(fromStop, toStop);
+    }
+    else if (algorithm == "hub") {
+        return network.findShortestPathHubLabels(fromStop, toStop);
+    }
+    else if (algorithm == "hub-cheapest") {
+        return network.findCheapestPathHubLabels(fromStop, toStop);
+    }
+    else if (algorithm == "alt") {
+        return network.findShortestPathALT(fromStop, toStop);
+    }
+    else if (algorithm == "alt-cheapest") {
+        return network.findCheapestPathALT(fromStop, toStop);
+    }
+    else if (algorithm == "pareto") {
+        return network.findParetoRoutes(fromStop, toStop, options.frontLimit, options.frontSlack);
+    }
+    else if (algorithm == "transfers") {
+        return network.findTransferAwarePath(fromStop, toStop, options.transferPenaltyKm);
+    }
+    else if (algorithm == "min-transfers") {
+        return network.findMinTransfersPath(fromStop, toStop);
+    }
+    else if (algorithm == "kshortest") {
+        return network.findKShortestPaths(fromStop, toStop, options.pathCount);
+    }
+    else if (algorithm == "kshortest-cheapest") {
+        return network.findKCheapestPaths(fromStop, toStop, options.pathCount);
+    }
+    else if (algorithm == "alternatives") {
+        return network.findAlternativeRoutes(fromStop, toStop, options.pathCount);
+    }
+    else if (algorithm == "alternatives-cheapest") {
+        return network.findCheapAlternativeRoutes(fromStop, toStop, options.pathCount);
+    }
+    else if (algorithm == "raptor") {
+        return network.findRaptorPath(fromStop, toStop, options.departSeconds >= 0 ? options.departSeconds : currentClockTime());
+    }
+    else if (algorithm == "csa") {
+        return network.findConnectionScanPath(fromStop, toStop, options.departSeconds >= 0 ? options.departSeconds : currentClockTime());
     }
+    else if (algorithm == "csa-profile") {
+        return network.findDepartureProfile(fromStop, toStop, options.departSeconds >= 0 ? options.departSeconds : currentClockTime(),
+            options.windowMinutes);
+    }
+    else if (algorithm == "balanced") {
+        return network.findBalancedPath(fromStop, toStop);
+    }
+    else if (algorithm == "fewest") {
+        return network.findFewestStopsPath(fromStop, toStop);
+    }
+    else if (algorithm == "bfs") {
+        return network.findFewestHopsPath(fromStop, toStop, options.maxDepth, options.maxStops);
+    }
+    else if (algorithm == "dfs") {
+        return network.findAnyPath(fromStop, toStop, options.maxDepth, options.maxStops);
+    }
+    else if (algorithm == "dijkstra-forward") {
+        return network.findShortestPath(fromStop, toStop);
+    }
+    else {
+        if (network.hasDistanceLabels()) return network.findShortestPathHubLabels(fromStop, toStop);
+        return largeNetwork ? network.findShortestPathBidirectional(fromStop, toStop) : network.findShortestPath(fromStop, toStop);
+    }
+}
 
-    void addRoute(string from, string to, double distance, int fare, string busName) {
-        Edge forwardEdge;
-        forwardEdge.to = to;
-        forwardEdge.distance = distance;
-        forwardEdge.fare = fare;
-        forwardEdge.bus = busName;
-
-        Edge reverseEdge;
-        reverseEdge.to = from;
-        reverseEdge.distance = distance;
-        reverseEdge.fare = fare;
-        reverseEdge.bus = busName;
+string getCurrentTimestamp() {
+    time_t now = time(0);
+    tm* ltm = localtime(&now);
+    stringstream ss;
+    ss << put_time(ltm, "%Y-%m-%d %H:%M:%S");
+    return ss.str();
+}
 
-        adjacencyList[from].push_back(forwardEdge);
-        adjacencyList[to].push_back(reverseEdge);
+// Load comprehensive sample data
+void loadSampleNetwork(Graph& network) {
+    network.addStop("Central Station");
+    network.addStop("City Mall");
+    network.addStop("University Campus");
+    network.addStop("General Hospital");
+    network.addStop("International Airport");
+    network.addStop("Seaside Beach");
+    network.addStop("City Park");
+    network.addStop("Sports Stadium");
+    network.addStop("Tech Valley");
+    network.addStop("Old Town Square");
+    network.addStop("Financial District");
+    network.addStop("Railway Terminal");
 
-        cout << "[+] Added route: " << from << " <-> " << to;
-        cout << " (" << distance << " km, Rs." << fare << ", " << busName << ")" << endl;
+    if (network.verbose) {
+        cout << endl;
+        cout << "[*] Loading route connections..." << endl;
+        cout << "------------------------------------------------------------" << endl;
     }
 
-    string findShortestPath(string startStop, string endStop) {
-        cout << "\n[SHORTEST DISTANCE] Finding optimal route..." << endl;
-        cout << "   From: " << startStop << endl;
-        cout << "   To:   " << endStop << endl;
+    // Main routes
+    network.addRoute("Central Station", "City Mall", 2.5, 15, "Metro Express 1");
+    network.addRoute("Central Station", "City Park", 1.8, 10, "Local Bus 2");
+    network.addRoute("Central Station", "International Airport", 18.0, 60, "Airport Express");
+    network.addRoute("Central Station", "Railway Terminal", 3.2, 20, "Metro Line 3");
 
-        priority_queue<
-            pair<double, string>,
-            vector<pair<double, string>>,
-            greater<pair<double, string>>
-        > priorityQueue;
+    network.addRoute("City Mall", "University Campus", 3.2, 18, "Campus Shuttle");
+    network.addRoute("City Mall", "Sports Stadium", 4.1, 15, "City Loop 4");
+    network.addRoute("City Mall", "Financial District", 2.8, 22, "Business Express");
 
-        unordered_map<string, double> shortestDistance;
-        double INFINITY_VALUE = 999999.0;
+    network.addRoute("University Campus", "General Hospital", 2.3, 12, "Health Link 5");
+    network.addRoute("University Campus", "Tech Valley", 3.5, 16, "Tech Corridor");
 
-        for (const string& stopName : stopNames) {
-            shortestDistance[stopName] = INFINITY_VALUE;
-        }
+    network.addRoute("General Hospital", "International Airport", 12.5, 35, "Airport Link 6");
+    network.addRoute("General Hospital", "Old Town Square", 4.2, 14, "Heritage Route");
 
-        shortestDistance[startStop] = 0;
-        unordered_map<string, string> previousStop;
-        unordered_map<string, Edge> previousEdge;
+    network.addRoute("City Park", "Sports Stadium", 2.1, 10, "Green Line 7");
+    network.addRoute("City Park", "Seaside Beach", 5.5, 18, "Coastal Route 8");
+    network.addRoute("City Park", "Old Town Square", 3.8, 15, "Park Connector");
 
-        priorityQueue.push(make_pair(0.0, startStop));
+    network.addRoute("Sports Stadium", "International Airport", 8.2, 28, "Stadium Express 9");
+    network.addRoute("Sports Stadium", "Tech Valley", 5.8, 20, "Innovation Line");
 
-        while (!priorityQueue.empty()) {
-            pair<double, string> current = priorityQueue.top();
-            priorityQueue.pop();
+    network.addRoute("Seaside Beach", "International Airport", 4.5, 16, "Beach Shuttle 10");
+    network.addRoute("Seaside Beach", "Old Town Square", 6.2, 22, "Scenic Route");
 
-            string currentStop = current.second;
-            double currentDistance = current.first;
+    network.addRoute("Tech Valley", "Financial District", 4.3, 25, "Business Tech Link");
+    network.addRoute("Tech Valley", "Railway Terminal", 6.5, 24, "Tech Express");
 
-            if (currentDistance > shortestDistance[currentStop]) {
-                continue;
-            }
+    network.addRoute("Financial District", "Railway Terminal", 2.9, 18, "Downtown Connector");
+    network.addRoute("Financial District", "Old Town Square", 3.5, 16, "Heritage Business");
 
-            vector<Edge> routes = adjacencyList[currentStop];
+    network.addRoute("Old Town Square", "Railway Terminal", 4.8, 20, "Historical Line");
+}
 
-            for (const Edge& route : routes) {
-                string neighborStop = route.to;
-                double distanceThroughCurrent = shortestDistance[currentStop] + route.distance;
+const int SAMPLE_FIRST_DEPARTURE = 6 * 3600;
+const int SAMPLE_LAST_DEPARTURE = 22 * 3600;
+const int SAMPLE_HEADWAY_SECONDS = 15 * 60;
+const double SAMPLE_BUS_KMH = 25.0;
+const int SAMPLE_DWELL_SECONDS = 30;
 
-                if (distanceThroughCurrent < shortestDistance[neighborStop]) {
-                    shortestDistance[neighborStop] = distanceThroughCurrent;
-                    previousStop[neighborStop] = currentStop;
-                    previousEdge[neighborStop] = route;
-                    priorityQueue.push(make_pair(distanceThroughCurrent, neighborStop));
-                }
-            }
+// Give every bus whose static edges form a simple line a timetable: trips in
+// both directions from 06:00 to 22:00 every 15 minutes, running at 25 km/h
+// with a 30 second stop at each intermediate stop. Buses whose edges branch
+// or loop are left without trips.
+void loadSampleTimetable(Graph& network) {
+    map<string, unordered_map<string, vector<pair<string, double>>>> lines;
+    for (const auto& pair : network.adjacencyList) {
+        for (const Edge& edge : pair.second) {
+            lines[edge.bus][pair.first].push_back(make_pair(edge.to, edge.distance));
         }
-
-        return buildResultJSON(startStop, endStop, previousStop, previousEdge, "Shortest Distance (Dijkstra's Algorithm)");
     }
 
-    string findCheapestPath(string startStop, string endStop) {
-        cout << "\n[LOWEST FARE] Finding most economical route..." << endl;
-        cout << "   From: " << startStop << endl;
-        cout << "   To:   " << endStop << endl;
-
-        priority_queue<
-            pair<int, string>,
-            vector<pair<int, string>>,
-            greater<pair<int, string>>
-        > priorityQueue;
-
-        unordered_map<string, int> cheapestFare;
-        int INFINITY_VALUE = 999999;
-
-        for (const string& stopName : stopNames) {
-            cheapestFare[stopName] = INFINITY_VALUE;
+    for (const auto& line : lines) {
+        const auto& stops = line.second;
+        string end;
+        bool simple = true;
+        for (const auto& stop : stops) {
+            simple = simple && stop.second.size() <= 2;
+            if (stop.second.size() == 1 && (end.empty() || stop.first < end)) end = stop.first;
+        }
+        if (!simple || end.empty()) {
+            continue;
         }
 
-        cheapestFare[startStop] = 0;
-        unordered_map<string, string> previousStop;
-        unordered_map<string, Edge> previousEdge;
-
-        priorityQueue.push(make_pair(0, startStop));
-
-        while (!priorityQueue.empty()) {
-            pair<int, string> current = priorityQueue.top();
-            priorityQueue.pop();
-
-            string currentStop = current.second;
-            int currentFare = current.first;
-
-            if (currentFare > cheapestFare[currentStop]) {
-                continue;
+        vector<string> sequence(1, end);
+        vector<double> distances;
+        string previous;
+        while (sequence.size() < stops.size()) {
+            const pair<string, double>* hop = nullptr;
+            for (const auto& candidate : stops.at(sequence.back())) {
+                if (candidate.first != previous) hop = &candidate;
             }
+            if (hop == nullptr) break;
+            previous = sequence.back();
+            sequence.push_back(hop->first);
+            distances.push_back(hop->second);
+        }
+        if (sequence.size() != stops.size()) {
+            continue;
+        }
 
-            vector<Edge> routes = adjacencyList[currentStop];
-
-            for (const Edge& route : routes) {
-                string neighborStop = route.to;
-                int fareThroughCurrent = cheapestFare[currentStop] + route.fare;
+        for (int direction = 0; direction < 2; direction++) {
+            vector<string> tripStops(sequence);
+            vector<double> hops(distances);
+            if (direction == 1) {
+                reverse(tripStops.begin(), tripStops.end());
+                reverse(hops.begin(), hops.end());
+            }
 
-                if (fareThroughCurrent < cheapestFare[neighborStop]) {
-                    cheapestFare[neighborStop] = fareThroughCurrent;
-                    previousStop[neighborStop] = currentStop;
-                    previousEdge[neighborStop] = route;
-                    priorityQueue.push(make_pair(fareThroughCurrent, neighborStop));
+            for (int start = SAMPLE_FIRST_DEPARTURE; start <= SAMPLE_LAST_DEPARTURE; start += SAMPLE_HEADWAY_SECONDS) {
+                vector<int> arrivals(1, start);
+                vector<int> departures(1, start);
+                for (double distance : hops) {
+                    int arrival = departures.back() + (int)ceil(distance / SAMPLE_BUS_KMH * 3600);
+                    arrivals.push_back(arrival);
+                    departures.push_back(arrival + SAMPLE_DWELL_SECONDS);
                 }
+                departures.back() = arrivals.back();
+                network.addTrip(line.first, tripStops, arrivals, departures);
             }
         }
-
-        return buildResultJSON(startStop, endStop, previousStop, previousEdge, "Lowest Fare (Dijkstra's Algorithm - Fare Optimized)");
     }
+}
 
-    string findAnyPath(string startStop, string endStop) {
-        cout << "\n[QUICK PATHFINDING] Finding available route..." << endl;
-        cout << "   From: " << startStop << endl;
-        cout << "   To:   " << endStop << endl;
-
-        unordered_set<string> visitedStops;
-        vector<string> currentPath;
-        vector<Edge> edgesUsed;
-
-        bool pathFound = dfsRecursive(startStop, endStop, visitedStops, currentPath, edgesUsed);
-
-        if (!pathFound) {
-            cout << "   Result: No path found!" << endl;
-            return "{\"found\":false}";
-        }
-
-        double totalDistance = 0;
-        int totalFare = 0;
-
-        for (const Edge& edge : edgesUsed) {
-            totalDistance += edge.distance;
-            totalFare += edge.fare;
-        }
-
-        cout << "   Result: Found path with " << currentPath.size() << " stops!" << endl;
-
-        string result = "{\"found\":true,";
-        result += "\"algorithm\":\"Quick Pathfinding (Depth-First Search)\",";
-        result += "\"distance\":" + to_string(totalDistance) + ",";
-        result += "\"fare\":" + to_string(totalFare) + ",";
-        result += "\"stops\":" + to_string(currentPath.size()) + ",";
+// Build a rows x cols grid of stops with deterministic pseudo-random weights,
+// used by --bench to stand in for a metro-scale network
+void loadGridNetwork(Graph& network, int rows, int cols) {
+    uint32_t seed = 12345;
+    auto nextRandom = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
 
-        result += "\"path\":[";
-        for (size_t i = 0; i < currentPath.size(); i++) {
-            if (i > 0) result += ",";
-            result += "\"" + currentPath[i] + "\"";
-        }
-        result += "],";
+    // Stops sit 0.5 km apart and edges are 0.5-0.69 km, a realistic detour factor
+    double baseLatitude = 24.8607;
+    double baseLongitude = 67.0011;
+    double latitudeStep = 0.5 / (EARTH_RADIUS_KM * DEGREES_TO_RADIANS);
+    double longitudeStep = latitudeStep / cos(baseLatitude * DEGREES_TO_RADIANS);
 
-        result += "\"buses\":[";
-        for (size_t i = 0; i < edgesUsed.size(); i++) {
-            if (i > 0) result += ",";
-            result += "\"" + edgesUsed[i].bus + "\"";
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            network.addStop("Grid " + to_string(row) + "-" + to_string(col),
+                baseLatitude + row * latitudeStep, baseLongitude + col * longitudeStep);
         }
-        result += "]}";
-
-        return result;
     }
 
-    // Get all unique bus numbers
-    vector<string> getAllBuses() {
-        unordered_set<string> busSet;
-        for (const auto& pair : adjacencyList) {
-            for (const Edge& edge : pair.second) {
-                busSet.insert(edge.bus);
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            string stopName = "Grid " + to_string(row) + "-" + to_string(col);
+            if (col + 1 < cols) {
+                network.addRoute(stopName, "Grid " + to_string(row) + "-" + to_string(col + 1),
+                    0.5 + nextRandom() % 20 / 100.0, 5 + nextRandom() % 20, "Row Bus " + to_string(row));
+            }
+            if (row + 1 < rows) {
+                network.addRoute(stopName, "Grid " + to_string(row + 1) + "-" + to_string(col),
+                    0.5 + nextRandom() % 20 / 100.0, 5 + nextRandom() % 20, "Column Bus " + to_string(col));
             }
         }
-        return vector<string>(busSet.begin(), busSet.end());
     }
+}
 
-    // Get network statistics
-    string getStatistics() {
-        int totalRoutes = 0;
-        double totalDistance = 0;
-        int totalFare = 0;
-        unordered_set<string> uniqueBuses;
+// Time every algorithm over the same random queries and report heap allocations
+// per query. Usage: --bench [gridSize] [queries] [algo,algo,...]
+// A grid size of 0 benchmarks the built-in sample network.
+int runBenchmark(int argc, char* argv[], size_t hubLabelBudgetBytes) {
+    int gridSize = argc > 0 ? atoi(argv[0]) : 0;
+    int queryCount = argc > 1 ? atoi(argv[1]) : 1000;
+    string algorithmList = argc > 2 ? argv[2] : "dijkstra,cheapest,dfs";
 
-        for (const auto& pair : adjacencyList) {
-            for (const Edge& edge : pair.second) {
-                totalRoutes++;
-                totalDistance += edge.distance;
-                totalFare += edge.fare;
-                uniqueBuses.insert(edge.bus);
-            }
-        }
+    Graph network;
+    network.verbose = false;
+    network.hubLabelBudgetBytes = hubLabelBudgetBytes;
 
-        totalRoutes /= 2; // Each route is counted twice
-        totalDistance /= 2;
-        totalFare /= 2;
+    if (gridSize > 0) {
+        loadGridNetwork(network, gridSize, gridSize);
+    }
+    else {
+        loadSampleNetwork(network);
+    }
+    loadSampleTimetable(network);
 
-        double avgDistance = totalRoutes > 0 ? totalDistance / totalRoutes : 0;
-        double avgFare = totalRoutes > 0 ? (double)totalFare / totalRoutes : 0;
+    Graph::Snapshot pinned = network.snapshot();
+    const CompactGraph& compact = *pinned;
+    cout << "[*] Benchmark network: " << compact.stopCount() << " stops, "
+        << compact.edgeCount() << " directed edges, " << queryCount << " queries" << endl;
+    cout << "[*] ALT preprocessing: " << compact.landmarks.landmarks.size() << " landmarks in "
+        << compact.landmarks.preprocessingMs << " ms, " << compact.landmarks.memoryBytes() / 1024.0 << " KB" << endl;
+    auto distanceHierarchy = compact.distanceHierarchy;
+    auto fareHierarchy = compact.fareHierarchy;
+    cout << "[*] CH preprocessing: distance " << distanceHierarchy->shortcutCount << " shortcuts in "
+        << distanceHierarchy->preprocessingMs << " ms (" << distanceHierarchy->memoryBytes() / 1024.0 << " KB)" << endl;
+    cout << "[*] CCH preprocessing: " << compact.customizable.arcCount() << " arcs ordered in "
+        << compact.customizable.preprocessingMs << " ms (" << compact.customizable.memoryBytes() / 1024.0
+        << " KB), fare customized in " << fareHierarchy->preprocessingMs << " ms with " << fareHierarchy->shortcutCount
+        << " shortcuts (" << fareHierarchy->memoryBytes() / 1024.0 << " KB)" << endl;
+    auto distanceLabels = compact.distanceLabels;
+    auto fareLabels = compact.fareLabels;
+    auto describeLabels = [](const auto& labels) {
+        if (!labels) return string("disabled or over budget");
+        stringstream description;
+        description << labels->entryCount() << " entries in " << labels->preprocessingMs << " ms ("
+            << labels->memoryBytes() / 1024.0 << " KB)";
+        return description.str();
+    };
+    cout << "[*] Hub labels: distance " << describeLabels(distanceLabels) << ", fare " << describeLabels(fareLabels) << endl;
+    cout << "[*] Timetable: " << compact.timetable.routeCount() << " routes, " << compact.timetable.tripCount() << " trips, "
+        << compact.timetable.arrivals.size() << " stop times, " << compact.timetable.connectionDepartures.size() << " connections, "
+        << compact.timetable.footpathEdges.size() << " footpaths ("
+        << compact.timetable.memoryBytes() / 1024.0 << " KB)" << endl;
 
-        string result = "{";
-        result += "\"stops\":" + to_string(stopNames.size()) + ",";
-        result += "\"routes\":" + to_string(totalRoutes) + ",";
-        result += "\"buses\":" + to_string(uniqueBuses.size()) + ",";
-        result += "\"totalDistance\":" + to_string(totalDistance) + ",";
-        result += "\"avgDistance\":" + to_string(avgDistance) + ",";
-        result += "\"avgFare\":" + to_string(avgFare) + "}";
+    // Timetable searches all leave at 08:00 so runs are comparable
+    RouteOptions options;
+    options.departSeconds = 8 * 3600;
 
-        return result;
+    uint32_t seed = 2024;
+    vector<pair<string, string>> queries;
+    for (int i = 0; i < queryCount; i++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t from = (seed >> 8) % compact.stopCount();
+        seed = seed * 1103515245u + 12345u;
+        uint32_t to = (seed >> 8) % compact.stopCount();
+        queries.push_back(make_pair(compact.stopNames[from], compact.stopNames[to]));
     }
 
-    // Search stops by name
-    string searchStops(string query) {
-        vector<string> results;
-        string lowerQuery = query;
-        transform(lowerQuery.begin(), lowerQuery.end(), lowerQuery.begin(), ::tolower);
+    stringstream algorithms(algorithmList);
+    string algorithm;
+    while (getline(algorithms, algorithm, ',')) {
+        size_t resultBytes = 0;
+        uint64_t nodesSettled = 0;
+        uint64_t edgesRelaxed = 0;
+        uint64_t allocationsBefore = heapAllocationCount.load();
+        auto startTime = chrono::steady_clock::now();
 
-        for (const string& stop : stopNames) {
-            string lowerStop = stop;
-            transform(lowerStop.begin(), lowerStop.end(), lowerStop.begin(), ::tolower);
-            if (lowerStop.find(lowerQuery) != string::npos) {
-                results.push_back(stop);
-            }
+        for (const auto& query : queries) {
+            resultBytes += findRoute(network, algorithm, query.first, query.second, options).size();
+            nodesSettled += searchStats.nodesSettled;
+            edgesRelaxed += searchStats.edgesRelaxed;
         }
 
-        string result = "[";
-        for (size_t i = 0; i < results.size(); i++) {
-            if (i > 0) result += ",";
-            result += "\"" + results[i] + "\"";
-        }
-        result += "]";
+        auto elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - startTime).count();
+        uint64_t allocations = heapAllocationCount.load() - allocationsBefore;
 
-        return result;
+        cout << "   " << left << setw(18) << algorithm << right
+            << fixed << setprecision(2) << setw(12) << elapsed / queryCount << " us/query";
+        if (COUNTING_ALLOCATIONS) {
+            cout << setw(12) << (double)allocations / queryCount << " allocs/query";
+        }
+        cout << setw(12) << (double)nodesSettled / queryCount << " settled"
+            << setw(12) << (double)edgesRelaxed / queryCount << " relaxed"
+            << "   (" << resultBytes << " bytes of JSON)" << endl;
+        cout.unsetf(ios::fixed);
     }
 
-private:
-    bool dfsRecursive(
-        string currentStop,
-        string endStop,
-        unordered_set<string>& visitedStops,
-        vector<string>& path,
-        vector<Edge>& edges
-    ) {
-        visitedStops.insert(currentStop);
-        path.push_back(currentStop);
-
-        if (currentStop == endStop) {
-            return true;
-        }
+    return 0;
+}
 
-        vector<Edge> routes = adjacencyList[currentStop];
+// Regression queries for behaviour that once went wrong. Usage: --self-check;
+// exits non-zero when any of them fails.
+int runSelfCheck() {
+    int failures = 0;
+    auto expect = [&failures](bool passed, const string& name) {
+        cout << (passed ? "   [ok]   " : "   [FAIL] ") << name << endl;
+        if (!passed) failures++;
+    };
 
-        for (const Edge& route : routes) {
-            string neighborStop = route.to;
+    // A -> B three ways: short but dear with a change, cheap with a change,
+    // and one bus all the way that is neither shortest nor cheapest
+    {
+        Graph network;
+        network.verbose = false;
+        for (const char* stop : { "A", "B", "X", "Y", "Z" }) {
+            network.addStop(stop);
+        }
+        network.addRoute("A", "X", 5, 50, "Short 1");
+        network.addRoute("X", "B", 5, 50, "Short 2");
+        network.addRoute("A", "Y", 10, 5, "Cheap 1");
+        network.addRoute("Y", "B", 10, 5, "Cheap 2");
+        network.addRoute("A", "Z", 12.5, 25, "Direct");
+        network.addRoute("Z", "B", 12.5, 25, "Direct");
 
-            if (visitedStops.find(neighborStop) == visitedStops.end()) {
-                edges.push_back(route);
+        RouteOptions options;
+        options.frontSlack = 0;
+        string front = findRoute(network, "pareto", "A", "B", options);
+        expect(front.find("\"distance\":25.000000,\"fare\":50,\"stops\":3,\"transfers\":0,") != string::npos,
+            "pareto keeps the zero-transfer journey");
+        expect(front.find("\"distance\":10.000000,\"fare\":100,\"stops\":3,\"transfers\":1,") != string::npos &&
+            front.find("limitReached") == string::npos, "pareto reports each journey's transfers");
+    }
 
-                if (dfsRecursive(neighborStop, endStop, visitedStops, path, edges)) {
-                    return true;
-                }
+    // A depth-limited DFS can first reach a stop on a long branch; a shorter
+    // branch through that stop must still find the two-edge routes bfs finds
+    {
+        Graph network;
+        network.verbose = false;
+        loadSampleNetwork(network);
 
-                edges.pop_back();
-            }
+        RouteOptions options;
+        options.maxDepth = 2;
+        bool allFound = true;
+        for (auto pair : { make_pair("Seaside Beach", "Financial District"), make_pair("City Park", "General Hospital") }) {
+            string route = findRoute(network, "dfs", pair.first, pair.second, options);
+            allFound = allFound && route.find("\"found\":true") != string::npos;
         }
+        expect(allFound, "dfs with depth=2 finds routes bfs finds");
+    }
 
-        path.pop_back();
-        return false;
+    cout << "[*] Self-check: " << (failures == 0 ? "all passed" : to_string(failures) + " failed") << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Called by the edit endpoints once their change is staged: it joins the
+// current batch, or with sync=1 is published before the reply so the caller
+// reads its own write
+void finishEdit(const httplib::Request& req) {
+    writeBatcher.noteEdit();
+    if (req.get_param_value("sync") == "1") {
+        writeBatcher.flush();
     }
+}
 
-    string buildResultJSON(
-        string startStop,
-        string endStop,
-        unordered_map<string, string>& previousStop,
-        unordered_map<string, Edge>& previousEdge,
-        string algorithmName
-    ) {
-        if (startStop == endStop) {
-            string result = "{\"found\":true,";
-            result += "\"algorithm\":\"" + algorithmName + "\",";
-            result += "\"distance\":0,";
-            result += "\"fare\":0,";
-            result += "\"stops\":1,";
-            result += "\"path\":[\"" + startStop + "\"],";
-            result += "\"buses\":[]}";
-            return result;
+int main(int argc, char* argv[]) {
+    // --hub-labels-mb N caps the hub label memory (0 disables them);
+    // --hub-labels-file PATH caches them on disk between runs;
+    // --batch-size N and --batch-window MS bound how long edits wait to be published;
+    // --gtfs DIR loads an unzipped GTFS feed instead of the sample network;
+    // --snapshot-in PATH starts from a saved network (building it as usual when
+    // the file is unusable) and --snapshot-out PATH saves the network at startup
+    uint32_t batchMaxEdits = DEFAULT_BATCH_MAX_EDITS;
+    uint32_t batchWindowMs = DEFAULT_BATCH_WINDOW_MS;
+    string gtfsDirectory;
+    string snapshotIn;
+    string snapshotOut;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--hub-labels-mb" && i + 1 < argc) {
+            busNetwork.hubLabelBudgetBytes = (size_t)atoll(argv[++i]) << 20;
         }
-
-        if (previousStop.find(endStop) == previousStop.end()) {
-            cout << "   Result: No path found!" << endl;
-            return "{\"found\":false}";
+        else if (option == "--hub-labels-file" && i + 1 < argc) {
+            busNetwork.hubLabelPath = argv[++i];
         }
-
-        vector<string> path;
-        vector<Edge> edges;
-        string current = endStop;
-
-        while (current != startStop) {
-            path.insert(path.begin(), current);
-            edges.insert(edges.begin(), previousEdge[current]);
-            current = previousStop[current];
+        else if (option == "--batch-size" && i + 1 < argc) {
+            batchMaxEdits = (uint32_t)max(1, atoi(argv[++i]));
         }
-
-        path.insert(path.begin(), startStop);
-
-        double totalDistance = 0;
-        int totalFare = 0;
-
-        for (const Edge& edge : edges) {
-            totalDistance += edge.distance;
-            totalFare += edge.fare;
+        else if (option == "--batch-window" && i + 1 < argc) {
+            batchWindowMs = (uint32_t)max(0, atoi(argv[++i]));
         }
-
-        cout << "   Result: Found path with " << path.size() << " stops, ";
-        cout << totalDistance << " km, Rs." << totalFare << endl;
-
-        string result = "{\"found\":true,";
-        result += "\"algorithm\":\"" + algorithmName + "\",";
-        result += "\"distance\":" + to_string(totalDistance) + ",";
-        result += "\"fare\":" + to_string(totalFare) + ",";
-        result += "\"stops\":" + to_string(path.size()) + ",";
-
-        result += "\"path\":[";
-        for (size_t i = 0; i < path.size(); i++) {
-            if (i > 0) result += ",";
-            result += "\"" + path[i] + "\"";
+        else if (option == "--gtfs" && i + 1 < argc) {
+            gtfsDirectory = argv[++i];
         }
-        result += "],";
-
-        result += "\"buses\":[";
-        for (size_t i = 0; i < edges.size(); i++) {
-            if (i > 0) result += ",";
-            result += "\"" + edges[i].bus + "\"";
+        else if (option == "--snapshot-in" && i + 1 < argc) {
+            snapshotIn = argv[++i];
+        }
+        else if (option == "--snapshot-out" && i + 1 < argc) {
+            snapshotOut = argv[++i];
+        }
+        else if (option == "--self-check") {
+            return runSelfCheck();
+        }
+        else if (option == "--bench") {
+            return runBenchmark(argc - i - 1, argv + i + 1, busNetwork.hubLabelBudgetBytes);
         }
-        result += "]}";
-
-        return result;
     }
-};
-
-Graph busNetwork;
-
-string getCurrentTimestamp() {
-    time_t now = time(0);
-    tm* ltm = localtime(&now);
-    stringstream ss;
-    ss << put_time(ltm, "%Y-%m-%d %H:%M:%S");
-    return ss.str();
-}
 
-int main() {
     cout << endl;
     cout << "============================================================" << endl;
     cout << "                                                            " << endl;
@@ -408,57 +7617,50 @@ int main() {
     cout << "[*] Initializing transit network..." << endl;
     cout << "------------------------------------------------------------" << endl;
 
-    // Load comprehensive sample data
-    busNetwork.addStop("Central Station");
-    busNetwork.addStop("City Mall");
-    busNetwork.addStop("University Campus");
-    busNetwork.addStop("General Hospital");
-    busNetwork.addStop("International Airport");
-    busNetwork.addStop("Seaside Beach");
-    busNetwork.addStop("City Park");
-    busNetwork.addStop("Sports Stadium");
-    busNetwork.addStop("Tech Valley");
-    busNetwork.addStop("Old Town Square");
-    busNetwork.addStop("Financial District");
-    busNetwork.addStop("Railway Terminal");
-
-    cout << endl;
-    cout << "[*] Loading route connections..." << endl;
-    cout << "------------------------------------------------------------" << endl;
-
-    // Main routes
-    busNetwork.addRoute("Central Station", "City Mall", 2.5, 15, "Metro Express 1");
-    busNetwork.addRoute("Central Station", "City Park", 1.8, 10, "Local Bus 2");
-    busNetwork.addRoute("Central Station", "International Airport", 18.0, 60, "Airport Express");
-    busNetwork.addRoute("Central Station", "Railway Terminal", 3.2, 20, "Metro Line 3");
-
-    busNetwork.addRoute("City Mall", "University Campus", 3.2, 18, "Campus Shuttle");
-    busNetwork.addRoute("City Mall", "Sports Stadium", 4.1, 15, "City Loop 4");
-    busNetwork.addRoute("City Mall", "Financial District", 2.8, 22, "Business Express");
-
-    busNetwork.addRoute("University Campus", "General Hospital", 2.3, 12, "Health Link 5");
-    busNetwork.addRoute("University Campus", "Tech Valley", 3.5, 16, "Tech Corridor");
-
-    busNetwork.addRoute("General Hospital", "International Airport", 12.5, 35, "Airport Link 6");
-    busNetwork.addRoute("General Hospital", "Old Town Square", 4.2, 14, "Heritage Route");
-
-    busNetwork.addRoute("City Park", "Sports Stadium", 2.1, 10, "Green Line 7");
-    busNetwork.addRoute("City Park", "Seaside Beach", 5.5, 18, "Coastal Route 8");
-    busNetwork.addRoute("City Park", "Old Town Square", 3.8, 15, "Park Connector");
-
-    busNetwork.addRoute("Sports Stadium", "International Airport", 8.2, 28, "Stadium Express 9");
-    busNetwork.addRoute("Sports Stadium", "Tech Valley", 5.8, 20, "Innovation Line");
-
-    busNetwork.addRoute("Seaside Beach", "International Airport", 4.5, 16, "Beach Shuttle 10");
-    busNetwork.addRoute("Seaside Beach", "Old Town Square", 6.2, 22, "Scenic Route");
-
-    busNetwork.addRoute("Tech Valley", "Financial District", 4.3, 25, "Business Tech Link");
-    busNetwork.addRoute("Tech Valley", "Railway Terminal", 6.5, 24, "Tech Express");
+    shared_ptr<CompactGraph> saved;
+    if (!snapshotIn.empty()) {
+        auto startTime = chrono::steady_clock::now();
+        saved = loadNetworkSnapshot(snapshotIn);
+        if (saved) {
+            cout << "[*] Loaded snapshot " << snapshotIn << ": " << saved->stopCount() << " stops, " << saved->edgeCount()
+                << " directed edges, " << saved->timetable.tripCount() << " trips in "
+                << chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count() << " ms" << endl;
+        }
+        else {
+            cout << "[!] Snapshot " << snapshotIn << " is missing, damaged or from another version; building the network" << endl;
+        }
+    }
 
-    busNetwork.addRoute("Financial District", "Railway Terminal", 2.9, 18, "Downtown Connector");
-    busNetwork.addRoute("Financial District", "Old Town Square", 3.5, 16, "Heritage Business");
+    if (saved) {
+        busNetwork.publishSnapshot(saved);
+    }
+    else if (!gtfsDirectory.empty()) {
+        if (!loadGtfsFeed(busNetwork, gtfsDirectory)) {
+            return 1;
+        }
+    }
+    else {
+        loadSampleNetwork(busNetwork);
+        busNetwork.verbose = false;
+        loadSampleTimetable(busNetwork);
+        busNetwork.verbose = true;
+        cout << "[*] Sample timetable: " << busNetwork.tripPatterns.size() << " trip patterns, every "
+            << SAMPLE_HEADWAY_SECONDS / 60 << " minutes from " << formatClockTime(SAMPLE_FIRST_DEPARTURE) << endl;
+    }
 
-    busNetwork.addRoute("Old Town Square", "Railway Terminal", 4.8, 20, "Historical Line");
+    // Publish now so the CSR, landmark and hierarchy preprocessing happen before the first query
+    busNetwork.publish();
+    if (!snapshotOut.empty()) {
+        auto startTime = chrono::steady_clock::now();
+        if (saveNetworkSnapshot(*busNetwork.snapshot(), snapshotOut)) {
+            cout << "[*] Saved snapshot " << snapshotOut << " in "
+                << chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count() << " ms" << endl;
+        }
+        else {
+            cout << "[!] Could not save snapshot to " << snapshotOut << endl;
+        }
+    }
+    writeBatcher.start(busNetwork, batchMaxEdits, batchWindowMs);
 
     cout << endl;
     cout << "============================================================" << endl;
@@ -499,10 +7701,12 @@ int main() {
     server.Get("/stops", [](const httplib::Request& req, httplib::Response& res) {
         cout << "\n[API] GET /stops - " << getCurrentTimestamp() << endl;
 
+        Graph::Snapshot pinned = busNetwork.snapshot();
+        const CompactGraph& network = *pinned;
         string jsonResult = "[";
-        for (size_t i = 0; i < busNetwork.stopNames.size(); i++) {
-            if (i > 0) jsonResult += ",";
-            jsonResult += "\"" + busNetwork.stopNames[i] + "\"";
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            if (stop > 0) jsonResult += ",";
+            jsonResult += "\"" + network.stopNames[stop] + "\"";
         }
         jsonResult += "]";
 
@@ -513,23 +7717,23 @@ int main() {
     server.Get("/graph", [](const httplib::Request& req, httplib::Response& res) {
         cout << "\n[API] GET /graph - " << getCurrentTimestamp() << endl;
 
+        Graph::Snapshot pinned = busNetwork.snapshot();
+        const CompactGraph& network = *pinned;
         string jsonResult = "{";
-        bool isFirstStop = true;
 
-        for (const auto& pair : busNetwork.adjacencyList) {
-            if (!isFirstStop) jsonResult += ",";
-            isFirstStop = false;
+        for (uint32_t stop = 0; stop < network.stopCount(); stop++) {
+            if (stop > 0) jsonResult += ",";
 
-            jsonResult += "\"" + pair.first + "\":[";
+            jsonResult += "\"" + network.stopNames[stop] + "\":[";
 
-            for (size_t i = 0; i < pair.second.size(); i++) {
-                if (i > 0) jsonResult += ",";
+            for (uint32_t edge : network.neighbors(stop)) {
+                if (edge > network.edgeOffsets[stop]) jsonResult += ",";
 
                 jsonResult += "{";
-                jsonResult += "\"to\":\"" + pair.second[i].to + "\",";
-                jsonResult += "\"distance\":" + to_string(pair.second[i].distance) + ",";
-                jsonResult += "\"fare\":" + to_string(pair.second[i].fare) + ",";
-                jsonResult += "\"bus\":\"" + pair.second[i].bus + "\"";
+                jsonResult += "\"to\":\"" + network.stopNames[network.edgeTargets[edge]] + "\",";
+                jsonResult += "\"distance\":" + to_string(network.edgeDistances[edge]) + ",";
+                jsonResult += "\"fare\":" + to_string(network.edgeFares[edge]) + ",";
+                jsonResult += "\"bus\":\"" + network.busNames[network.edgeBusIds[edge]] + "\"";
                 jsonResult += "}";
             }
 
@@ -551,18 +7755,39 @@ int main() {
         cout << "   To: " << toStop << endl;
         cout << "   Algorithm: " << algorithm << endl;
 
-        string result;
-
-        if (algorithm == "cheapest") {
-            result = busNetwork.findCheapestPath(fromStop, toStop);
+        RouteOptions options;
+        if (req.has_param("limit")) {
+            options.frontLimit = (uint32_t)max(1, min((int)MAX_PARETO_FRONT, atoi(req.get_param_value("limit").c_str())));
         }
-        else if (algorithm == "dfs") {
-            result = busNetwork.findAnyPath(fromStop, toStop);
+        if (req.has_param("penalty")) {
+            options.transferPenaltyKm = max(0.0, atof(req.get_param_value("penalty").c_str()));
         }
-        else {
-            result = busNetwork.findShortestPath(fromStop, toStop);
+        if (req.has_param("slack")) {
+            options.frontSlack = max(0.0, min(0.5, atof(req.get_param_value("slack").c_str())));
+        }
+        if (req.has_param("k")) {
+            options.pathCount = (uint32_t)max(1, min((int)MAX_KSHORTEST_PATHS, atoi(req.get_param_value("k").c_str())));
+        }
+        if (req.has_param("depart")) {
+            options.departSeconds = parseClockTime(req.get_param_value("depart"));
+            // Only an absent depart means "now"; a malformed one is rejected
+            if (options.departSeconds < 0) {
+                res.status = 400;
+                res.set_content("{\"found\":false,\"error\":\"depart must be HH:MM or HH:MM:SS\"}", "application/json");
+                return;
+            }
+        }
+        if (req.has_param("window")) {
+            options.windowMinutes = max(1, min(MAX_PROFILE_WINDOW_MINUTES, atoi(req.get_param_value("window").c_str())));
+        }
+        if (req.has_param("depth")) {
+            options.maxDepth = (uint32_t)max(0, atoi(req.get_param_value("depth").c_str()));
+        }
+        if (req.has_param("budget")) {
+            options.maxStops = (uint32_t)max(0, atoi(req.get_param_value("budget").c_str()));
         }
 
+        string result = findRoute(busNetwork, algorithm, fromStop, toStop, options);
         res.set_content(result, "application/json");
         });
 
@@ -599,10 +7824,13 @@ int main() {
     // Add stop
     server.Post("/addstop", [](const httplib::Request& req, httplib::Response& res) {
         string stopName = req.get_param_value("name");
+        double latitude = req.has_param("lat") ? stod(req.get_param_value("lat")) : NAN;
+        double longitude = req.has_param("lon") ? stod(req.get_param_value("lon")) : NAN;
         cout << "\n[API] POST /addstop - " << getCurrentTimestamp() << endl;
         cout << "   Adding: " << stopName << endl;
 
-        busNetwork.addStop(stopName);
+        busNetwork.addStop(stopName, latitude, longitude);
+        finishEdit(req);
         res.set_content("{\"success\":true,\"message\":\"Stop added successfully\"}", "application/json");
         });
 
@@ -617,9 +7845,122 @@ int main() {
         cout << "\n[API] POST /addroute - " << getCurrentTimestamp() << endl;
 
         busNetwork.addRoute(fromStop, toStop, distance, fare, busName);
+        finishEdit(req);
         res.set_content("{\"success\":true,\"message\":\"Route added successfully\"}", "application/json");
         });
 
+    // Update a route's fare without rebuilding the network
+    server.Post("/setfare", [](const httplib::Request& req, httplib::Response& res) {
+        string fromStop = req.get_param_value("from");
+        string toStop = req.get_param_value("to");
+        string busName = req.get_param_value("bus");
+        int fare = stoi(req.get_param_value("fare"));
+
+        cout << "\n[API] POST /setfare - " << getCurrentTimestamp() << endl;
+
+        if (busNetwork.updateFare(fromStop, toStop, busName, fare)) {
+            finishEdit(req);
+            res.set_content("{\"success\":true,\"message\":\"Fare updated successfully\"}", "application/json");
+        }
+        else {
+            res.set_content("{\"success\":false,\"message\":\"Route not found\"}", "application/json");
+        }
+        });
+
+    // Publish every batched edit now
+    server.Post("/commit", [](const httplib::Request&, httplib::Response& res) {
+        cout << "\n[API] POST /commit - " << getCurrentTimestamp() << endl;
+        uint64_t version = writeBatcher.flush();
+        res.set_content("{\"success\":true,\"version\":" + to_string(version) + "}", "application/json");
+        });
+
+    // Add a scheduled trip: stops and times (HH:MM, one per stop) are comma-separated
+    server.Post("/addtrip", [](const httplib::Request& req, httplib::Response& res) {
+        string busName = req.get_param_value("bus");
+        vector<string> stops;
+        vector<int> times;
+
+        string field;
+        stringstream stopList(req.get_param_value("stops"));
+        while (getline(stopList, field, ',')) {
+            stops.push_back(field);
+        }
+        stringstream timeList(req.get_param_value("times"));
+        while (getline(timeList, field, ',')) {
+            times.push_back(parseClockTime(field));
+        }
+
+        cout << "\n[API] POST /addtrip - " << getCurrentTimestamp() << endl;
+
+        if (find(times.begin(), times.end(), -1) != times.end()) {
+            res.status = 400;
+            res.set_content("{\"success\":false,\"message\":\"Times must be HH:MM or HH:MM:SS\"}", "application/json");
+            return;
+        }
+
+        if (busNetwork.addTrip(busName, stops, times, times)) {
+            finishEdit(req);
+            res.set_content("{\"success\":true,\"message\":\"Trip added successfully\"}", "application/json");
+        }
+        else {
+            res.set_content("{\"success\":false,\"message\":\"Stops and times do not form a valid trip\"}", "application/json");
+        }
+        });
+
+    // Bulk load stops and routes from a streamed CSV or NDJSON body, published
+    // as one new version once the whole body has been staged
+    server.Post("/import", [](const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& content_reader) {
+        cout << "\n[API] POST /import - " << getCurrentTimestamp() << endl;
+
+        ImportFormat format = parseImportFormat(req.get_param_value("format"), req.get_header_value("Content-Type"));
+        auto startTime = chrono::steady_clock::now();
+        ImportSummary summary;
+        {
+            NetworkImporter importer(busNetwork, format);
+            content_reader([&importer](const char* data, size_t length) {
+                importer.feed(data, length);
+                return true;
+                });
+            summary = importer.finish();
+        }
+        auto parsedTime = chrono::steady_clock::now();
+        uint64_t version = writeBatcher.flush();
+        double parseMs = chrono::duration<double, milli>(parsedTime - startTime).count();
+        double publishMs = chrono::duration<double, milli>(chrono::steady_clock::now() - parsedTime).count();
+
+        cout << "   Imported " << summary.stops << " stops and " << summary.routes << " routes in " << parseMs
+            << " ms, published version " << version << " in " << publishMs << " ms";
+        if (summary.errors > 0) {
+            cout << " (" << summary.errors << " bad records, first on line " << summary.firstErrorLine << ": " << summary.firstError << ")";
+        }
+        cout << endl;
+
+        string result = "{\"success\":";
+        result += summary.errors == 0 ? "true" : "false";
+        result += ",\"stops\":";
+        appendJsonNumber(result, (long long)summary.stops);
+        result += ",\"routes\":";
+        appendJsonNumber(result, (long long)summary.routes);
+        result += ",\"duplicateStops\":";
+        appendJsonNumber(result, (long long)summary.duplicateStops);
+        result += ",\"errors\":";
+        appendJsonNumber(result, (long long)summary.errors);
+        if (summary.errors > 0) {
+            result += ",\"firstErrorLine\":";
+            appendJsonNumber(result, (long long)summary.firstErrorLine);
+            result += ",\"firstError\":";
+            appendJsonString(result, summary.firstError);
+        }
+        result += ",\"version\":";
+        appendJsonNumber(result, (long long)version);
+        result += ",\"parseMs\":";
+        appendJsonNumber(result, parseMs);
+        result += ",\"publishMs\":";
+        appendJsonNumber(result, publishMs);
+        result += "}";
+        res.set_content(result, "application/json");
+        });
+
     // Health check
     server.Get("/health", [](const httplib::Request& req, httplib::Response& res) {
         string result = "{\"status\":\"healthy\",\"timestamp\":\"" + getCurrentTimestamp() + "\"}";
@@ -642,6 +7983,10 @@ int main() {
     cout << "   • GET  /buses       - List all buses                     " << endl;
     cout << "   • POST /addstop     - Add new stop                       " << endl;
     cout << "   • POST /addroute    - Add new route                      " << endl;
+    cout << "   • POST /setfare     - Change a route's fare              " << endl;
+    cout << "   • POST /addtrip     - Add a scheduled trip               " << endl;
+    cout << "   • POST /commit      - Publish batched edits now          " << endl;
+    cout << "   • POST /import      - Bulk load stops and routes         " << endl;
     cout << "   • GET  /health      - Server health check                " << endl;
     cout << "                                                            " << endl;
     cout << "   Press Ctrl+C to stop the server                          " << endl;